@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,9 +25,33 @@
 #include <sched.h>
 #include <getopt.h>
 #include <byteswap.h>
+#include <endian.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <net/if.h>
+#include <math.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_TSC 1
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #include <linux/rds.h>
+#include <linux/futex.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #include "pfhack.h"
 
@@ -45,14 +71,11 @@ struct rds_reset {
 /*
  *
  * TODO
- *  - checksum the data some day.
  *  - use poll to wait instead of blocking recvmsg?  doesn't seem great.
  *  - measure us/call of nonblocking recvmsg
  *  - do something about receiver congestion
  *  - notice when parent tcp socket dies
  *  - should the parent be at a higher priority?
- *  - catch ctl-c
- *  - final stats summary page
  */
 
 enum {
@@ -61,6 +84,7 @@ enum {
         M_RDMA_WRITE_ONLY
 };
 #define VERSION_MAX_LEN 16 
+#define DIST_SPEC_LEN	64
 
 struct options_2_0_6 {
 	uint32_t	req_depth;
@@ -123,38 +147,38 @@ struct options {
         uint32_t        connect_retries;
         uint8_t         tos;
         uint8_t         async;
+	uint32_t	rate;
+	uint32_t	backlog;
+	uint8_t		arrival;
+	uint32_t	size_seed;
+	char		req_dist[DIST_SPEC_LEN];
+	char		ack_dist[DIST_SPEC_LEN];
+	uint8_t		verify_mode;
+	uint32_t	verify_sample;
+	uint16_t	peer_port;	/* of the peer's first task, if not
+					 * starting_port; see --peers */
+	uint8_t		matrix;		/* more options may follow on the
+					 * control connection, see --matrix */
 } __attribute__((packed));
 
 
-#define MAX_BUCKETS 16
-
-static struct options	opt;
-static int		control_fd;
+/* every child thread has its own, see child_thread_main() */
+static __thread struct options opt;
 static uint64_t         rtt_threshold;
 static int              show_histogram;
 static int		reset_connection;
+static int		use_threads;
+static int		daemon_mode;
+static int		reuse_children;	/* park them after a run */
+static int		keep_control;	/* and the control connections */
+static unsigned int	batch_size;
+static unsigned int	uring_depth;
+static unsigned int	send_iov_nr;
+static unsigned int	recv_iov_nr;
+static int		poll_mode;
+static unsigned int	spin_budget;
 static char		peer_version[VERSION_MAX_LEN];
 
-static int get_bucket(uint64_t rtt_time)
-{
-  int i;
-  uint64_t l_rtt_time = rtt_time;
-
-  if (!l_rtt_time)
-    i = 0;
-  else
-  {
-    i = -1;
-    while (l_rtt_time)
-    {
-      i++;
-      l_rtt_time = (l_rtt_time >> 1);
-    }
-  }
-
-  return i;
-}
-
 struct counter {
 	uint64_t	nr;
 	uint64_t	sum;
@@ -171,13 +195,24 @@ enum {
 	S_RDMA_READ_BYTES,
 	S_MBUS_IN_BYTES,
 	S_MBUS_OUT_BYTES,
-	S_SENDMSG_USECS,
-	S_RTT_USECS,
+	S_SENDMSG_NSECS,
+	S_RTT_NSECS,
+	S_RECV_BATCH,
+	S_SEND_BATCH,
+	S_URING_SQES,
+	S_URING_CQES,
+	S_SPINS,
+	S_EMPTY_POLLS,
+	S_SEND_LAG_NSECS,
+	S_OL_DROPS,
 	S__LAST
 };
 
 #define NR_STATS S__LAST
 
+/* requests are also counted by size when a size distribution is used */
+#define MAX_SIZE_CLASSES	16
+
 /*
  * Parents share a mapped array of these with their children.  Each child
  * gets one.  It's used to communicate between the child and the parent
@@ -185,14 +220,60 @@ enum {
  */
 struct child_control {
 	pid_t pid;
-	int ready;
 	int stopping;
-	struct timeval start;
+	int terminate;		/* thread engine: leave run_child() */
+	int parked;		/* --daemon: between runs, -1 to retire */
+	int cpu;		/* placement chosen by the parent, or -1 */
+	int node;
+	int size_step;		/* --size-sweep: index of the current size */
+	uint16_t peer_port;	/* where the peer's tasks are, if it said */
+	uint64_t started_ns;	/* when the start gate let it go */
 	struct counter cur[NR_STATS];
 	struct counter last[NR_STATS];
-        uint64_t       latency_histogram[MAX_BUCKETS];
+	struct counter size_tx[MAX_SIZE_CLASSES];	/* request bytes */
+	struct counter size_rtt[MAX_SIZE_CLASSES];	/* nsecs */
+	uint64_t *hist;		/* hist_len RTT counts, past the array */
+	struct options run_opts;	/* the child's own, see --daemon */
 } __attribute__((aligned (256))); /* arbitrary */
 
+/*
+ * Past the end of the control array and the histograms. Children count
+ * themselves in as they get ready and wait for go to change, so the
+ * parent hears of each one as soon as it's there and releases them all
+ * with a single futex wakeup.
+ */
+struct start_gate {
+	int		nr_ready;
+	int		go;		/* bumped to start a run */
+	uint64_t	open_ns;	/* when it was */
+};
+
+static struct start_gate	*gate;
+static uint64_t			startup_ns;	/* until all were ready */
+
+/*
+ * --task-stats: past the gate, every child counts what it sent to each
+ * of its destinations, the round trips and the sends the destination
+ * refused with ENOBUFS. Child i has dest_stride entries, one per task.
+ */
+struct dest_stats {
+	uint64_t	req_tx;
+	uint64_t	rtt_nr;
+	uint64_t	rtt_sum;	/* nsecs */
+	uint64_t	congested;
+	uint32_t	addr;		/* network byte order */
+	uint16_t	port;
+};
+
+static unsigned int		task_stats;	/* rows of the top table */
+static struct dest_stats	*dest_stats;
+static uint16_t			dest_stride;
+
+static long futex(int *uaddr, int op, int val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
 struct soak_control {
 	pid_t		pid;
 	uint64_t	per_sec;
@@ -203,6 +284,85 @@ struct soak_control {
 
 void stop_soakers(struct soak_control *soak_arr);
 
+/*
+ * With --peers the active side negotiates with every peer in turn and
+ * starts --tasks children for each of them, which only talk to that
+ * peer. Each peer learns where its run of our children starts through
+ * peer_port. With --clients the passive side does the same for every
+ * active side that connects, each with its own options, and tells it
+ * where its children start in reply to its go. Either parent keeps the
+ * totals of each run from the start and the end of the test to report
+ * every peer.
+ */
+#define MAX_PEERS	256
+
+struct peer {
+	uint32_t	addr;		/* host byte order */
+	int		fd;		/* control connection */
+	uint16_t	first_task;	/* our children for this peer */
+	uint16_t	nr_tasks;
+	struct options	*opts;		/* a client's own, passive only */
+	struct counter	first[NR_STATS];
+	struct counter	last[NR_STATS];
+	uint64_t	*hist_first;
+	uint64_t	*hist_last;
+};
+
+static struct peer	*peers;
+static unsigned int	nr_peers;
+static unsigned int	nr_clients;
+
+static void peer_send(int fd, const void *ptr, size_t size);
+
+/* where the ports of the peer's tasks count from */
+static inline uint16_t peer_port(const struct options *opts)
+{
+	return opts->peer_port ? opts->peer_port : opts->starting_port;
+}
+
+/* the options of one child */
+static struct options *child_options(struct options *opts, uint16_t id,
+				     struct options *copy)
+{
+	struct peer *pr;
+
+	if (nr_peers <= 1)
+		return opts;
+	for (pr = peers; id >= pr->first_task + pr->nr_tasks; pr++)
+		;
+	if (pr->opts)
+		return pr->opts;
+	*copy = *opts;
+	copy->nr_tasks = pr->nr_tasks;
+	copy->send_addr = pr->addr;
+	return copy;
+}
+
+/* has one of the peers closed its control connection? */
+static int peer_hangup(int timeout)
+{
+	struct pollfd pfd[MAX_PEERS];
+	unsigned int p;
+
+	for (p = 0; p < nr_peers; p++) {
+		pfd[p].fd = peers[p].fd;
+		pfd[p].events = POLLIN|POLLHUP;
+	}
+	return poll(pfd, nr_peers, timeout) > 0;
+}
+
+/* children must not hold the control connections open */
+static void close_control(void)
+{
+	unsigned int p;
+
+	for (p = 0; p < nr_peers; p++) {
+		if (peers[p].fd >= 0)
+			close(peers[p].fd);
+		peers[p].fd = -1;
+	}
+}
+
 /*
  * Requests tend to be larger and we try to keep a certain number of them
  * in flight at a time.  Acks are sent in response to requests and tend
@@ -246,12 +406,39 @@ struct header {
 	uint8_t         rdma_remote_err;
 	uint8_t         pending;
 
+	/* Length of the whole message, which varies with --req-sizes */
+	uint32_t	size;
+	/* CRC32C of the payload in crc32c verify mode */
+	uint32_t	csum;
+	/* sender's pid, mixed into unique payloads */
+	uint32_t	pid;
+
 	uint8_t         data[0];
 } __attribute__((packed));
 
 #define MIN_MSG_BYTES		(sizeof(struct header))
 #define BASIC_HEADER_SIZE	(size_t)(&((struct header *) 0)->rdma_op)
 
+/*
+ * Peers before 2.0.8 end their header at pending, and 2.0.7 sent only
+ * the options up to async. 2.0.6 sent no version and stopped at
+ * connect_retries, see options_2_0_6.
+ */
+#define VERSION_2_0_7		"2.0.7"
+#define HEADER_2_0_7_SIZE	(size_t)(&((struct header *) 0)->size)
+#define OPTIONS_2_0_7_SIZE	(size_t)(&((struct options *) 0)->rate)
+
+/* the header a child and its peer exchange, see wire_hdr_len() */
+static __thread size_t hdr_len = sizeof(struct header);
+
+/* Only options sent in full say the peer knows the whole header */
+static size_t wire_hdr_len(const struct options *opts)
+{
+	if (strcmp(opts->version, RDS_VERSION))
+		return HEADER_2_0_7_SIZE;
+	return sizeof(struct header);
+}
+
 #define print_outlier(...) do {         \
         fprintf(stderr, __VA_ARGS__);   \
 } while (0)
@@ -267,7 +454,7 @@ struct header {
 	exit(1);						\
 } while (0)
 
-static int	mrs_allocated = 0;
+static __thread int mrs_allocated = 0;
 
 #define trace(fmt...) do {		\
 	if (opt.tracing)		\
@@ -299,6 +486,100 @@ static inline uint64_t minz(uint64_t a, uint64_t b)
 	return min(a, b);
 }
 
+/*
+ * RTT histograms, HDR style. Values are grouped by their power of two,
+ * and each group is split into enough linear sub-buckets to resolve
+ * hist_digits significant decimal digits. Anything past HIST_MAX_NSECS
+ * is counted in the last bucket. Every child records into its own
+ * array of hist_len counts in the child_control mapping.
+ */
+#define HIST_MAX_NSECS		(1ULL << 38)	/* ~275 seconds */
+#define HIST_LOG2_ROWS		16		/* --show-histogram table */
+
+static unsigned int	hist_digits;
+static unsigned int	hist_half_shift;	/* log2(sub-buckets / 2) */
+static unsigned int	hist_len;
+
+static void hist_init(void)
+{
+	uint64_t need = 2, range;
+	unsigned int i, buckets = 1;
+
+	for (i = 0; i < hist_digits; i++)
+		need *= 10;
+	for (i = 0; (1ULL << i) < need; i++)
+		;
+	hist_half_shift = i - 1;
+
+	for (range = 1ULL << i; range <= HIST_MAX_NSECS; range <<= 1)
+		buckets++;
+	hist_len = (buckets + 1) << hist_half_shift;
+}
+
+static inline unsigned int hist_index(uint64_t val)
+{
+	uint64_t mask = (2ULL << hist_half_shift) - 1;
+	unsigned int bucket, idx;
+
+	bucket = 63 - __builtin_clzll(val | mask) - hist_half_shift;
+	idx = (bucket << hist_half_shift) + (val >> bucket);
+	return min(idx, hist_len - 1);
+}
+
+/* highest value that is counted at idx */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int half = 1U << hist_half_shift;
+	int bucket = (idx >> hist_half_shift) - 1;
+	uint64_t sub = (idx & (half - 1)) + half;
+
+	if (bucket < 0) {
+		sub -= half;
+		bucket = 0;
+	}
+	return (sub << bucket) + (1ULL << bucket) - 1;
+}
+
+static uint64_t hist_total(const uint64_t *hist)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < hist_len; i++)
+		total += hist[i];
+	return total;
+}
+
+/* highest value counted, to within the histogram's precision */
+static uint64_t hist_max(const uint64_t *hist)
+{
+	unsigned int i;
+
+	for (i = hist_len; i-- > 0; ) {
+		if (hist[i])
+			return hist_value(i);
+	}
+	return 0;
+}
+
+/* the smallest value that pct percent of the samples don't exceed */
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+				double pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	want = (pct / 100.0) * total + 0.5;
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < hist_len; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return hist_value(i);
+	}
+	return hist_value(hist_len - 1);
+}
+
 static unsigned long long parse_ull(char *ptr, unsigned long long max)
 {
 	unsigned long long val;
@@ -371,6 +652,51 @@ static void usage(void)
 	" -V                trace execution\n"
 	" -z                print a summary at end of test only\n"
 	"\n"
+	"Children:\n"
+	" --threads                 run children as threads, not processes\n"
+	" --placement [how]         pin children: rr, compact or hca\n"
+	" --cpu-list [list]         only use these cpus, such as 0-3,8-11\n"
+	" --numa-node [node]        only use the cpus of this node\n"
+	" --batch [nr, 0]           recvmmsg() and sendmmsg() up to nr messages\n"
+	" --io-uring [nr, 0]        drive the socket through io_uring\n"
+	" --poll-mode [block]       block, spin or hybrid\n"
+	" --spin-budget [usecs, 50] how long hybrid spins after a receive\n"
+	" --send-iov [nr, 1]        split messages over up to nr iovecs (max 64)\n"
+	" --recv-iov [nr, 1]        receive into up to nr iovecs (max 64)\n"
+	"\n"
+	"Open loop:\n"
+	" --rate [msgs/sec]         send requests on a schedule, per peer\n"
+	" --arrival [const]         const or poisson gaps between requests\n"
+	" --backlog [nr, 1024]      requests a task may have outstanding\n"
+	"\n"
+	"Message sizes and verification:\n"
+	" --req-sizes [spec]        request sizes, such as 200:90,8K:10\n"
+	" --ack-sizes [spec]        ack sizes, in the same form\n"
+	" --size-seed [nr]          seed of the size distributions\n"
+	" --verify-mode [pattern]   pattern, crc32c or unique; implies -v\n"
+	" --verify-sample [nr, 1]   only verify one in nr messages\n"
+	" --size-sweep [list]       run each request size for -T seconds\n"
+	"\n"
+	"Several instances:\n"
+	" --peers [addr,...]        send to several passives instead of -s\n"
+	" --clients [nr, 1]         passive: serve nr active instances\n"
+	" --daemon                  passive: wait for the next test when done\n"
+	"\n"
+	"Sessions:\n"
+	" --matrix [axis=list;...]  run every combination, such as q=1K,16K;d=1,4\n"
+	" --matrix-format [csv]     csv or json\n"
+	" --search [rate|d|t=lo:hi] find the highest load that meets the --slo\n"
+	" --slo [pNN=usecs]         such as p99=50\n"
+	" --curve [lo:hi:step]      rtt against an offered rate, step or xF\n"
+	" --curve-data [file]       where --curve writes its data\n"
+	"\n"
+	"Measurement:\n"
+	" --clock [monotonic]       monotonic or tsc\n"
+	" --hist-digits [nr, 2]     significant digits of the rtt histograms\n"
+	" --steady-cv [percent, 10] measure once this steady, 0 for a fixed 2s\n"
+	" --warmup-max [secs, 10]   longest wait for a steady state\n"
+	" --task-stats [n]          per child and per destination statistics\n"
+	"\n"
 	"Example:\n"
 	"  recv$ rds-stress\n"
 	"  send$ rds-stress -s recv -q 4096 -t 2 -d 2\n"
@@ -402,6 +728,30 @@ static void check_parent(pid_t pid)
 		die("parent %u exited\n", pid);
 }
 
+/*
+ * A ctl-c during a run ends it the way -T would, summary and all. The
+ * children leave it to their parent, and a second ctl-c kills the
+ * parent outright.
+ */
+static volatile sig_atomic_t interrupted;
+
+static void interrupt(int sig)
+{
+	interrupted = 1;
+}
+
+static void catch_interrupts(int on)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on ? interrupt : SIG_DFL;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL))
+		die_errno("sigaction(SIGINT) failed");
+}
+
 /*
  * put a pattern in the message so the remote side can verify that it's
  * what was expected.
@@ -423,2306 +773,6666 @@ static void init_msg_pattern(struct options *opts)
 		msg_pattern[i] = k;
 }
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-#define htonll(x)	bswap_64(x)
-#define ntohll(x)	bswap_64(x)
-#else
-#define htonll(x)	(x)
-#define ntohll(x)	(x)
-#endif
+/*
+ * Payload verification. In pattern mode the receiver compares every
+ * payload against msg_pattern. In crc32c mode the sender puts a CRC32C
+ * of the payload into the header, and the receiver checks the payload
+ * without touching a reference copy. In unique mode every payload is a
+ * keystream derived from the sender, receiver and seq, which the sender
+ * writes instead of copying the pattern and the receiver regenerates
+ * while it compares, so a stale or replayed buffer can't pass. With
+ * --verify-sample N only
+ * messages whose seq is a multiple of N are filled and checked. The
+ * compare and checksum kernels are picked for the cpu at startup.
+ */
+enum {
+	VERIFY_PATTERN = 0,
+	VERIFY_CRC32C,
+	VERIFY_UNIQUE,
+};
 
-static void encode_hdr(struct header *dst, const struct header *hdr)
-{
-	memset(dst, 0, sizeof(*dst));
+static const char *verify_mode_names[] = {
+	[VERIFY_PATTERN]	= "pattern",
+	[VERIFY_CRC32C]		= "crc32c",
+	[VERIFY_UNIQUE]		= "unique",
+};
 
-	dst->seq = htonl(hdr->seq);
-	dst->from_addr = hdr->from_addr;	/* always network byte order */
-	dst->from_port = hdr->from_port;	/* ditto */
-	dst->to_addr = hdr->to_addr;		/* ditto */
-	dst->to_port = hdr->to_port;		/* ditto */
-	dst->index = htons(hdr->index);
-	dst->op = hdr->op;
+#define CRC32C_POLY	0x82f63b78	/* reflected */
 
-	dst->rdma_op = hdr->rdma_op;
-	dst->rdma_addr = htonll(hdr->rdma_addr);
-	dst->rdma_phyaddr = htonll(hdr->rdma_phyaddr);
-	dst->rdma_pattern = htonll(hdr->rdma_pattern);
-	dst->rdma_key = htonll(hdr->rdma_key);
-	dst->rdma_size = htonl(hdr->rdma_size);
-	dst->rdma_vector = htonl(hdr->rdma_vector);
-	dst->retry = hdr->retry;
-}
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_x2n[32];		/* x^(2^n) mod P */
 
-static void decode_hdr(struct header *dst, const struct header *hdr)
+/* a * b mod P, in the reflected bit order */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
 {
-	memset(dst, 0, sizeof(*dst));
-
-	dst->seq = ntohl(hdr->seq);
-	dst->from_addr = hdr->from_addr;	/* always network byte order */
-	dst->from_port = hdr->from_port;	/* ditto */
-	dst->to_addr = hdr->to_addr;		/* ditto */
-	dst->to_port = hdr->to_port;		/* ditto */
-	dst->index = ntohs(hdr->index);
-	dst->op = hdr->op;
+	uint32_t m = 1U << 31, p = 0;
 
-	dst->rdma_op = hdr->rdma_op;
-	dst->rdma_addr = ntohll(hdr->rdma_addr);
-	dst->rdma_phyaddr = ntohll(hdr->rdma_phyaddr);
-	dst->rdma_pattern = ntohll(hdr->rdma_pattern);
-	dst->rdma_key = ntohll(hdr->rdma_key);
-	dst->rdma_size = ntohl(hdr->rdma_size);
-	dst->rdma_vector = ntohl(hdr->rdma_vector);
-	dst->retry = hdr->retry;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
 }
 
-static void fill_hdr(void *message, uint32_t bytes, struct header *hdr)
+/*
+ * The CRC register after feeding len zero bytes into crc. Since the
+ * CRC is linear, crc(A B) = crc32c_shift(crc(A), len(B)) ^ crc(B) when
+ * B is checksummed from zero, which lets us run independent streams.
+ */
+static uint32_t crc32c_shift(uint32_t crc, size_t len)
 {
-	encode_hdr(message, hdr);
-	if (opt.verify)
-		memcpy(message + sizeof(*hdr), msg_pattern, bytes - sizeof(*hdr));
+	uint32_t p = 1U << 31;		/* x^0 */
+	unsigned int k;
+
+	for (k = 3; len; len >>= 1, k++) {
+		if (len & 1)
+			p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+	}
+	return crc32c_multmodp(p, crc);
 }
 
-/* inet_ntoa uses a static buffer, so calling it twice in
- * a single printf as we do below will produce undefined
- * results. We copy the output to two static buffers,
- * and switch between them.
- */
-static char *inet_ntoa_32(uint32_t val)
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
 {
-	struct in_addr addr = { .s_addr = val };
-	static char buffer[2][64];
-	static unsigned int select = 0;
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
 
-	select = 1 - select;
-	strncpy(buffer[select], inet_ntoa(addr), 63);
+/* offset of the first byte that differs, or len */
+static size_t mismatch_sw(const unsigned char *a, const unsigned char *b,
+			  size_t len)
+{
+	size_t i;
 
-	return buffer[select];
+	if (!memcmp(a, b, len))
+		return len;
+	for (i = 0; a[i] == b[i]; i++)
+		;
+	return i;
 }
 
 /*
- * Compare incoming message header with expected header. All header fields
- * are in host byte order except for address and port fields.
+ * The unique payload generator: the n-th 32 bit little endian word of
+ * a payload is fmix32(seed + n * PAYLOAD_STEP), the murmur3 finalizer
+ * run on a counter. Being counter based, any word can be computed on
+ * its own, which keeps the vector kernels simple.
  */
-static int check_hdr(void *message, uint32_t bytes, struct header *hdr, struct options *opts)
-{
-	struct header msghdr;
-	uint32_t	inc_seq;
-	uint32_t	my_seq;
-
-	decode_hdr(&msghdr, message);
-	inc_seq = msghdr.seq;
-	my_seq = hdr->seq;
-
-	if (msghdr.retry && (inc_seq < my_seq))
-		return -1;
+#define PAYLOAD_STEP	0x9e3779b9
 
-	if (memcmp(&msghdr, hdr, BASIC_HEADER_SIZE)) {
-#define bleh(var, disp)					\
-		disp(hdr->var),				\
-		msghdr.var == hdr->var ? " =" : "!=",	\
-		disp(msghdr.var)
+static inline uint32_t fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
 
-		/*
-		 * This is printed as one GIANT printf() so that it serializes
-		 * with stdout() and we don't get things stomping on each
-		 * other
-		 */
-		printf( "An incoming message had a %s header which\n"
-			"didn't contain the fields we expected:\n"
-			"    member        expected eq             got\n"
-			"       seq %15u %s %15u\n"
-			" from_addr %15s %s %15s\n"
-			" from_port %15u %s %15u\n"
-			"   to_addr %15s %s %15s\n"
-			"   to_port %15u %s %15u\n"
-			"     index %15u %s %15u\n"
-			"        op %15u %s %15u\n",
-			(msghdr.retry) ? "RETRY" : "",
-			bleh(seq, /**/),
-			bleh(from_addr, inet_ntoa_32),
-			bleh(from_port, ntohs),
-			bleh(to_addr, inet_ntoa_32),
-			bleh(to_port, ntohs),
-			bleh(index, /**/),
-			bleh(op, /**/));
-#undef bleh
+static void unique_fill_sw(unsigned char *p, size_t len, uint32_t ctr)
+{
+	uint32_t w;
+	size_t i;
 
-		return 1;
+	for (i = 0; i < len; i += 4, ctr += PAYLOAD_STEP) {
+		w = htole32(fmix32(ctr));
+		memcpy(p + i, &w, min(len - i, 4));
 	}
+}
 
-	if (opt.verify
-	 && memcmp(message + sizeof(*hdr), msg_pattern, bytes - sizeof(*hdr))) {
-		unsigned char *p = message + sizeof(*hdr);
-		unsigned int i, count = 0, total = bytes - sizeof(*hdr);
-		int offset = -1;
-
-		for (i = 0; i < total; ++i) {
-			if (p[i] != msg_pattern[i]) {
-				if (offset < 0)
-					offset = i;
-				count++;
-			}
+static size_t unique_mismatch_sw(const unsigned char *p, size_t len,
+				 uint32_t ctr)
+{
+	unsigned char w[4];
+	uint32_t v;
+	size_t i, k;
+
+	for (i = 0; i < len; i += 4, ctr += PAYLOAD_STEP) {
+		v = htole32(fmix32(ctr));
+		memcpy(w, &v, 4);
+		for (k = 0; k < 4 && i + k < len; k++) {
+			if (p[i + k] != w[k])
+				return i + k;
 		}
-
-		printf("An incoming message has a corrupted payload at offset %u; "
-				"%u out of %u bytes corrupted\n",
-				offset, count, total);
-		return 1;
 	}
+	return len;
+}
 
-	return 0;
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static inline __m256i fmix32_avx2(__m256i h)
+{
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85ebca6b));
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xc2b2ae35));
+	return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
 }
 
-void stat_inc(struct counter *ctr, uint64_t val)
+__attribute__((target("avx2")))
+static inline __m256i unique_ctr_avx2(uint32_t ctr)
 {
-	ctr->nr++;
-	ctr->sum += val;
-	ctr->min = minz(val, ctr->min);
-	ctr->max = max(val, ctr->max);
+	return _mm256_add_epi32(_mm256_set1_epi32(ctr),
+			_mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+					   _mm256_set1_epi32(PAYLOAD_STEP)));
 }
 
-int64_t tv_cmp(const struct timeval *a, const struct timeval *b)
+__attribute__((target("avx2")))
+static void unique_fill_avx2(unsigned char *p, size_t len, uint32_t ctr)
 {
-	int64_t a_usecs = ((uint64_t)a->tv_sec * 1000000ULL) + a->tv_usec;
-	int64_t b_usecs = ((uint64_t)b->tv_sec * 1000000ULL) + b->tv_usec;
+	__m256i c = unique_ctr_avx2(ctr);
+	__m256i step = _mm256_set1_epi32(8 * PAYLOAD_STEP);
+	size_t i;
 
-	return a_usecs - b_usecs;
+	for (i = 0; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *) (p + i), fmix32_avx2(c));
+		c = _mm256_add_epi32(c, step);
+	}
+	unique_fill_sw(p + i, len - i, ctr + (i / 4) * PAYLOAD_STEP);
 }
 
-/* returns a - b in usecs */
-uint64_t usec_sub(struct timeval *a, struct timeval *b)
+__attribute__((target("avx2")))
+static size_t unique_mismatch_avx2(const unsigned char *p, size_t len,
+				   uint32_t ctr)
 {
-	return ((uint64_t)(a->tv_sec - b->tv_sec) * 1000000ULL) +
-		a->tv_usec - b->tv_usec;
+	__m256i c = unique_ctr_avx2(ctr);
+	__m256i step = _mm256_set1_epi32(8 * PAYLOAD_STEP);
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *) (p + i)),
+				fmix32_avx2(c)));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+		c = _mm256_add_epi32(c, step);
+	}
+	return i + unique_mismatch_sw(p + i, len - i,
+				      ctr + (i / 4) * PAYLOAD_STEP);
 }
 
-static int bound_socket(int domain, int type, int protocol,
-			struct sockaddr_in *sin)
+/*
+ * The crc32 instruction has a latency of three cycles but can start one
+ * every cycle, so larger buffers are split into three streams that are
+ * merged at the end.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
 {
-	int fd;
-	int sockopt;
+	uint64_t c = crc, c1 = 0, c2 = 0, v0, v1, v2;
+	size_t i, third;
+
+	if (len >= 1024) {
+		third = (len / 3) & ~7UL;
+		for (i = 0; i < third; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + third + i, 8);
+			memcpy(&v2, p + 2 * third + i, 8);
+			c = _mm_crc32_u64(c, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+		}
+		c = crc32c_shift(c, third) ^ c1;
+		c = crc32c_shift(c, third) ^ c2;
+		p += 3 * third;
+		len -= 3 * third;
+	}
 
-	fd = socket(domain, type, protocol);
-	if (fd < 0)
-		die_errno("socket(%d, %d, %d) failed", domain, type, protocol);
-
-	sockopt = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt)))
-		die_errno("setsockopt(SO_REUSEADDR) failed");
-
-	if (bind(fd, (struct sockaddr *)sin, sizeof(struct sockaddr_in)))
-		die_errno("bind() failed");
-
-	return fd;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v0, p, 8);
+		c = _mm_crc32_u64(c, v0);
+	}
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
 }
 
-static uint32_t get_local_address(int fd, struct sockaddr_in *sin)
+static size_t mismatch_sse2(const unsigned char *a, const unsigned char *b,
+			    size_t len)
 {
-	socklen_t alen = sizeof(*sin);
-
-	if (getsockname(fd, (struct sockaddr *) sin, &alen))
-		die_errno("getsockname failed");
-	return ntohl(sin->sin_addr.s_addr);
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *) (a + i)),
+				_mm_loadu_si128((const __m128i *) (b + i))));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+	for (; i < len; i++) {
+		if (a[i] != b[i])
+			return i;
+	}
+	return len;
 }
 
-static int rds_socket(struct options *opts, struct sockaddr_in *sin)
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const unsigned char *a, const unsigned char *b,
+			    size_t len)
 {
-	int bytes;
-	int fd;
-	int val;
-	socklen_t optlen;
-
-	fd = bound_socket(pf, SOCK_SEQPACKET, 0, sin);
-
-	bytes = opts->nr_tasks * opts->req_depth *
-		(opts->req_size + opts->ack_size) * 2;
-
-	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)))
-		die_errno("setsockopt(SNDBUF, %d) failed", bytes);
-	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)))
-		die_errno("setsockopt(RCVBUF, %d) failed", bytes);
-
-	optlen = sizeof(val);
-	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, &optlen))
-		die_errno("getsockopt(SNDBUF) failed");
-	if (val / 2 < bytes && !opts->suppress_warnings)
-		fprintf(stderr,
-			"getsockopt(SNDBUF) returned %d, we wanted %d * 2\n",
-			val, bytes);
-
-	optlen = sizeof(val);
-	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, &optlen))
-		die_errno("getsockopt(RCVBUF) failed");
-	if (val / 2 < bytes && !opts->suppress_warnings)
-		fprintf(stderr,
-			"getsockopt(RCVBUF) returned %d, we need %d * 2\n",
-			val, bytes);
-
-	val = 1;
-	if (opts->use_cong_monitor
-	 && setsockopt(fd, sol, RDS_CONG_MONITOR, &val, sizeof(val))) {
-		if (errno != ENOPROTOOPT)
-			die_errno("setsockopt(RDS_CONG_MONITOR) failed");
-		printf("Kernel does not support congestion monitoring; disabled\n");
-		opts->use_cong_monitor = 0;
+	__m256i d0, d1;
+	unsigned int mask;
+	size_t i;
+
+	/* 64 bytes per pass until something differs */
+	for (i = 0; i + 64 <= len; i += 64) {
+		d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+				      _mm256_loadu_si256((const __m256i *) (b + i)));
+		d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i + 32)),
+				      _mm256_loadu_si256((const __m256i *) (b + i + 32)));
+		d0 = _mm256_or_si256(d0, d1);
+		if (!_mm256_testz_si256(d0, d0))
+			break;
 	}
-
-	fcntl(fd, F_SETFL, O_NONBLOCK);
-
-	return fd;
+	for (; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *) (a + i)),
+				_mm256_loadu_si256((const __m256i *) (b + i))));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + mismatch_sse2(a + i, b + i, len - i);
 }
+#endif
 
-static int check_rdma_support(struct options *opts)
-{
-	struct sockaddr_in sin;
-	struct rds_free_mr_args args;
-	int fd, okay = 0;
-
-	/* We need a local address to bind to. If the user
-	 * didn't specify the -r option, we tell him to go on for
-	 * now - he'll call back once more later. */
-	if (opts->receive_addr == 0)
-		return 1;
-
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opts->starting_port);
-	sin.sin_addr.s_addr = htonl(opts->receive_addr);
-
-	fd = bound_socket(pf, SOCK_SEQPACKET, 0, &sin);
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t) =
+	crc32c_sw;
+static size_t (*payload_mismatch)(const unsigned char *,
+				  const unsigned char *, size_t) = mismatch_sw;
+static void (*unique_fill)(unsigned char *, size_t, uint32_t) = unique_fill_sw;
+static size_t (*unique_mismatch)(const unsigned char *, size_t, uint32_t) =
+	unique_mismatch_sw;
 
-	memset(&args, 0, sizeof(args));
-	if (setsockopt(fd, sol, RDS_FREE_MR, &args, sizeof(args)) >= 0) {
-		okay = 1;
-	} else if (errno == ENOPROTOOPT) {
-		okay = 0;
-	} else {
-		die_errno("%s: RDS_FREE_MR failed with unexpected error",
-				__FUNCTION__);
+static void verify_init(void)
+{
+	uint32_t crc;
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		crc32c_table[i] = crc;
 	}
-	close(fd);
-
-	return okay;
+	crc32c_x2n[0] = 1U << 30;	/* x^1 */
+	for (i = 1; i < 32; i++)
+		crc32c_x2n[i] = crc32c_multmodp(crc32c_x2n[i - 1],
+						crc32c_x2n[i - 1]);
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_update = crc32c_sse42;
+	if (__builtin_cpu_supports("avx2")) {
+		payload_mismatch = mismatch_avx2;
+		unique_fill = unique_fill_avx2;
+		unique_mismatch = unique_mismatch_avx2;
+	} else
+		payload_mismatch = mismatch_sse2;
+#endif
 }
 
-static uint64_t get_rdma_key(int fd, uint64_t addr, uint32_t size)
+static inline uint32_t crc32c(const unsigned char *p, size_t len)
 {
-	uint64_t cookie = 0;
-	struct rds_get_mr_args mr_args;
+	return ~crc32c_update(~0U, p, len);
+}
 
-	mr_args.vec.addr = addr;
-	mr_args.vec.bytes = size;
-	mr_args.cookie_addr = ptr64(&cookie);
-	mr_args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
-	if (opt.rdma_use_once)
-		mr_args.flags |= RDS_RDMA_USE_ONCE;
+/*
+ * Senders fill payloads from msg_pattern, so their checksum only depends
+ * on the length. Remember the last one.
+ */
+static uint32_t pattern_crc32c(size_t len)
+{
+	static __thread size_t last_len = ~0UL;
+	static __thread uint32_t last_csum;
 
-	if (setsockopt(fd, sol, RDS_GET_MR, &mr_args, sizeof(mr_args)))
-		die_errno("setsockopt(RDS_GET_MR) failed (%u allocated)", mrs_allocated);
+	if (len != last_len) {
+		last_csum = crc32c(msg_pattern, len);
+		last_len = len;
+	}
+	return last_csum;
+}
 
-	trace("RDS get_rdma_key() = %Lx\n",
-				(unsigned long long) cookie);
+static __thread uint32_t payload_pid;
 
-	mrs_allocated++;
-	return cookie;
+/* ports are in network byte order, the same on both sides */
+static uint32_t unique_seed(const struct header *hdr)
+{
+	return fmix32(hdr->seq ^ fmix32(hdr->pid ^
+			fmix32((uint32_t) hdr->from_port << 16 | hdr->to_port)));
 }
 
-static void free_rdma_key(int fd, uint64_t key)
+static inline int verify_this(uint32_t seq)
 {
-	struct rds_free_mr_args mr_args;
-
-	trace("RDS free_rdma_key(%Lx)\n", (unsigned long long) key);
-
-	mr_args.cookie = key;
-#if 1
-	mr_args.flags = 0;
-#else
-	mr_args.flags = RDS_FREE_MR_ARGS_INVALIDATE;
-#endif
-	if (setsockopt(fd, sol, RDS_FREE_MR, &mr_args, sizeof(mr_args)))
-		return;
-	mrs_allocated--;
+	return opt.verify && (opt.verify_sample <= 1 ||
+			      seq % opt.verify_sample == 0);
 }
 
 /*
- * RDMA key-o-meter. We track how frequently the kernel
- * re-issues R_Keys
- *
- * The key_o_meter data structures are shared between the processes
- * without any locking. We don't care much for locking here...
+ * Message size distributions. A spec is either a weighted list of sizes
+ * ("200:90,8K:10"), "uniform:MIN,MAX" or "lognormal:MEDIAN,SIGMA,MAX".
+ * Without one every message has the fixed -q or -a size. Requests are
+ * counted per size class: one per listed size, or power of two ranges
+ * starting at the smallest size for the other two.
  */
-#define RDMA_MAX_TRACKED_KEYS	(32*1024)
-struct rdma_key_stamp {
-	uint32_t	r_key;
-	struct timeval	issued;
-};
-struct rdma_key_trace {
-	uint32_t	count, max;
-	struct rdma_key_stamp *entry;
+enum {
+	DIST_FIXED = 0,
+	DIST_WEIGHTED,
+	DIST_UNIFORM,
+	DIST_LOGNORMAL,
+	DIST_SWEEP,		/* one size after the other, see --size-sweep */
 };
-struct rdma_key_o_meter {
-	struct rdma_key_trace *current;
-	struct rdma_key_trace *idle;
+
+struct size_dist {
+	int		type;
+	uint32_t	min;
+	uint32_t	max;
+	unsigned int	nr;			/* weighted list entries */
+	uint32_t	size[MAX_SIZE_CLASSES];
+	double		cum[MAX_SIZE_CLASSES];	/* cumulative weight, up to 1 */
+	double		mu;			/* log of the lognormal median */
+	double		sigma;
 };
-static struct rdma_key_o_meter *rdma_key_o_meter;
-static unsigned int rdma_key_task;
 
-static void rdma_key_o_meter_init(unsigned int nr_tasks)
+static struct size_dist	req_sizes;
+static struct size_dist	ack_sizes;
+
+/* every child draws its own stream from the negotiated seed */
+static __thread unsigned short size_rand[3];
+/* the sweep step the parent has us at */
+static __thread volatile int *sweep_step;
+
+static void parse_size_dist(struct size_dist *d, const char *spec,
+			    uint32_t fixed, const char *option)
 {
-	struct rdma_key_trace *kt;
-	struct rdma_key_stamp *ks;
-	uint32_t max;
-	unsigned int i, size;
-	void *base;
+	char buf[DIST_SPEC_LEN], *str, *tok, *next, *weight;
+	double total = 0;
+	unsigned int i;
 
-	size = sizeof(struct rdma_key_o_meter)
-			+ 2 * nr_tasks * sizeof(*kt)
-			+ 2 * RDMA_MAX_TRACKED_KEYS * sizeof(*ks);
-	base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_SHARED, 0, 0);
-	if (base == MAP_FAILED)
-		die_errno("alloc_rdma_buffers: mmap failed");
+	memset(d, 0, sizeof(*d));
+	d->min = d->max = fixed;
+	if (!spec[0])
+		return;
 
-	rdma_key_o_meter = (struct rdma_key_o_meter *) base;
-	base = rdma_key_o_meter + 1;
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	if (!strncmp(buf, "uniform:", 8)) {
+		str = buf + 8;
+		next = strchr(str, ',');
+		if (!next)
+			die("%s: expected uniform:MIN,MAX\n", option);
+		*next++ = '\0';
+		d->type = DIST_UNIFORM;
+		d->min = parse_ull(str, (uint32_t)~0);
+		d->max = parse_ull(next, (uint32_t)~0);
+	} else if (!strncmp(buf, "lognormal:", 10)) {
+		str = buf + 10;
+		weight = strchr(str, ',');
+		next = weight ? strchr(weight + 1, ',') : NULL;
+		if (!next)
+			die("%s: expected lognormal:MEDIAN,SIGMA,MAX\n", option);
+		*weight++ = '\0';
+		*next++ = '\0';
+		d->type = DIST_LOGNORMAL;
+		d->mu = log(parse_ull(str, (uint32_t)~0));
+		d->sigma = strtod(weight, &tok);
+		if (*tok || d->sigma < 0)
+			die("%s: invalid sigma '%s'\n", option, weight);
+		d->min = MIN_MSG_BYTES;
+		d->max = parse_ull(next, (uint32_t)~0);
+		if (d->mu > log(d->max))
+			die("%s: median is larger than the maximum\n", option);
+	} else {
+		d->type = DIST_WEIGHTED;
+		str = buf;
+		if (!strncmp(buf, "sweep:", 6)) {
+			d->type = DIST_SWEEP;
+			str += 6;
+		}
+		d->min = ~0;
+		d->max = 0;
+		for (; str; str = next) {
+			next = strchr(str, ',');
+			if (next)
+				*next++ = '\0';
+			weight = strchr(str, ':');
+			if (weight)
+				*weight++ = '\0';
+			if (weight && d->type == DIST_SWEEP)
+				die("%s: sweep sizes have no weights\n", option);
+
+			if (d->nr == MAX_SIZE_CLASSES)
+				die("%s: at most %u sizes\n", option,
+				    MAX_SIZE_CLASSES);
+			d->size[d->nr] = parse_ull(str, (uint32_t)~0);
+			for (i = 0; i < d->nr; i++) {
+				if (d->size[i] == d->size[d->nr])
+					die("%s: size %u is listed twice\n",
+					    option, d->size[i]);
+			}
+			total += weight ? parse_ull(weight, (uint32_t)~0) : 1;
+			d->cum[d->nr] = total;
+			d->min = min(d->min, d->size[d->nr]);
+			d->max = max(d->max, d->size[d->nr]);
+			d->nr++;
+		}
+		if (total == 0)
+			die("%s: all weights are zero\n", option);
+		for (i = 0; i < d->nr; i++)
+			d->cum[i] /= total;
+	}
 
-	rdma_key_o_meter->current = (struct rdma_key_trace *) base;
-	base = rdma_key_o_meter->current + nr_tasks;
+	if (d->min < MIN_MSG_BYTES)
+		die("%s: sizes must be at least %u bytes\n", option,
+		    (unsigned int) MIN_MSG_BYTES);
+	if (d->min > d->max)
+		die("%s: minimum is larger than the maximum\n", option);
+}
 
-	rdma_key_o_meter->idle = (struct rdma_key_trace *) base;
-	base = rdma_key_o_meter->idle + nr_tasks;
+static uint32_t pick_size(const struct size_dist *d)
+{
+	double u, z;
+	unsigned int i;
 
-	ks = (struct rdma_key_stamp *) base;
-	max = RDMA_MAX_TRACKED_KEYS / nr_tasks;
-	for (i = 0, kt = rdma_key_o_meter->current; i < 2 * nr_tasks; ++i, ++kt) {
-		kt->count = 0;
-		kt->max = max;
-		kt->entry = ks + i * max;
+	switch (d->type) {
+	case DIST_SWEEP:
+		return d->size[*sweep_step];
+	case DIST_WEIGHTED:
+		u = erand48(size_rand);
+		for (i = 0; i < d->nr - 1 && u >= d->cum[i]; i++)
+			;
+		return d->size[i];
+	case DIST_UNIFORM:
+		return min(d->min + (uint64_t) (erand48(size_rand) *
+				(d->max - d->min + 1.0)), d->max);
+	case DIST_LOGNORMAL:
+		/* Box-Muller */
+		u = 1.0 - erand48(size_rand);
+		z = sqrt(-2.0 * log(u)) * cos(2 * M_PI * erand48(size_rand));
+		u = exp(d->mu + d->sigma * z);
+		if (u < d->min)
+			return d->min;
+		if (u > d->max)
+			return d->max;
+		return u;
 	}
+	return d->min;
 }
 
-/* This is called in the child process to set the index of
- * the key-o-meter to use */
-static void rdma_key_o_meter_set_self(unsigned int task_idx)
+static unsigned int size_class(const struct size_dist *d, uint32_t size)
 {
-	rdma_key_task = task_idx;
+	unsigned int i;
+
+	switch (d->type) {
+	case DIST_WEIGHTED:
+	case DIST_SWEEP:
+		for (i = 0; i < d->nr - 1 && d->size[i] != size; i++)
+			;
+		return i;
+	case DIST_UNIFORM:
+	case DIST_LOGNORMAL:
+		i = (31 - __builtin_clz(size)) - (31 - __builtin_clz(d->min));
+		return min(i, MAX_SIZE_CLASSES - 1);
+	}
+	return 0;
 }
 
-static void rdma_key_o_meter_add(uint32_t key)
+static void check_msg_size(const struct size_dist *d, ssize_t bytes,
+			   const char *what)
 {
-	struct rdma_key_trace *kt;
+	unsigned int i;
 
-	if (!rdma_key_o_meter)
+	if (d->type == DIST_FIXED) {
+		if (bytes != d->min)
+			die("%s size %zd, not %u\n", what, bytes, d->min);
 		return;
-
-	kt = &rdma_key_o_meter->current[rdma_key_task];
-	if (kt->count < kt->max) {
-		kt->entry[kt->count].r_key = key;
-		gettimeofday(&kt->entry[kt->count].issued, NULL);
-		kt->count++;
+	}
+	if (bytes < d->min || bytes > d->max)
+		die("%s size %zd, not between %u and %u\n", what, bytes,
+		    d->min, d->max);
+	if (d->type == DIST_WEIGHTED || d->type == DIST_SWEEP) {
+		for (i = 0; i < d->nr; i++) {
+			if (d->size[i] == bytes)
+				return;
+		}
+		die("%s size %zd is not one of the listed sizes\n", what, bytes);
 	}
 }
 
-static int rdma_key_stamp_compare(const void *p1, const void *p2)
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define htonll(x)	bswap_64(x)
+#define ntohll(x)	bswap_64(x)
+#else
+#define htonll(x)	(x)
+#define ntohll(x)	(x)
+#endif
+
+/* This writes every field, as dst is usually a reused send slot */
+static void encode_hdr(struct header *dst, const struct header *hdr)
 {
-	const struct rdma_key_stamp *ks1 = p1, *ks2 = p2;
+	dst->seq = htonl(hdr->seq);
+	dst->from_addr = hdr->from_addr;	/* always network byte order */
+	dst->from_port = hdr->from_port;	/* ditto */
+	dst->to_addr = hdr->to_addr;		/* ditto */
+	dst->to_port = hdr->to_port;		/* ditto */
+	dst->index = htons(hdr->index);
+	dst->op = hdr->op;
 
-	if (ks1->r_key < ks2->r_key)
-		return -1;
-	if (ks1->r_key > ks2->r_key)
-		return 1;
-	return tv_cmp(&ks1->issued, &ks2->issued);
+	dst->rdma_op = hdr->rdma_op;
+	dst->rdma_addr = htonll(hdr->rdma_addr);
+	dst->rdma_phyaddr = htonll(hdr->rdma_phyaddr);
+	dst->rdma_pattern = htonll(hdr->rdma_pattern);
+	dst->rdma_key = htonll(hdr->rdma_key);
+	dst->rdma_size = htonl(hdr->rdma_size);
+	dst->rdma_vector = htonl(hdr->rdma_vector);
+	dst->retry = hdr->retry;
+	dst->rdma_remote_err = 0;
+	dst->pending = 0;
+	if (hdr_len == HEADER_2_0_7_SIZE)
+		return;			/* the payload starts here */
+	dst->size = htonl(hdr->size);
+	dst->csum = htonl(hdr->csum);
+	dst->pid = htonl(hdr->pid);
 }
 
-static void rdma_key_o_meter_check(unsigned int nr_tasks)
+static void decode_hdr(struct header *dst, const struct header *hdr)
 {
-	struct rdma_key_stamp *ks, sorted[RDMA_MAX_TRACKED_KEYS];
-	struct rdma_key_trace *kt;
-	unsigned int i, j, count = 0;
-	unsigned int reissued = 0;
-	double min_elapsed = 0, avg_elapsed = 0;
+	memset(dst, 0, sizeof(*dst));
 
-	if (!rdma_key_o_meter)
-		return;
+	dst->seq = ntohl(hdr->seq);
+	dst->from_addr = hdr->from_addr;	/* always network byte order */
+	dst->from_port = hdr->from_port;	/* ditto */
+	dst->to_addr = hdr->to_addr;		/* ditto */
+	dst->to_port = hdr->to_port;		/* ditto */
+	dst->index = ntohs(hdr->index);
+	dst->op = hdr->op;
 
-	/* Extract keys from all tasks and sort them. */
-	kt = rdma_key_o_meter->idle;
-	for (i = 0; i < nr_tasks; ++i, ++kt) {
-		ks = kt->entry;
-
-		for (j = 0; j < kt->count; ++j)
-			sorted[count++] = *ks++;
-		kt->count = 0;
-	}
-	qsort(sorted, count, sizeof(*sorted), rdma_key_stamp_compare);
+	dst->rdma_op = hdr->rdma_op;
+	dst->rdma_addr = ntohll(hdr->rdma_addr);
+	dst->rdma_phyaddr = ntohll(hdr->rdma_phyaddr);
+	dst->rdma_pattern = ntohll(hdr->rdma_pattern);
+	dst->rdma_key = ntohll(hdr->rdma_key);
+	dst->rdma_size = ntohl(hdr->rdma_size);
+	dst->rdma_vector = ntohl(hdr->rdma_vector);
+	dst->retry = hdr->retry;
+	if (hdr_len == HEADER_2_0_7_SIZE)
+		return;
+	dst->size = ntohl(hdr->size);
+	dst->csum = ntohl(hdr->csum);
+	dst->pid = ntohl(hdr->pid);
+}
 
-	/* Now see how many were reissued */
-	ks = sorted;
-	for (i = 0; i + 1 < count; ++i, ++ks) {
-		double elapsed;
+/*
+ * A message may be scattered over several iovecs, see msg_segments().
+ * The first one starts with the header and all but the last hold a
+ * multiple of 64 payload bytes, so unique payload words never straddle
+ * two of them. This returns the payload in iovec k, which starts at
+ * payload offset off, trimmed to the total payload length.
+ */
+static unsigned char *payload_seg(const struct iovec *iov, unsigned int k,
+				  size_t off, size_t total, size_t *len)
+{
+	unsigned char *p = iov[k].iov_base;
+	size_t room = iov[k].iov_len;
 
-		if (ks[0].r_key != ks[1].r_key)
-			continue;
-		elapsed = 1e-6 * usec_sub(&ks[1].issued, &ks[0].issued);
-		if (reissued == 0 || elapsed < min_elapsed)
-			min_elapsed = elapsed;
-		avg_elapsed += elapsed;
+	if (k == 0) {
+		p += hdr_len;
+		room -= hdr_len;
 	}
+	*len = min(room, total - off);
+	return p;
+}
 
-	if (reissued)
-		printf(" *** %u R_Keys were re-issued; min distance=%f sec, avg distance=%f sec\n",
-				reissued, min_elapsed, avg_elapsed / reissued);
-
-	/* Swap current and idle */
-	kt = rdma_key_o_meter->current;
-	rdma_key_o_meter->current = rdma_key_o_meter->idle;
-	rdma_key_o_meter->idle = kt;
+static void fill_hdr(const struct iovec *iov, uint32_t bytes, struct header *hdr)
+{
+	size_t off, len, total = bytes - hdr_len;
+	unsigned char *p;
+	unsigned int k;
+
+	hdr->size = bytes;
+	hdr->csum = 0;
+	hdr->pid = payload_pid;
+	if (verify_this(hdr->seq)) {
+		switch (opt.verify_mode) {
+		case VERIFY_UNIQUE:
+			for (k = 0, off = 0; off < total; k++, off += len) {
+				p = payload_seg(iov, k, off, total, &len);
+				unique_fill(p, len, unique_seed(hdr) +
+					    (off / 4) * PAYLOAD_STEP);
+			}
+			break;
+		case VERIFY_CRC32C:
+			/* send slots come with the pattern filled in */
+			hdr->csum = pattern_crc32c(total);
+			break;
+		}
+	}
+	encode_hdr(iov[0].iov_base, hdr);
 }
 
-static void rds_fill_buffer(void *buf, size_t size, uint64_t pattern)
+/* inet_ntoa uses a static buffer, so calling it twice in
+ * a single printf as we do below will produce undefined
+ * results. We copy the output to two static buffers,
+ * and switch between them.
+ */
+static char *inet_ntoa_32(uint32_t val)
 {
-	uint64_t *pos, *end;
+	struct in_addr addr = { .s_addr = val };
+	static char buffer[2][64];
+	static unsigned int select = 0;
 
-	pos = (uint64_t *) buf;
-	end = (uint64_t *) (buf + size);
-	while (pos < end)
-		*pos++ = pattern;
+	select = 1 - select;
+	strncpy(buffer[select], inet_ntoa(addr), 63);
+
+	return buffer[select];
 }
 
-#if 0
-static void  rds_dump_buffer(const void *buf, size_t size)
+/*
+ * Compare incoming message header with expected header. All header fields
+ * are in host byte order except for address and port fields.
+ */
+static int check_hdr(const struct iovec *iov, uint32_t bytes, struct header *hdr,
+		     struct options *opts)
 {
-	const uint64_t *pos;
-	unsigned int i, count;
+	struct header msghdr;
+	uint32_t	inc_seq;
+	uint32_t	my_seq;
+	unsigned char	*p, *expect;
+	unsigned int	k, count, total;
+	size_t		i, off, len, offset;
+	uint32_t	csum;
 
-	pos = (const uint64_t *) buf;
+	decode_hdr(&msghdr, iov[0].iov_base);
+	inc_seq = msghdr.seq;
+	my_seq = hdr->seq;
 
-	count = size / sizeof(uint64_t);
-	pos = (const uint64_t *) buf;
+	if (msghdr.retry && (inc_seq < my_seq))
+		return -1;
 
-	printf("rds_dump_buffer(%p, %u)\n", buf, (int) size);
-	for (i = 0; i < count; ++i) {
-		if ((i % 4) == 0)
-			printf("\n%08x:", i);
-		printf(" %016Lx", (unsigned long long) *pos++);
+	if (memcmp(&msghdr, hdr, BASIC_HEADER_SIZE)) {
+#define bleh(var, disp)					\
+		disp(hdr->var),				\
+		msghdr.var == hdr->var ? " =" : "!=",	\
+		disp(msghdr.var)
+
+		/*
+		 * This is printed as one GIANT printf() so that it serializes
+		 * with stdout() and we don't get things stomping on each
+		 * other
+		 */
+		printf( "An incoming message had a %s header which\n"
+			"didn't contain the fields we expected:\n"
+			"    member        expected eq             got\n"
+			"       seq %15u %s %15u\n"
+			" from_addr %15s %s %15s\n"
+			" from_port %15u %s %15u\n"
+			"   to_addr %15s %s %15s\n"
+			"   to_port %15u %s %15u\n"
+			"     index %15u %s %15u\n"
+			"        op %15u %s %15u\n",
+			(msghdr.retry) ? "RETRY" : "",
+			bleh(seq, /**/),
+			bleh(from_addr, inet_ntoa_32),
+			bleh(from_port, ntohs),
+			bleh(to_addr, inet_ntoa_32),
+			bleh(to_port, ntohs),
+			bleh(index, /**/),
+			bleh(op, /**/));
+#undef bleh
+
+		return 1;
 	}
-}
-#endif
 
-static void rds_compare_buffer(uint64_t *addr, int size, uint64_t pattern)
-{
-	int d, failed = 0;
+	/* older peers don't say */
+	if (hdr_len > HEADER_2_0_7_SIZE && msghdr.size != bytes) {
+		printf("An incoming message of %u bytes said it was %u bytes long\n",
+		       bytes, msghdr.size);
+		return 1;
+	}
 
-	for (d = 0; d < size / sizeof(uint64_t); d++) {
-		if (addr[d] == pattern)
-			continue;
+	if (!verify_this(msghdr.seq))
+		return 0;
 
-		failed = 1;
-		trace("compare fail pattern offset %u: expected %Lx got %Lx\n",
-				8 * d,
-				(unsigned long long) pattern,
-				(unsigned long long) addr[d]);
+	total = bytes - hdr_len;
 
-#if 0
-		rds_dump_buffer(addr, size);
-		die("compare pass\n");
-#endif
+	if (opt.verify_mode == VERIFY_CRC32C) {
+		csum = ~0U;
+		for (k = 0, off = 0; off < total; k++, off += len) {
+			p = payload_seg(iov, k, off, total, &len);
+			csum = crc32c_update(csum, p, len);
+		}
+		csum = ~csum;
+		if (csum != msghdr.csum) {
+			printf("An incoming message of %u bytes has a corrupted payload; "
+			       "crc32c %08x, expected %08x\n",
+			       bytes, csum, msghdr.csum);
+			return 1;
+		}
+		return 0;
 	}
 
-	if (!failed)
-		trace("compare pass pattern %Lx addr %p\n",
-			(unsigned long long) pattern, addr);
+	for (k = 0, off = 0; off < total; k++, off += len) {
+		p = payload_seg(iov, k, off, total, &len);
+		if (opt.verify_mode == VERIFY_UNIQUE)
+			i = unique_mismatch(p, len, unique_seed(&msghdr) +
+					    (off / 4) * PAYLOAD_STEP);
+		else
+			i = payload_mismatch(p, msg_pattern + off, len);
+		if (i < len)
+			break;
+	}
+	if (off >= total)
+		return 0;
+	offset = off + i;
+
+	if (opt.verify_mode == VERIFY_UNIQUE) {
+		/* rebuild what we expected to count the damage */
+		expect = malloc(total);
+		if (!expect)
+			die("ERROR: failed to alloc memory\n");
+		unique_fill(expect, total, unique_seed(&msghdr));
+	} else
+		expect = msg_pattern;
+
+	for (count = 0; off < total; k++, off += len, i = 0) {
+		p = payload_seg(iov, k, off, total, &len);
+		for (; i < len; i++) {
+			if (p[i] != expect[off + i])
+				count++;
+		}
+	}
+
+	printf("An incoming message has a corrupted payload at offset %zu; "
+			"%u out of %u bytes corrupted\n",
+			offset, count, total);
+	if (expect != msg_pattern)
+		free(expect);
+	return 1;
 }
 
-struct retry_entry {
-	uint32_t	retries;
-	uint32_t	seq;
-	int		status;
-};
+void stat_inc(struct counter *ctr, uint64_t val)
+{
+	ctr->nr++;
+	ctr->sum += val;
+	ctr->min = minz(val, ctr->min);
+	ctr->max = max(val, ctr->max);
+}
 
-struct task {
-	unsigned int		nr;
-	unsigned int		pending;
-	int			trace;
-	unsigned int		unacked;
-	struct sockaddr_in	src_addr;	/* same for all tasks */
-	struct sockaddr_in	dst_addr;
-	unsigned char		congested;
-	unsigned char		drain_rdmas;
-	uint32_t		send_seq;
-	uint32_t		recv_seq;
-	uint16_t		send_index;
-	uint16_t		recv_index;
-	struct timeval *	send_time;
-	struct header *		ack_header;
-	struct header *         ack2_header;
-	struct header *         req_header;
-	uint64_t *		retry_token;
-	uint32_t		retries;
-	uint32_t            	last_retry_seq;
-	uint32_t		retry_index;
+int64_t tv_cmp(const struct timeval *a, const struct timeval *b)
+{
+	int64_t a_usecs = ((uint64_t)a->tv_sec * 1000000ULL) + a->tv_usec;
+	int64_t b_usecs = ((uint64_t)b->tv_sec * 1000000ULL) + b->tv_usec;
 
+	return a_usecs - b_usecs;
+}
 
-	/* RDMA related stuff */
-	uint64_t **		local_buf;
-	uint64_t **		rdma_buf;
-	uint64_t *		rdma_req_key;
-	uint8_t *		rdma_inflight;
-	uint32_t		buffid;
-	uint8_t			rdma_next_op;
+/* returns a - b in usecs */
+uint64_t usec_sub(struct timeval *a, struct timeval *b)
+{
+	return ((uint64_t)(a->tv_sec - b->tv_sec) * 1000000ULL) +
+		a->tv_usec - b->tv_usec;
+}
+
+/*
+ * Timestamps on the data path are nanoseconds from now_ns(). They come
+ * from CLOCK_MONOTONIC_RAW, which NTP doesn't slew, or with --clock=tsc
+ * from the time stamp counter, calibrated against that clock at startup.
+ * Only differences between them mean anything.
+ */
+#define NSEC_PER_SEC		1000000000ULL
+
+enum {
+	CLOCK_SRC_MONOTONIC = 0,
+	CLOCK_SRC_TSC,
 };
 
-static void alloc_rdma_buffers(struct task *t, struct options *opts)
+static const char *clock_names[] = {
+	[CLOCK_SRC_MONOTONIC]	= "monotonic",
+	[CLOCK_SRC_TSC]		= "tsc",
+};
+
+static int		clock_source;
+
+static inline uint64_t monotonic_ns(void)
 {
-	unsigned int i, j;
-	size_t len;
-	caddr_t	base;
+	struct timespec ts;
 
-	/* We use mmap here rather than malloc, because it is always
-	 * page aligned. */
-	len = 2 * opts->nr_tasks * opts->req_depth * (opts->rdma_vector * opts->rdma_size) + sys_page_size;
-	base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, 0, 0);
-	if (base == MAP_FAILED)
-		die_errno("alloc_rdma_buffers: mmap failed");
-	memset(base, 0x2f, len);
-	base += opts->rdma_alignment;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-	for (i = 0; i < opts->nr_tasks; ++i, ++t) {
-		for (j = 0; j < opts->req_depth; ++j) {
-			t->rdma_buf[j] = (uint64_t *) base;
-			base += opts->rdma_size * opts->rdma_vector;
+#ifdef HAVE_TSC
+static uint64_t		tsc_base;
+static double		tsc_ns_per_tick;
 
-			t->local_buf[j] = (uint64_t *) base;
-			base += opts->rdma_size * opts->rdma_vector;
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
 
-			t->rdma_req_key[j] = 0;
-			t->rdma_inflight[j] = 0;
-		}
-	}
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t) hi << 32 | lo;
 }
 
-static void rdma_build_req(int fd, struct header *hdr, struct task *t,
-		unsigned int rdma_size, unsigned int req_depth, int rw_mode, int rdma_vector)
+/*
+ * The counter has to tick at a constant rate and keep going in deep
+ * C-states, or it's no use as a clock.
+ */
+static void calibrate_tsc(void)
 {
-	uint64_t *rdma_addr, *rdma_key_p;
+	unsigned int eax, ebx, ecx, edx;
+	uint64_t ns0, ns1, tsc0, tsc1;
 
-	rdma_addr = t->rdma_buf[t->send_index];
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+	    !(edx & (1 << 8))) {
+		fprintf(stderr, "TSC is not invariant, using the monotonic clock\n");
+		clock_source = CLOCK_SRC_MONOTONIC;
+		return;
+	}
 
-	rdma_key_p = &t->rdma_req_key[t->send_index];
-	if (opt.rdma_use_get_mr && *rdma_key_p == 0)
-		*rdma_key_p = get_rdma_key(fd, ptr64(rdma_addr), rdma_size * rdma_vector);
+	ns0 = monotonic_ns();
+	tsc0 = rdtsc();
+	usleep(100000);
+	ns1 = monotonic_ns();
+	tsc1 = rdtsc();
 
-	/* We alternate between RDMA READ and WRITEs */
-        if (M_RDMA_READWRITE == rw_mode)
-                t->rdma_next_op = RDMA_OP_TOGGLE(t->rdma_next_op);
-        else if (M_RDMA_READ_ONLY == rw_mode)
-                t->rdma_next_op = RDMA_OP_READ;
-        else
-                t->rdma_next_op = RDMA_OP_WRITE;
-	hdr->rdma_op = t->rdma_next_op;
-
-	hdr->rdma_pattern = (((uint64_t) t->send_seq) << 32) | getpid();
-	hdr->rdma_addr = ptr64(rdma_addr);
-	hdr->rdma_phyaddr = 0;
-	hdr->rdma_size = rdma_size;
-	hdr->rdma_key = *rdma_key_p;
-	hdr->rdma_vector = rdma_vector;
-
-	if (RDMA_OP_READ == hdr->rdma_op) {
-		if (opt.verify)
-			rds_fill_buffer(rdma_addr, rdma_size, hdr->rdma_pattern);
-		trace("Requesting RDMA read for pattern %Lx "
-				"local addr to rdma read %p\n",
-				(unsigned long long) hdr->rdma_pattern,
-				rdma_addr);
-	} else {
-		if (opt.verify)
-			rds_fill_buffer(rdma_addr, rdma_size, 0);
-		trace("Requesting RDMA write for pattern %Lx "
-				"local addr to rdma write %p\n",
-				(unsigned long long) hdr->rdma_pattern,
-				rdma_addr);
-	}
+	tsc_base = tsc0;
+	tsc_ns_per_tick = (double) (ns1 - ns0) / (tsc1 - tsc0);
 }
-
-static void rdma_validate(const struct header *in_hdr, struct options *opts)
+#else
+static void calibrate_tsc(void)
 {
-	unsigned long	rdma_size;
-        unsigned long   rdma_vector;
+	fprintf(stderr, "no TSC on this architecture, using the monotonic clock\n");
+	clock_source = CLOCK_SRC_MONOTONIC;
+}
+#endif
 
-	rdma_size = in_hdr->rdma_size;
-	if (rdma_size != opts->rdma_size)
-		die("Unexpected RDMA size %lu in request\n", rdma_size);
+static inline uint64_t now_ns(void)
+{
+#ifdef HAVE_TSC
+	if (clock_source == CLOCK_SRC_TSC)
+		return (rdtsc() - tsc_base) * tsc_ns_per_tick;
+#endif
+	return monotonic_ns();
+}
 
-	rdma_vector = in_hdr->rdma_vector;
-        if (rdma_vector != opts->rdma_vector)
-                die("Unexpected RDMA vector %lu in request %u \n", rdma_vector, opts->rdma_vector);
+static int bound_socket(int domain, int type, int protocol,
+			struct sockaddr_in *sin)
+{
+	int fd;
+	int sockopt;
 
+	fd = socket(domain, type, protocol);
+	if (fd < 0)
+		die_errno("socket(%d, %d, %d) failed", domain, type, protocol);
 
-	if (in_hdr->rdma_op != RDMA_OP_READ && in_hdr->rdma_op != RDMA_OP_WRITE)
-		die("Unexpected RDMA op %u in request\n", in_hdr->rdma_op);
+	sockopt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt)))
+		die_errno("setsockopt(SO_REUSEADDR) failed");
 
+	if (bind(fd, (struct sockaddr *)sin, sizeof(struct sockaddr_in)))
+		die_errno("bind() failed");
 
-	trace("RDS received request to issue rdma %s len %lu rva %Lx key %Lx pattern %Lx\n",
-		in_hdr->rdma_op == RDMA_OP_WRITE? "write to" : "read from",
-		rdma_size,
-		(unsigned long long) in_hdr->rdma_addr,
-		(unsigned long long) in_hdr->rdma_key,
-		(unsigned long long) in_hdr->rdma_pattern);
+	return fd;
 }
 
-static void rdma_build_ack(struct header *hdr, const struct header *in_hdr)
+static uint32_t get_local_address(int fd, struct sockaddr_in *sin)
 {
-	hdr->rdma_op = in_hdr->rdma_op;
-	hdr->rdma_size = in_hdr->rdma_size;
-	hdr->rdma_key = in_hdr->rdma_key;
-	hdr->rdma_phyaddr = in_hdr->rdma_phyaddr; /* remote's address to rdma to / from */
-	hdr->rdma_addr = in_hdr->rdma_addr; /* remote's address to rdma to / from */
-	hdr->rdma_pattern = in_hdr->rdma_pattern;
-	hdr->rdma_vector = in_hdr->rdma_vector;
-}
+	socklen_t alen = sizeof(*sin);
 
-static inline uint64_t rdma_user_token(struct task *t, unsigned int qindex,  unsigned int type, uint32_t seq)
-{
-	uint64_t tmp = seq;
-	return (tmp << 32) | ((t->nr * opt.req_depth + qindex) << 2 | type);
+	if (getsockname(fd, (struct sockaddr *) sin, &alen))
+		die_errno("getsockname failed");
+	return ntohl(sin->sin_addr.s_addr);
 }
 
-static void rdma_mark_completed(struct task *tasks, uint64_t token, int status, struct options *opts)
+static int rds_socket(struct options *opts, struct sockaddr_in *sin)
 {
-	struct task *t;
-	unsigned int i;
-	struct header *hdr = NULL;
-	uint32_t seq = token >> 32;
-	unsigned int type = token & 0x03;
-	unsigned int index = (token & 0xFFFFFFFF) >> 2;
-
-	trace("RDS rdma completion for token 0x%lx\n", token);
-
-	t = &tasks[index / opt.req_depth];
-	i = index % opt.req_depth;
+	uint64_t want;
+	int bytes;
+	int fd;
+	int val;
+	socklen_t optlen;
 
-	if (opts->async) {
-		if (type == OP_REQ)
-			hdr = &t->req_header[i];
-		else
-			hdr = &t->ack2_header[i];
-	}
+	fd = bound_socket(pf, SOCK_SEQPACKET, 0, sin);
 
-	if (status) {
-		const char *errmsg;
+	/* multi-megabyte messages would overflow an int; the kernel
+	 * doubles what we ask for and caps it at wmem_max anyway */
+	want = (uint64_t) opts->nr_tasks * opts->req_depth *
+		((uint64_t) opts->req_size + opts->ack_size) * 2;
+	bytes = min(want, INT_MAX / 2);
 
-		switch (status) {
-		case RDS_RDMA_REMOTE_ERROR:
-			errmsg = "remote error"; break;
-		case RDS_RDMA_DROPPED:
-			errmsg = "operation was dropped"; break;
-		case RDS_RDMA_CANCELED:
-			errmsg = "operation was cancelled"; break;
-		case RDS_RDMA_OTHER_ERROR:
-			errmsg = "other error"; break;
-		default:
-			errmsg = "unknown error"; break;
-		}
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)))
+		die_errno("setsockopt(SNDBUF, %d) failed", bytes);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)))
+		die_errno("setsockopt(RCVBUF, %d) failed", bytes);
 
-		trace("%s:%u: %s failed: %s\n",
-				inet_ntoa(t->dst_addr.sin_addr),
-				ntohs(t->dst_addr.sin_port),
-				type ? "SEND" : "RDMA",
-				errmsg);
+	optlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, &optlen))
+		die_errno("getsockopt(SNDBUF) failed");
+	if (val / 2 < bytes && !opts->suppress_warnings)
+		fprintf(stderr,
+			"getsockopt(SNDBUF) returned %d, we wanted %d * 2\n",
+			val, bytes);
 
-		if (hdr &&
-			(status == RDS_RDMA_DROPPED ||
-			 status == RDS_RDMA_REMOTE_ERROR)) {
+	optlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, &optlen))
+		die_errno("getsockopt(RCVBUF) failed");
+	if (val / 2 < bytes && !opts->suppress_warnings)
+		fprintf(stderr,
+			"getsockopt(RCVBUF) returned %d, we need %d * 2\n",
+			val, bytes);
 
-			if (hdr->seq == seq) {
-				hdr->retry = 1;
-				if (hdr->seq > t->last_retry_seq) {
-					if (status == RDS_RDMA_REMOTE_ERROR)
-						hdr->rdma_remote_err = 1;
-					t->retry_token[t->retry_index] = token;
-					t->retry_index = (t->retry_index + 1) %
-						(2 * opts->req_depth);
-					t->retries += 1;
-					t->last_retry_seq = hdr->seq;
-					if (t->retries > 2 * opts->req_depth)
-						die("Exceeded MAX retry entries..\n");
-				}
-			} else
-				die("SEQ Out-Of-Sync: %u/%u\n", hdr->seq, seq);
-		} else if (hdr) {
-			hdr->pending = 0;
-			hdr->retry = 0;
-			hdr->rdma_remote_err = 0;
-		}
-	} else if (hdr) {
-		hdr->pending = 0;
-		hdr->retry = 0;
-		hdr->rdma_remote_err = 0;
+	val = 1;
+	if (opts->use_cong_monitor
+	 && setsockopt(fd, sol, RDS_CONG_MONITOR, &val, sizeof(val))) {
+		if (errno != ENOPROTOOPT)
+			die_errno("setsockopt(RDS_CONG_MONITOR) failed");
+		printf("Kernel does not support congestion monitoring; disabled\n");
+		opts->use_cong_monitor = 0;
 	}
 
-	t->rdma_inflight[i] = 0;
-	t->drain_rdmas = 0;
-}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
 
-#define MSG_MAXIOVLEN 2
+	return fd;
+}
 
-/*
- * Add a control message to the outgoing message
- */
-static void rdma_put_cmsg(struct msghdr *msg, int type,
-			const void *ptr, size_t size)
+static int check_rdma_support(struct options *opts)
 {
-	static char ctlbuf[1024];
-	struct cmsghdr *cmsg;
+	struct sockaddr_in sin;
+	struct rds_free_mr_args args;
+	int fd, okay = 0;
 
-	if (!msg->msg_control) {
-		msg->msg_control = ctlbuf;
-		msg->msg_controllen = CMSG_SPACE(size);
-		cmsg = CMSG_FIRSTHDR(msg);
+	/* We need a local address to bind to. If the user
+	 * didn't specify the -r option, we tell him to go on for
+	 * now - he'll call back once more later. */
+	if (opts->receive_addr == 0)
+		return 1;
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opts->starting_port);
+	sin.sin_addr.s_addr = htonl(opts->receive_addr);
+
+	fd = bound_socket(pf, SOCK_SEQPACKET, 0, &sin);
+
+	memset(&args, 0, sizeof(args));
+	if (setsockopt(fd, sol, RDS_FREE_MR, &args, sizeof(args)) >= 0) {
+		okay = 1;
+	} else if (errno == ENOPROTOOPT) {
+		okay = 0;
 	} else {
-		cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
-		msg->msg_controllen += CMSG_SPACE(size);
+		die_errno("%s: RDS_FREE_MR failed with unexpected error",
+				__FUNCTION__);
 	}
+	close(fd);
 
-	cmsg->cmsg_level = sol;
-	cmsg->cmsg_type = type;
-	cmsg->cmsg_len = CMSG_LEN(size);
-	memcpy(CMSG_DATA(cmsg), ptr, size);
+	return okay;
 }
 
-/*
- * This sets up all the fields for an RDMA transfer.
- * The request is passed as a control message along with
- * the ACK packet.
- */
-static void rdma_build_cmsg_xfer(struct msghdr *msg, const struct header *hdr,
-		uint64_t user_token, void *local_buf)
+static uint64_t get_rdma_key(int fd, uint64_t addr, uint32_t size)
 {
+	uint64_t cookie = 0;
+	struct rds_get_mr_args mr_args;
 
-#define RDS_MAX_IOV 512 /* FIX_ME - put this into rds.h or use socket max ?*/
-
-	static struct rds_iovec iov[RDS_MAX_IOV];
-	struct rds_rdma_args args;
-	unsigned int rdma_size;
-	unsigned int rdma_vector;
-	unsigned int v;
+	mr_args.vec.addr = addr;
+	mr_args.vec.bytes = size;
+	mr_args.cookie_addr = ptr64(&cookie);
+	mr_args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
+	if (opt.rdma_use_once)
+		mr_args.flags |= RDS_RDMA_USE_ONCE;
 
-	rdma_size = hdr->rdma_size;
-	rdma_vector = hdr->rdma_vector;
+	if (setsockopt(fd, sol, RDS_GET_MR, &mr_args, sizeof(mr_args)))
+		die_errno("setsockopt(RDS_GET_MR) failed (%u allocated)", mrs_allocated);
 
-	trace("RDS issuing rdma for token 0x%lx key 0x%llx len %d local_buf %p vector %d\n",
-			user_token,
-			(unsigned long long) hdr->rdma_key,
-			rdma_size, local_buf,
-			rdma_vector);
+	trace("RDS get_rdma_key() = %Lx\n",
+				(unsigned long long) cookie);
 
-	/* rdma args */
-	memset(&args, 0, sizeof(args));
+	mrs_allocated++;
+	return cookie;
+}
 
-	/* Set up the iovec pointing to the RDMA buffer */
-	args.local_vec_addr = (uint64_t) iov;
-	args.nr_local = rdma_vector;
+static void free_rdma_key(int fd, uint64_t key)
+{
+	struct rds_free_mr_args mr_args;
 
-	for (v = 0; v < rdma_vector; v++) {
-		iov[v].addr = ptr64((local_buf + (rdma_size * v)));
-		iov[v].bytes = rdma_size;
-	}
+	trace("RDS free_rdma_key(%Lx)\n", (unsigned long long) key);
 
-	/* The remote could either give us a physical address, or
-	 * an index into a zero-based FMR. Either way, we just copy it.
-	 */
-	args.remote_vec.addr = hdr->rdma_phyaddr;
-	args.remote_vec.bytes = rdma_size * rdma_vector;
-	args.cookie = hdr->rdma_key;
+	mr_args.cookie = key;
+#if 1
+	mr_args.flags = 0;
+#else
+	mr_args.flags = RDS_FREE_MR_ARGS_INVALIDATE;
+#endif
+	if (setsockopt(fd, sol, RDS_FREE_MR, &mr_args, sizeof(mr_args)))
+		return;
+	mrs_allocated--;
+}
 
-	/* read or write */
-	switch (hdr->rdma_op) {
-	case RDMA_OP_WRITE:
-		args.flags = RDS_RDMA_READWRITE;
+/*
+ * RDMA key-o-meter. We track how frequently the kernel
+ * re-issues R_Keys
+ *
+ * The key_o_meter data structures are shared between the processes
+ * without any locking. We don't care much for locking here...
+ */
+#define RDMA_MAX_TRACKED_KEYS	(32*1024)
+struct rdma_key_stamp {
+	uint32_t	r_key;
+	struct timeval	issued;
+};
+struct rdma_key_trace {
+	uint32_t	count, max;
+	struct rdma_key_stamp *entry;
+};
+struct rdma_key_o_meter {
+	struct rdma_key_trace *current;
+	struct rdma_key_trace *idle;
+};
+static struct rdma_key_o_meter *rdma_key_o_meter;
+static __thread unsigned int rdma_key_task;
 
-		if (opt.verify)
-			rds_fill_buffer(local_buf, rdma_size, hdr->rdma_pattern);
-		break;
+static void rdma_key_o_meter_init(unsigned int nr_tasks)
+{
+	struct rdma_key_trace *kt;
+	struct rdma_key_stamp *ks;
+	uint32_t max;
+	unsigned int i, size;
+	void *base;
 
-	case RDMA_OP_READ:
-		args.flags = 0;
-		break;
-	}
+	size = sizeof(struct rdma_key_o_meter)
+			+ 2 * nr_tasks * sizeof(*kt)
+			+ 2 * RDMA_MAX_TRACKED_KEYS * sizeof(*ks);
+	base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_SHARED, 0, 0);
+	if (base == MAP_FAILED)
+		die_errno("alloc_rdma_buffers: mmap failed");
 
-	/* Fence off subsequent SENDs - this is the default */
-	/* for rdma read operations. We force this fence to control */
-	/* order of remote immediate data rm completion */
-	/* If we do not use a fence the immediate send rm can complete */
-	/* before rdma data arrives.. */
+	rdma_key_o_meter = (struct rdma_key_o_meter *) base;
+	base = rdma_key_o_meter + 1;
 
-	if (!(args.flags & RDS_RDMA_READWRITE) && opt.rdma_use_fence)
-		args.flags |= RDS_RDMA_FENCE;
+	rdma_key_o_meter->current = (struct rdma_key_trace *) base;
+	base = rdma_key_o_meter->current + nr_tasks;
 
-	args.flags |= RDS_RDMA_NOTIFY_ME;
-	/* args.flags |= RDS_RDMA_REMOTE_COMPLETE; */
-	args.user_token = user_token;
+	rdma_key_o_meter->idle = (struct rdma_key_trace *) base;
+	base = rdma_key_o_meter->idle + nr_tasks;
 
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_ARGS, &args, sizeof(args));
+	ks = (struct rdma_key_stamp *) base;
+	max = RDMA_MAX_TRACKED_KEYS / nr_tasks;
+	for (i = 0, kt = rdma_key_o_meter->current; i < 2 * nr_tasks; ++i, ++kt) {
+		kt->count = 0;
+		kt->max = max;
+		kt->entry = ks + i * max;
+	}
 }
 
-static void build_cmsg_async_send(struct msghdr *msg, uint64_t user_token)
+/* This is called in the child process to set the index of
+ * the key-o-meter to use */
+static void rdma_key_o_meter_set_self(unsigned int task_idx)
 {
-	struct rds_asend_args args = { 0 };
-
-	args.flags |= RDS_RDMA_NOTIFY_ME;
-	args.user_token = user_token;
-	rdma_put_cmsg(msg, RDS_CMSG_ASYNC_SEND, &args, sizeof(args));
+	rdma_key_task = task_idx;
 }
 
-static void rdma_build_cmsg_dest(struct msghdr *msg, rds_rdma_cookie_t rdma_dest)
+static void rdma_key_o_meter_add(uint32_t key)
 {
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_DEST, &rdma_dest, sizeof(rdma_dest));
+	struct rdma_key_trace *kt;
+
+	if (!rdma_key_o_meter)
+		return;
+
+	kt = &rdma_key_o_meter->current[rdma_key_task];
+	if (kt->count < kt->max) {
+		kt->entry[kt->count].r_key = key;
+		gettimeofday(&kt->entry[kt->count].issued, NULL);
+		kt->count++;
+	}
 }
 
-static void rdma_build_cmsg_map(struct msghdr *msg, uint64_t addr, uint32_t size,
-			rds_rdma_cookie_t *cookie)
+static int rdma_key_stamp_compare(const void *p1, const void *p2)
 {
-	struct rds_get_mr_args args;
-
-	args.vec.addr = addr;
-	args.vec.bytes = size;
-	args.cookie_addr = ptr64(cookie);
-	args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
-	if (opt.rdma_use_once)
-		args.flags |= RDS_RDMA_USE_ONCE;
+	const struct rdma_key_stamp *ks1 = p1, *ks2 = p2;
 
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_MAP, &args, sizeof(args));
+	if (ks1->r_key < ks2->r_key)
+		return -1;
+	if (ks1->r_key > ks2->r_key)
+		return 1;
+	return tv_cmp(&ks1->issued, &ks2->issued);
 }
 
-static void rdma_process_ack(int fd, struct header *hdr,
-		struct child_control *ctl)
+static void rdma_key_o_meter_check(unsigned int nr_tasks)
 {
-	trace("RDS rcvd rdma %s ACK for request key %Lx len %u local addr %Lx\n",
-		  RDMA_OP_WRITE == hdr->rdma_op ? "write" : "read",
-		  (unsigned long long) hdr->rdma_key,
-		  hdr->rdma_size,
-		  (unsigned long long) hdr->rdma_addr);
+	struct rdma_key_stamp *ks, sorted[RDMA_MAX_TRACKED_KEYS];
+	struct rdma_key_trace *kt;
+	unsigned int i, j, count = 0;
+	unsigned int reissued = 0;
+	double min_elapsed = 0, avg_elapsed = 0;
 
-	/* Need to free the MR unless allocated with use_once */
-	if (!opt.rdma_use_once && !opt.rdma_cache_mrs)
-		free_rdma_key(fd, hdr->rdma_key);
+	if (!rdma_key_o_meter)
+		return;
 
-	/* if acking an rdma write request - then remote node wrote local host buffer
-	 * (data in) so count this as rdma data coming in (rdma_read) - else remote node read
-	 * local host buffer so count this as rdma write (data out)
-	 */
-	switch (hdr->rdma_op) {
-	case RDMA_OP_WRITE:
-		/* remote node wrote local buffer check pattern
-		 * sent via immediate data in rdma buffer
-		 */
-		stat_inc(&ctl->cur[S_MBUS_IN_BYTES],  hdr->rdma_size);
+	/* Extract keys from all tasks and sort them. */
+	kt = rdma_key_o_meter->idle;
+	for (i = 0; i < nr_tasks; ++i, ++kt) {
+		ks = kt->entry;
 
-		if (opt.verify) {
-			/* This funny looking cast avoids compile warnings
-			 * on 32bit platforms. */
-			rds_compare_buffer((void *)(unsigned long) hdr->rdma_addr,
-				hdr->rdma_size,
-				hdr->rdma_pattern);
-		}
-		break;
+		for (j = 0; j < kt->count; ++j)
+			sorted[count++] = *ks++;
+		kt->count = 0;
+	}
+	qsort(sorted, count, sizeof(*sorted), rdma_key_stamp_compare);
 
-	case RDMA_OP_READ:
-		stat_inc(&ctl->cur[S_MBUS_OUT_BYTES],  hdr->rdma_size);
-		break;
+	/* Now see how many were reissued */
+	ks = sorted;
+	for (i = 0; i + 1 < count; ++i, ++ks) {
+		double elapsed;
+
+		if (ks[0].r_key != ks[1].r_key)
+			continue;
+		elapsed = 1e-6 * usec_sub(&ks[1].issued, &ks[0].issued);
+		if (reissued == 0 || elapsed < min_elapsed)
+			min_elapsed = elapsed;
+		avg_elapsed += elapsed;
 	}
+
+	if (reissued)
+		printf(" *** %u R_Keys were re-issued; min distance=%f sec, avg distance=%f sec\n",
+				reissued, min_elapsed, avg_elapsed / reissued);
+
+	/* Swap current and idle */
+	kt = rdma_key_o_meter->current;
+	rdma_key_o_meter->current = rdma_key_o_meter->idle;
+	rdma_key_o_meter->idle = kt;
 }
 
-static void build_header(struct task *t, struct header *hdr,
-		unsigned int op, unsigned int qindex)
+static void rds_fill_buffer(void *buf, size_t size, uint64_t pattern)
 {
-	memset(hdr, 0, sizeof(*hdr));
-	hdr->op = op;
-	hdr->seq = t->send_seq;
-	hdr->from_addr = t->src_addr.sin_addr.s_addr;
-	hdr->from_port = t->src_addr.sin_port;
-	hdr->to_addr = t->dst_addr.sin_addr.s_addr;
-	hdr->to_port = t->dst_addr.sin_port;
-	hdr->index = qindex;
+	uint64_t *pos, *end;
+
+	pos = (uint64_t *) buf;
+	end = (uint64_t *) (buf + size);
+	while (pos < end)
+		*pos++ = pattern;
 }
 
-static int send_msg(int fd, struct task *t, struct header *hdr,
-		    unsigned int size, struct options *opts, 
-		    struct child_control *ctl)
+#if 0
+static void  rds_dump_buffer(const void *buf, size_t size)
 {
-	unsigned char buf[size];
-	uint8_t *rdma_flight_recorder = NULL;
-	rds_rdma_cookie_t cookie = 0;
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t ret;
+	const uint64_t *pos;
+	unsigned int i, count;
 
-	fill_hdr(buf, size, hdr);
+	pos = (const uint64_t *) buf;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name  = (struct sockaddr *) &t->dst_addr;
-	msg.msg_namelen = sizeof(t->dst_addr);
+	count = size / sizeof(uint64_t);
+	pos = (const uint64_t *) buf;
 
-	msg.msg_iovlen = 1;
-	msg.msg_iov = &iov;
-	iov.iov_base = buf;
-	iov.iov_len = size;
+	printf("rds_dump_buffer(%p, %u)\n", buf, (int) size);
+	for (i = 0; i < count; ++i) {
+		if ((i % 4) == 0)
+			printf("\n%08x:", i);
+		printf(" %016Lx", (unsigned long long) *pos++);
+	}
+}
+#endif
 
+static void rds_compare_buffer(uint64_t *addr, int size, uint64_t pattern)
+{
+	int d, failed = 0;
 
-	/* If this is an ACK packet with RDMA, build the cmsg
-	   * header that goes with it. */
-	if (hdr->op == OP_ACK && hdr->rdma_op != 0 && !hdr->rdma_remote_err) {
-		unsigned int qindex = hdr->index;
+	for (d = 0; d < size / sizeof(uint64_t); d++) {
+		if (addr[d] == pattern)
+			continue;
 
-		if (t->rdma_inflight[qindex] != 0) {
-			/* It is unlikely but (provably) possible for
-			 * new requests to arrive before the RDMA notification.
-			 * That's because RDMA notifications are triggered
-			 * by the RDS ACK processing, which happens after new
-			 * messages were queued on the socket.
-			 *
-			 * We return one of the more obscure error messages,
-			 * which we recognize and handle in the top loop. */
-			trace("Drain RDMA 0x%lx\n", rdma_user_token(t, qindex, 0, hdr->seq));
-			errno = EBADSLT;
-			return -1;
-		}
-		rdma_build_cmsg_xfer(&msg, hdr,
-				rdma_user_token(t, qindex, 0, hdr->seq),
-				t->local_buf[qindex]);
-		rdma_flight_recorder = &t->rdma_inflight[qindex];
-	} else if (opts->async) {
-		if (hdr->op == OP_REQ)
-			build_cmsg_async_send(&msg,
-				rdma_user_token(t, hdr->index, OP_REQ, hdr->seq));
-		else
-			build_cmsg_async_send(&msg,
-				rdma_user_token(t, hdr->index, OP_ACK, hdr->seq));
-	}
+		failed = 1;
+		trace("compare fail pattern offset %u: expected %Lx got %Lx\n",
+				8 * d,
+				(unsigned long long) pattern,
+				(unsigned long long) addr[d]);
 
-	if (hdr->op == OP_REQ && hdr->rdma_op != 0) {
-		if (hdr->rdma_key != 0) {
-			rdma_build_cmsg_dest(&msg, hdr->rdma_key);
-			cookie = hdr->rdma_key;
-			hdr->rdma_key = 0;
-		} else {
-			rdma_build_cmsg_map(&msg, hdr->rdma_addr,
-					hdr->rdma_size * hdr->rdma_vector,
-					&cookie);
-		}
+#if 0
+		rds_dump_buffer(addr, size);
+		die("compare pass\n");
+#endif
 	}
 
-	ret = sendmsg(fd, &msg, 0);
-	if (ret < 0) {
-		if (errno != EAGAIN && errno != ENOBUFS)
-			die_errno("sendto() failed");
-		return ret;
-	}
-	if (ret != size)
-		die("sendto() truncated - %zd", ret);
+	if (!failed)
+		trace("compare pass pattern %Lx addr %p\n",
+			(unsigned long long) pattern, addr);
+}
 
-	if (rdma_flight_recorder)
-		*rdma_flight_recorder = 1;
-	if (cookie) {
-		/* We just happen to know that the r_key is in the
-		 * lower 32bit of the cookie */
-		rdma_key_o_meter_add(cookie);
-	}
+struct retry_entry {
+	uint32_t	retries;
+	uint32_t	seq;
+	int		status;
+};
 
-	hdr->pending = 1;
+/*
+ * Batched I/O. Messages that carry no control data are queued on their
+ * task and sent in bulk with sendmmsg() once per pass of the child loop.
+ * A task never has more than req_depth requests and req_depth acks
+ * waiting, so a queue of 2 * req_depth entries can't overflow.
+ */
+#define MAX_BATCH		1024	/* UIO_MAXIOV */
+#define RECV_CMSG_SPACE		256
+#define MSG_MAXIOVLEN		64	/* --send-iov and --recv-iov */
+
+struct send_entry {
+	struct msghdr		msg;
+	struct iovec *		iov;	/* send_iov_nr of them */
+	size_t			len;
+	unsigned int		op;
+	uint64_t *		stamp;
+};
 
-	return ret;
-}
+struct send_queue {
+	unsigned int		head;
+	unsigned int		count;
+	unsigned int		inflight;	/* io_uring only */
+	unsigned int		nr;
+	struct send_entry *	ent;
+};
 
-static int send_packet(int fd, struct task *t,
-		struct header *hdr, unsigned int size,
-		struct options *opts, struct child_control *ctl)
-{
-	ssize_t ret;
+struct send_batch {
+	unsigned int		nr;
+	unsigned int		gen;
+	struct mmsghdr *	vec;
+	struct task **		owner;
+};
 
-	/* Make sure we always have the current sequence number.
-	 * When we send ACK packets, the seq that gets filled in is
-	 * stale. */
-	hdr->seq = t->send_seq;
+struct recv_batch {
+	unsigned int		nr;
+	struct mmsghdr *	msgs;
+	struct iovec *		iov;
+	struct sockaddr_in *	sin;
+};
 
-	ret = send_msg(fd, t, hdr, size, opts, ctl);
-	if (ret < 0) return ret;
+struct task {
+	unsigned int		nr;
+	unsigned int		pending;
+	int			trace;
+	unsigned int		unacked;
+	struct sockaddr_in	src_addr;	/* same for all tasks */
+	struct sockaddr_in	dst_addr;
+	unsigned char		congested;
+	unsigned char		drain_rdmas;
+	struct dest_stats *	dest;		/* --task-stats, or NULL */
+	uint32_t		send_seq;
+	uint32_t		recv_seq;
+	uint16_t		send_index;
+	uint16_t		recv_index;
+	uint64_t *		send_time;
+	struct header *		ack_header;
+	struct header *         ack2_header;
+	struct header *         req_header;
+	uint64_t *		retry_token;
+	uint32_t		retries;
+	uint32_t            	last_retry_seq;
+	uint32_t		retry_index;
+	struct send_queue *	sendq;		/* batched I/O only */
+	unsigned char *		req_slots;	/* req_depth of each, in */
+	unsigned char *		ack_slots;	/* the message arena */
+	unsigned int		flush_skip;
+	uint64_t *		due;		/* open loop backlog */
+	unsigned int		due_head;
+	unsigned int		due_count;
 
-	t->send_seq++;
-	return ret;
-}
+	/* RDMA related stuff */
+	uint64_t **		local_buf;
+	uint64_t **		rdma_buf;
+	uint64_t *		rdma_req_key;
+	uint8_t *		rdma_inflight;
+	uint32_t		buffid;
+	uint8_t			rdma_next_op;
+};
 
-static int resend_packet(int fd, struct task *t,
-		struct header *hdr, unsigned int size,
-		struct options *opts, struct child_control *ctl)
+/* the destination has no room for us, the kernel said ENOBUFS */
+static void task_congested(struct task *t)
 {
-	ssize_t ret;
+	t->congested = 1;
+	if (t->dest)
+		t->dest->congested++;
+}
 
-	ret = send_msg(fd, t, hdr, size, opts, ctl);
+/*
+ * CPU and NUMA placement. The parent picks a cpu for every child before
+ * starting it; the child pins itself there and allocates its header
+ * rings and RDMA buffers from that cpu's node.
+ */
+enum {
+	PLACE_NONE = 0,
+	PLACE_RR,
+	PLACE_COMPACT,
+	PLACE_HCA,
+};
 
-	return ret;
+static const char *placement_names[] = {
+	[PLACE_NONE]	= "none",
+	[PLACE_RR]	= "rr",
+	[PLACE_COMPACT]	= "compact",
+	[PLACE_HCA]	= "hca",
+};
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED	1
+#endif
+
+#define MAX_NUMA_NODES	1024
+
+static int		placement;
+static int		placement_node = -1;
+static char *		placement_cpus;
+static int		nr_numa_nodes;
+static int		cpu_nodes[CPU_SETSIZE];
+
+static void parse_cpu_list(const char *str, cpu_set_t *set)
+{
+	const char *ptr = str;
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*ptr && *ptr != '\n') {
+		first = strtoul(ptr, &end, 10);
+		if (end == ptr)
+			die("invalid cpu list '%s'\n", str);
+		last = first;
+		if (*end == '-') {
+			ptr = end + 1;
+			last = strtoul(ptr, &end, 10);
+			if (end == ptr || last < first)
+				die("invalid cpu list '%s'\n", str);
+		}
+		if (last >= CPU_SETSIZE)
+			die("cpu %lu in '%s' out of range\n", last, str);
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*end == ',')
+			end++;
+		ptr = end;
+	}
 }
 
-static int send_one(int fd, struct task *t,
-		struct options *opts,
-		struct child_control *ctl)
+static int read_sysfs_int(const char *path, int *val)
 {
-	struct timeval start;
-	struct timeval stop;
-	struct header *hdr = &t->req_header[t->send_index]; 
+	char buffer[64];
+	FILE *fp;
 	int ret;
 
-	if (opts->async && hdr->pending) {
+	if ((fp = fopen(path, "r")) == NULL)
 		return -1;
-	}
+	ret = fgets(buffer, sizeof(buffer), fp) ? 0 : -1;
+	fclose(fp);
+	if (ret == 0)
+		*val = strtol(buffer, NULL, 0);
+	return ret;
+}
 
-	build_header(t, hdr, OP_REQ, t->send_index);
-	if (opts->rdma_size && t->send_seq > 10)
-		rdma_build_req(fd, hdr, t,
-				opts->rdma_size,
-				opts->req_depth,
-				opts->rw_mode,
-				opts->rdma_vector);
+/* Build the cpu to node map from sysfs. Without NUMA support everything
+ * lives on node 0. */
+static void discover_numa_nodes(void)
+{
+	char path[PATH_MAX], buffer[4096];
+	cpu_set_t set;
+	int node, cpu;
+	FILE *fp;
 
+	memset(cpu_nodes, 0, sizeof(cpu_nodes));
+	nr_numa_nodes = 1;
 
-	gettimeofday(&start, NULL);
-	ret = send_packet(fd, t, hdr, opts->req_size, opts, ctl);
-	gettimeofday(&stop, NULL);
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		if ((fp = fopen(path, "r")) == NULL)
+			break;
+		if (fgets(buffer, sizeof(buffer), fp)) {
+			parse_cpu_list(buffer, &set);
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &set))
+					cpu_nodes[cpu] = node;
+			}
+		}
+		fclose(fp);
+		nr_numa_nodes = node + 1;
+	}
+}
 
-	if (ret < 0)
-		return ret;
+/* Find the NUMA node of the device that carries our local address,
+ * falling back to the first InfiniBand device we can find. */
+static int hca_numa_node(uint32_t addr)
+{
+	char path[PATH_MAX], ifname[IFNAMSIZ + 1];
+	struct ifaddrs *ifa_list, *ifa;
+	struct dirent *de;
+	DIR *dir;
+	int node = -1;
+
+	if (addr && getifaddrs(&ifa_list) == 0) {
+		for (ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+			struct sockaddr_in *sin;
+			char *colon;
+
+			sin = (struct sockaddr_in *) ifa->ifa_addr;
+			if (!sin || sin->sin_family != AF_INET
+			 || sin->sin_addr.s_addr != htonl(addr))
+				continue;
 
-	t->send_time[t->send_index] = start;
-	if (!opts->rdma_cache_mrs)
-		t->rdma_req_key[t->send_index] = 0; /* we consumed this key */
-	stat_inc(&ctl->cur[S_REQ_TX_BYTES], ret);
-	stat_inc(&ctl->cur[S_SENDMSG_USECS],
-		 usec_sub(&stop, &start));
+			/* strip alias suffixes such as eth0:1 */
+			snprintf(ifname, sizeof(ifname), "%s", ifa->ifa_name);
+			if ((colon = strchr(ifname, ':')) != NULL)
+				*colon = '\0';
+			snprintf(path, sizeof(path),
+				 "/sys/class/net/%s/device/numa_node", ifname);
+			read_sysfs_int(path, &node);
+			break;
+		}
+		freeifaddrs(ifa_list);
+	}
 
-	t->send_index = (t->send_index + 1) % opts->req_depth;
-	t->pending++;
-	return ret;
+	if (node < 0 && (dir = opendir("/sys/class/infiniband")) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path),
+				 "/sys/class/infiniband/%s/device/numa_node",
+				 de->d_name);
+			if (read_sysfs_int(path, &node) == 0 && node >= 0)
+				break;
+		}
+		closedir(dir);
+	}
+
+	if (node < 0) {
+		fprintf(stderr, "Cannot determine HCA NUMA node, using node 0\n");
+		node = 0;
+	}
+	return node;
 }
 
-static int send_ack(int fd, struct task *t, unsigned int qindex,
-		struct options *opts,
-		struct child_control *ctl)
+static void place_children(struct child_control *ctl, struct options *opts)
 {
-	struct header *hdr = &t->ack_header[qindex];
-	struct header *hdr2 = &t->ack2_header[qindex];
-	ssize_t ret;
+	int order[CPU_SETSIZE];
+	cpu_set_t cpus;
+	int node, cpu, nr = 0;
+	uint16_t i;
 
-	if (opts->async && hdr2->pending) {
-		return -1;
+	for (i = 0; i < opts->nr_tasks; i++) {
+		ctl[i].cpu = -1;
+		ctl[i].node = -1;
 	}
 
-	/* send an ack in response to the req we just got */
-	ret = send_packet(fd, t, hdr, opts->ack_size, opts, ctl);
-	if (ret < 0)
-		return ret;
-	if (ret != opts->ack_size)
-		die_errno("sendto() returned %zd", ret);
-
-	stat_inc(&ctl->cur[S_ACK_TX_BYTES], ret);
+	if (placement == PLACE_NONE && !placement_cpus && placement_node < 0)
+		return;
+	if (placement == PLACE_NONE)
+		placement = PLACE_COMPACT;
+
+	discover_numa_nodes();
+
+	if (placement_cpus)
+		parse_cpu_list(placement_cpus, &cpus);
+	else if (sched_getaffinity(0, sizeof(cpus), &cpus))
+		die_errno("sched_getaffinity failed");
+
+	node = placement_node;
+	if (placement == PLACE_HCA && node < 0)
+		node = hca_numa_node(opts->receive_addr);
+
+	if (placement == PLACE_RR) {
+		/* take one cpu from every node in turn */
+		int taken[MAX_NUMA_NODES] = { 0 };
+		int more = 1;
+
+		while (more) {
+			more = 0;
+			for (node = 0; node < nr_numa_nodes; node++) {
+				int skip = taken[node];
+
+				for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if (!CPU_ISSET(cpu, &cpus) || cpu_nodes[cpu] != node)
+						continue;
+					if (skip-- == 0) {
+						order[nr++] = cpu;
+						taken[node]++;
+						more = 1;
+						break;
+					}
+				}
+			}
+		}
+	} else {
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &cpus))
+				continue;
+			if (node >= 0 && cpu_nodes[cpu] != node)
+				continue;
+			order[nr++] = cpu;
+		}
+	}
 
-	/* need separate rdma stats cells for send/recv */
-	switch (hdr->rdma_op) {
-	case RDMA_OP_WRITE:
-		stat_inc(&ctl->cur[S_MBUS_OUT_BYTES], opts->rdma_size);
-		break;
+	if (nr == 0)
+		die("no usable cpus for %s placement\n", placement_names[placement]);
 
-	case RDMA_OP_READ:
-		stat_inc(&ctl->cur[S_MBUS_IN_BYTES], opts->rdma_size);
-		break;
+	for (i = 0; i < opts->nr_tasks; i++) {
+		ctl[i].cpu = order[i % nr];
+		ctl[i].node = cpu_nodes[ctl[i].cpu];
 	}
+}
 
-	memcpy(hdr2, hdr, sizeof(struct header));
-
-	return ret;
+static void numa_node_mask(int node, unsigned long *mask, size_t size)
+{
+	memset(mask, 0, size);
+	mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
 }
 
-static int ack_anything(int fd, struct task *t,
-			struct options *opts,
-			struct child_control *ctl,
-			int can_send)
+/* Called by each child before it allocates anything */
+static void apply_placement(struct child_control *ctl)
 {
-	while (t->unacked) {
-		uint16_t qindex;
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+	cpu_set_t set;
 
-		qindex = (t->recv_index - t->unacked + opts->req_depth) % opts->req_depth;
-		if (!can_send)
-			goto eagain;
-		if (send_ack(fd, t, qindex, opts, ctl) < 0)
-			return -1;
-		t->unacked -= 1;
-	}
-	return 0;
+	if (ctl->cpu < 0)
+		return;
 
-eagain:
-	errno = EAGAIN;
-	return -1;
+	CPU_ZERO(&set);
+	CPU_SET(ctl->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die_errno("sched_setaffinity(cpu %d) failed", ctl->cpu);
+
+	if (nr_numa_nodes < 2)
+		return;
+
+	/* Prefer rather than bind, so a node running out of memory
+	 * doesn't get the child killed. The message and RDMA arenas
+	 * get the same policy from prefer_node(). */
+	numa_node_mask(ctl->node, mask, sizeof(mask));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 8 * sizeof(mask)))
+		die_errno("set_mempolicy(node %d) failed", ctl->node);
 }
 
-static int send_anything(int fd, struct task *t,
-			struct options *opts,
-			struct child_control *ctl,
-			int can_send, int do_work)
+static void prefer_node(void *addr, size_t len, int node)
 {
-	struct header *hdr;
-	unsigned int index;
-	int req_size;
-	int num_retries = t->retries;
-	uint64_t token;
-	unsigned int type;
-	unsigned int index2;
-	unsigned int i;
-
-	while (opts->async && num_retries > 0) {
-		index = (t->retry_index - num_retries +
-			(2 * opts->req_depth)) % (2 * opts->req_depth);
-
-		token = t->retry_token[index];
-		type = token & 0x03;
-		index2 = (token & 0xFFFFFFFF) >> 2;
-		i = index2 % opts->req_depth;
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
 
-		if (type == OP_REQ)
-			hdr = &t->req_header[i];
-		else
-			hdr = &t->ack2_header[i];
+	if (node < 0 || nr_numa_nodes < 2)
+		return;
 
-		if (!hdr->retry)
-			goto next;
+	numa_node_mask(node, mask, sizeof(mask));
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, 8 * sizeof(mask), 0))
+		die_errno("mbind(node %d) failed", node);
+}
 
-		if (hdr->op == OP_REQ)
-			req_size = opts->req_size;
-		else
-			req_size = opts->ack_size;
+static void print_placement(struct child_control *ctl, uint16_t nr_tasks)
+{
+	uint16_t i;
 
-		if (resend_packet(fd, t, hdr, req_size, opts, ctl) < 0) {
-			return -1;
-		}
-		hdr->retry = 0;
-next:
-		num_retries--;
-	}
-	t->last_retry_seq = t->retries = 0;
+	if (ctl[0].cpu < 0)
+		return;
 
-	if (ack_anything(fd, t, opts, ctl, can_send) < 0)
-		return -1;
+	printf("\nPlacement (%s)\n", placement_names[placement]);
+	printf("%5s %5s %5s\n", "task", "cpu", "node");
+	for (i = 0; i < nr_tasks; i++)
+		printf("%5u %5d %5d\n", i, ctl[i].cpu, ctl[i].node);
+}
 
-	while (do_work && t->pending < opts->req_depth) {
-		if (!can_send)
-			goto eagain;
-		if (send_one(fd, t, opts, ctl) < 0)
-			return -1;
-	}
+/*
+ * With the thread engine, all children carve their RDMA buffers out of
+ * one arena that the parent maps before starting them. Each child gets
+ * a slice sized for its own options, which differ between --peers.
+ */
+static caddr_t		rdma_arena;
+static size_t		rdma_arena_len;
+static __thread caddr_t	rdma_slice;
 
-	return 0;
+static size_t rdma_buffers_len(struct options *opts)
+{
+	size_t len;
 
-eagain:
-	errno = EAGAIN;
-	return -1;
+	len = 2 * opts->nr_tasks * opts->req_depth * (opts->rdma_vector * opts->rdma_size) + sys_page_size;
+	return (len + sys_page_size - 1) & ~(sys_page_size - 1);
 }
 
-static int recv_message(int fd,
-		void *buffer, size_t size,
-		rds_rdma_cookie_t *cookie,
-		struct sockaddr_in *sin,
-		struct timeval *tstamp,
-		struct task *tasks,
-		struct options *opts)
+static caddr_t map_rdma_buffers(size_t len)
 {
-	struct cmsghdr *cmsg;
-	char cmsgbuf[256];
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t ret;
+	caddr_t	base;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name = (struct sockaddr *) sin;
-	msg.msg_namelen = sizeof(struct sockaddr_in);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-	iov.iov_base = buffer;
-	iov.iov_len = size;
+	/* We use mmap here rather than malloc, because it is always
+	 * page aligned. */
+	base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, 0, 0);
+	if (base == MAP_FAILED)
+		die_errno("alloc_rdma_buffers: mmap failed");
+	return base;
+}
 
-	ret = recvmsg(fd, &msg, MSG_DONTWAIT);
-	gettimeofday(tstamp, NULL);
+static void alloc_rdma_buffers(struct task *t, struct options *opts, int node)
+{
+	unsigned int i, j;
+	size_t len;
+	caddr_t	base;
 
-	if (ret < 0)
-		return ret;
-	if (ret && !strcmp(RDS_VERSION, peer_version) &&
-		ret < sizeof(struct header))
-		die("recvmsg() returned short data: %zd", ret);
-	if (ret && msg.msg_namelen < sizeof(struct sockaddr_in))
-		die("socklen = %d < sizeof(sin) (%zu)\n",
-		    msg.msg_namelen, sizeof(struct sockaddr_in));
+	len = rdma_buffers_len(opts);
+	if (rdma_slice)
+		base = rdma_slice;
+	else
+		base = map_rdma_buffers(len);
 
-	/* See if the message comes with a RDMA destination */
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		struct rds_rdma_notify notify;
+	/* before the first touch, so the pages land on our node */
+	prefer_node(base, len, node);
+	memset(base, 0x2f, len);
+	base += opts->rdma_alignment;
 
-		if (cmsg->cmsg_level != sol)
-			continue;
-		switch (cmsg->cmsg_type) {
-		case RDS_CMSG_CONG_UPDATE:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(uint64_t)))
-				die("RDS_CMSG_CONG_UPDATE data too small");
-			else {
-				unsigned int i, port;
-				uint64_t mask;
+	for (i = 0; i < opts->nr_tasks; ++i, ++t) {
+		for (j = 0; j < opts->req_depth; ++j) {
+			t->rdma_buf[j] = (uint64_t *) base;
+			base += opts->rdma_size * opts->rdma_vector;
 
-				memcpy(&mask, CMSG_DATA(cmsg), sizeof(mask));
-				for (i = 0; i < opt.nr_tasks; ++i) {
-					port = ntohs(tasks[i].dst_addr.sin_port);
-					if (mask & RDS_CONG_MONITOR_MASK(port))
-						tasks[i].congested = 0;
-				}
-			}
-			break;
-		case RDS_CMSG_RDMA_DEST:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(*cookie)))
-				die("RDS_CMSG_RDMA_DEST data too small");
-			memcpy(cookie, CMSG_DATA(cmsg), sizeof(*cookie));
-			break;
+			t->local_buf[j] = (uint64_t *) base;
+			base += opts->rdma_size * opts->rdma_vector;
 
-		case RDS_CMSG_RDMA_STATUS:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(notify)))
-				die("RDS_CMSG_RDMA_DEST data too small");
-			memcpy(&notify, CMSG_DATA(cmsg), sizeof(notify));
-			rdma_mark_completed(tasks, notify.user_token, notify.status, opts);
-			break;
+			t->rdma_req_key[j] = 0;
+			t->rdma_inflight[j] = 0;
 		}
 	}
-	return ret;
 }
 
-static int recv_one(int fd, struct task *tasks,
-			struct options *opts,
-		struct child_control *ctl,
-		struct child_control *all_ctl)
+static void rdma_build_req(int fd, struct header *hdr, struct task *t,
+		unsigned int rdma_size, unsigned int req_depth, int rw_mode, int rdma_vector)
 {
-	char buf[max(opts->req_size, opts->ack_size)];
-	rds_rdma_cookie_t rdma_dest = 0;
-	struct sockaddr_in sin;
-	struct header hdr, in_hdr;
-	struct timeval tstamp;
-	struct task *t;
-	uint16_t expect_index;
-	int task_index;
-	ssize_t ret;
-	int	check_status;
-
+	uint64_t *rdma_addr, *rdma_key_p;
 
-	ret = recv_message(fd, buf, sizeof(buf), &rdma_dest, &sin, &tstamp, tasks, opts);
-	if (ret < 0)
-		return ret;
+	rdma_addr = t->rdma_buf[t->send_index];
 
-	/* If we received only RDMA completions or cong updates,
-	 * ret will be 0 */
-	if (ret == 0) {
-		return 0;
-	}
+	rdma_key_p = &t->rdma_req_key[t->send_index];
+	if (opt.rdma_use_get_mr && *rdma_key_p == 0)
+		*rdma_key_p = get_rdma_key(fd, ptr64(rdma_addr), rdma_size * rdma_vector);
 
-	/* check the incoming sequence number */
-	task_index = ntohs(sin.sin_port) - opts->starting_port - 1;
-	if (task_index >= opts->nr_tasks)
-		die("received bad task index %u\n", task_index);
-	t = &tasks[task_index];
+	/* We alternate between RDMA READ and WRITEs */
+        if (M_RDMA_READWRITE == rw_mode)
+                t->rdma_next_op = RDMA_OP_TOGGLE(t->rdma_next_op);
+        else if (M_RDMA_READ_ONLY == rw_mode)
+                t->rdma_next_op = RDMA_OP_READ;
+        else
+                t->rdma_next_op = RDMA_OP_WRITE;
+	hdr->rdma_op = t->rdma_next_op;
 
-	/* make sure the incoming message's size matches its op */
-	decode_hdr(&in_hdr, (struct header *) buf);
-	switch(in_hdr.op) {
-	case OP_REQ:
-		stat_inc(&ctl->cur[S_REQ_RX_BYTES], ret);
-		if (ret != opts->req_size)
-			die("req size %zd, not %u\n", ret,
-			    opts->req_size);
-		expect_index = t->recv_index;
-		break;
-	case OP_ACK:
-		stat_inc(&ctl->cur[S_ACK_RX_BYTES], ret);
-		if (ret != opts->ack_size)
-			die("ack size %zd, not %u\n", ret,
-			    opts->ack_size);
+	hdr->rdma_pattern = (((uint64_t) t->send_seq) << 32) | getpid();
+	hdr->rdma_addr = ptr64(rdma_addr);
+	hdr->rdma_phyaddr = 0;
+	hdr->rdma_size = rdma_size;
+	hdr->rdma_key = *rdma_key_p;
+	hdr->rdma_vector = rdma_vector;
 
-		/* This ACK should be for the oldest outstanding REQ */
-		expect_index = (t->send_index - t->pending + opts->req_depth) % opts->req_depth;
-		break;
-	default:
-		die("unknown op %u\n", in_hdr.op);
+	if (RDMA_OP_READ == hdr->rdma_op) {
+		if (opt.verify)
+			rds_fill_buffer(rdma_addr, rdma_size, hdr->rdma_pattern);
+		trace("Requesting RDMA read for pattern %Lx "
+				"local addr to rdma read %p\n",
+				(unsigned long long) hdr->rdma_pattern,
+				rdma_addr);
+	} else {
+		if (opt.verify)
+			rds_fill_buffer(rdma_addr, rdma_size, 0);
+		trace("Requesting RDMA write for pattern %Lx "
+				"local addr to rdma write %p\n",
+				(unsigned long long) hdr->rdma_pattern,
+				rdma_addr);
 	}
+}
 
-	/*
-	 * Verify that the incoming header indicates that this
-	 * is the next in-order message to us.  We can't predict
-	 * op.
-	 */
-	hdr.op = in_hdr.op;
-	hdr.seq = t->recv_seq;
-	hdr.from_addr = sin.sin_addr.s_addr;
-	hdr.from_port = sin.sin_port;
-	hdr.to_addr = t->src_addr.sin_addr.s_addr;
-	hdr.to_port = t->src_addr.sin_port;
-	hdr.index = expect_index;
+static void rdma_validate(const struct header *in_hdr, struct options *opts)
+{
+	unsigned long	rdma_size;
+        unsigned long   rdma_vector;
 
-	check_status = check_hdr(buf, ret, &hdr, opts);
-	if (check_status) {
-		if (check_status > 0) {
-			die("header from %s:%u to id %u bogus\n",
-		    	inet_ntoa(sin.sin_addr), htons(sin.sin_port),
-		    	ntohs(t->src_addr.sin_port));
-		} else
-			return 0;
-	}
+	rdma_size = in_hdr->rdma_size;
+	if (rdma_size != opts->rdma_size)
+		die("Unexpected RDMA size %lu in request\n", rdma_size);
 
-	if (hdr.op == OP_ACK) {
-                uint64_t rtt_time = 
-                  usec_sub(&tstamp, &t->send_time[expect_index]);
+	rdma_vector = in_hdr->rdma_vector;
+        if (rdma_vector != opts->rdma_vector)
+                die("Unexpected RDMA vector %lu in request %u \n", rdma_vector, opts->rdma_vector);
 
-		stat_inc(&ctl->cur[S_RTT_USECS], rtt_time);
-                if (rtt_time > rtt_threshold)
-			print_outlier("Found RTT = 0x%lx\n", rtt_time);
 
-                if (show_histogram)
-                {
-                  ctl->latency_histogram[get_bucket(rtt_time)]++;
-                }
+	if (in_hdr->rdma_op != RDMA_OP_READ && in_hdr->rdma_op != RDMA_OP_WRITE)
+		die("Unexpected RDMA op %u in request\n", in_hdr->rdma_op);
 
-		if (t->pending > 0)
-			t->pending -= 1;
 
-		if (in_hdr.rdma_key)
-			rdma_process_ack(fd, &in_hdr, ctl);
-	} else {
-		struct header *ack_hdr;
+	trace("RDS received request to issue rdma %s len %lu rva %Lx key %Lx pattern %Lx\n",
+		in_hdr->rdma_op == RDMA_OP_WRITE? "write to" : "read from",
+		rdma_size,
+		(unsigned long long) in_hdr->rdma_addr,
+		(unsigned long long) in_hdr->rdma_key,
+		(unsigned long long) in_hdr->rdma_pattern);
+}
 
-		/* Build the ACK header right away */
-		ack_hdr = &t->ack_header[t->recv_index];
-		build_header(t, ack_hdr, OP_ACK, t->recv_index);
+static void rdma_build_ack(struct header *hdr, const struct header *in_hdr)
+{
+	hdr->rdma_op = in_hdr->rdma_op;
+	hdr->rdma_size = in_hdr->rdma_size;
+	hdr->rdma_key = in_hdr->rdma_key;
+	hdr->rdma_phyaddr = in_hdr->rdma_phyaddr; /* remote's address to rdma to / from */
+	hdr->rdma_addr = in_hdr->rdma_addr; /* remote's address to rdma to / from */
+	hdr->rdma_pattern = in_hdr->rdma_pattern;
+	hdr->rdma_vector = in_hdr->rdma_vector;
+}
 
-		/* The RDMA is performed at the time the ACK
-		 * message is sent. We need to mirror all
-		 * RDMA related header fields in our response
+static inline uint64_t rdma_user_token(struct task *t, unsigned int qindex,  unsigned int type, uint32_t seq)
+{
+	uint64_t tmp = seq;
+	return (tmp << 32) | ((t->nr * opt.req_depth + qindex) << 2 | type);
+}
+
+static void rdma_mark_completed(struct task *tasks, uint64_t token, int status, struct options *opts)
+{
+	struct task *t;
+	unsigned int i;
+	struct header *hdr = NULL;
+	uint32_t seq = token >> 32;
+	unsigned int type = token & 0x03;
+	unsigned int index = (token & 0xFFFFFFFF) >> 2;
+
+	trace("RDS rdma completion for token 0x%lx\n", token);
+
+	t = &tasks[index / opt.req_depth];
+	i = index % opt.req_depth;
+
+	if (opts->async) {
+		if (type == OP_REQ)
+			hdr = &t->req_header[i];
+		else
+			hdr = &t->ack2_header[i];
+	}
+
+	if (status) {
+		const char *errmsg;
+
+		switch (status) {
+		case RDS_RDMA_REMOTE_ERROR:
+			errmsg = "remote error"; break;
+		case RDS_RDMA_DROPPED:
+			errmsg = "operation was dropped"; break;
+		case RDS_RDMA_CANCELED:
+			errmsg = "operation was cancelled"; break;
+		case RDS_RDMA_OTHER_ERROR:
+			errmsg = "other error"; break;
+		default:
+			errmsg = "unknown error"; break;
+		}
+
+		trace("%s:%u: %s failed: %s\n",
+				inet_ntoa(t->dst_addr.sin_addr),
+				ntohs(t->dst_addr.sin_port),
+				type ? "SEND" : "RDMA",
+				errmsg);
+
+		if (hdr &&
+			(status == RDS_RDMA_DROPPED ||
+			 status == RDS_RDMA_REMOTE_ERROR)) {
+
+			if (hdr->seq == seq) {
+				hdr->retry = 1;
+				if (hdr->seq > t->last_retry_seq) {
+					if (status == RDS_RDMA_REMOTE_ERROR)
+						hdr->rdma_remote_err = 1;
+					t->retry_token[t->retry_index] = token;
+					t->retry_index = (t->retry_index + 1) %
+						(2 * opts->req_depth);
+					t->retries += 1;
+					t->last_retry_seq = hdr->seq;
+					if (t->retries > 2 * opts->req_depth)
+						die("Exceeded MAX retry entries..\n");
+				}
+			} else
+				die("SEQ Out-Of-Sync: %u/%u\n", hdr->seq, seq);
+		} else if (hdr) {
+			hdr->pending = 0;
+			hdr->retry = 0;
+			hdr->rdma_remote_err = 0;
+		}
+	} else if (hdr) {
+		hdr->pending = 0;
+		hdr->retry = 0;
+		hdr->rdma_remote_err = 0;
+	}
+
+	t->rdma_inflight[i] = 0;
+	t->drain_rdmas = 0;
+}
+
+/*
+ * Add a control message to the outgoing message
+ */
+static void rdma_put_cmsg(struct msghdr *msg, int type,
+			const void *ptr, size_t size)
+{
+	static __thread char ctlbuf[1024];
+	struct cmsghdr *cmsg;
+
+	if (!msg->msg_control) {
+		msg->msg_control = ctlbuf;
+		msg->msg_controllen = CMSG_SPACE(size);
+		cmsg = CMSG_FIRSTHDR(msg);
+	} else {
+		cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
+		msg->msg_controllen += CMSG_SPACE(size);
+	}
+
+	cmsg->cmsg_level = sol;
+	cmsg->cmsg_type = type;
+	cmsg->cmsg_len = CMSG_LEN(size);
+	memcpy(CMSG_DATA(cmsg), ptr, size);
+}
+
+/*
+ * This sets up all the fields for an RDMA transfer.
+ * The request is passed as a control message along with
+ * the ACK packet.
+ */
+static void rdma_build_cmsg_xfer(struct msghdr *msg, const struct header *hdr,
+		uint64_t user_token, void *local_buf)
+{
+
+#define RDS_MAX_IOV 512 /* FIX_ME - put this into rds.h or use socket max ?*/
+
+	static __thread struct rds_iovec iov[RDS_MAX_IOV];
+	struct rds_rdma_args args;
+	unsigned int rdma_size;
+	unsigned int rdma_vector;
+	unsigned int v;
+
+	rdma_size = hdr->rdma_size;
+	rdma_vector = hdr->rdma_vector;
+
+	trace("RDS issuing rdma for token 0x%lx key 0x%llx len %d local_buf %p vector %d\n",
+			user_token,
+			(unsigned long long) hdr->rdma_key,
+			rdma_size, local_buf,
+			rdma_vector);
+
+	/* rdma args */
+	memset(&args, 0, sizeof(args));
+
+	/* Set up the iovec pointing to the RDMA buffer */
+	args.local_vec_addr = (uint64_t) iov;
+	args.nr_local = rdma_vector;
+
+	for (v = 0; v < rdma_vector; v++) {
+		iov[v].addr = ptr64((local_buf + (rdma_size * v)));
+		iov[v].bytes = rdma_size;
+	}
+
+	/* The remote could either give us a physical address, or
+	 * an index into a zero-based FMR. Either way, we just copy it.
+	 */
+	args.remote_vec.addr = hdr->rdma_phyaddr;
+	args.remote_vec.bytes = rdma_size * rdma_vector;
+	args.cookie = hdr->rdma_key;
+
+	/* read or write */
+	switch (hdr->rdma_op) {
+	case RDMA_OP_WRITE:
+		args.flags = RDS_RDMA_READWRITE;
+
+		if (opt.verify)
+			rds_fill_buffer(local_buf, rdma_size, hdr->rdma_pattern);
+		break;
+
+	case RDMA_OP_READ:
+		args.flags = 0;
+		break;
+	}
+
+	/* Fence off subsequent SENDs - this is the default */
+	/* for rdma read operations. We force this fence to control */
+	/* order of remote immediate data rm completion */
+	/* If we do not use a fence the immediate send rm can complete */
+	/* before rdma data arrives.. */
+
+	if (!(args.flags & RDS_RDMA_READWRITE) && opt.rdma_use_fence)
+		args.flags |= RDS_RDMA_FENCE;
+
+	args.flags |= RDS_RDMA_NOTIFY_ME;
+	/* args.flags |= RDS_RDMA_REMOTE_COMPLETE; */
+	args.user_token = user_token;
+
+	rdma_put_cmsg(msg, RDS_CMSG_RDMA_ARGS, &args, sizeof(args));
+}
+
+static void build_cmsg_async_send(struct msghdr *msg, uint64_t user_token)
+{
+	struct rds_asend_args args = { 0 };
+
+	args.flags |= RDS_RDMA_NOTIFY_ME;
+	args.user_token = user_token;
+	rdma_put_cmsg(msg, RDS_CMSG_ASYNC_SEND, &args, sizeof(args));
+}
+
+static void rdma_build_cmsg_dest(struct msghdr *msg, rds_rdma_cookie_t rdma_dest)
+{
+	rdma_put_cmsg(msg, RDS_CMSG_RDMA_DEST, &rdma_dest, sizeof(rdma_dest));
+}
+
+static void rdma_build_cmsg_map(struct msghdr *msg, uint64_t addr, uint32_t size,
+			rds_rdma_cookie_t *cookie)
+{
+	struct rds_get_mr_args args;
+
+	args.vec.addr = addr;
+	args.vec.bytes = size;
+	args.cookie_addr = ptr64(cookie);
+	args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
+	if (opt.rdma_use_once)
+		args.flags |= RDS_RDMA_USE_ONCE;
+
+	rdma_put_cmsg(msg, RDS_CMSG_RDMA_MAP, &args, sizeof(args));
+}
+
+static void rdma_process_ack(int fd, struct header *hdr,
+		struct child_control *ctl)
+{
+	trace("RDS rcvd rdma %s ACK for request key %Lx len %u local addr %Lx\n",
+		  RDMA_OP_WRITE == hdr->rdma_op ? "write" : "read",
+		  (unsigned long long) hdr->rdma_key,
+		  hdr->rdma_size,
+		  (unsigned long long) hdr->rdma_addr);
+
+	/* Need to free the MR unless allocated with use_once */
+	if (!opt.rdma_use_once && !opt.rdma_cache_mrs)
+		free_rdma_key(fd, hdr->rdma_key);
+
+	/* if acking an rdma write request - then remote node wrote local host buffer
+	 * (data in) so count this as rdma data coming in (rdma_read) - else remote node read
+	 * local host buffer so count this as rdma write (data out)
+	 */
+	switch (hdr->rdma_op) {
+	case RDMA_OP_WRITE:
+		/* remote node wrote local buffer check pattern
+		 * sent via immediate data in rdma buffer
+		 */
+		stat_inc(&ctl->cur[S_MBUS_IN_BYTES],  hdr->rdma_size);
+
+		if (opt.verify) {
+			/* This funny looking cast avoids compile warnings
+			 * on 32bit platforms. */
+			rds_compare_buffer((void *)(unsigned long) hdr->rdma_addr,
+				hdr->rdma_size,
+				hdr->rdma_pattern);
+		}
+		break;
+
+	case RDMA_OP_READ:
+		stat_inc(&ctl->cur[S_MBUS_OUT_BYTES],  hdr->rdma_size);
+		break;
+	}
+}
+
+static void build_header(struct task *t, struct header *hdr,
+		unsigned int op, unsigned int qindex)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->op = op;
+	hdr->seq = t->send_seq;
+	hdr->from_addr = t->src_addr.sin_addr.s_addr;
+	hdr->from_port = t->src_addr.sin_port;
+	hdr->to_addr = t->dst_addr.sin_addr.s_addr;
+	hdr->to_port = t->dst_addr.sin_port;
+	hdr->index = qindex;
+}
+
+static inline int msg_is_batched(struct task *t, struct header *hdr,
+				  struct options *opts)
+{
+	return t->sendq && !opts->async && !hdr->rdma_op;
+}
+
+/*
+ * Every request and ack has its own send slot, by op and queue index,
+ * which is built up in place and handed to the kernel from there. A
+ * slot is only reused once the peer has seen what was sent from it.
+ *
+ * With --send-iov a slot is split into segments that live in separate
+ * pools: the first pool holds the header and first payload chunk of
+ * every slot, pool k the k-th chunk. Receive buffers are split the
+ * same way with --recv-iov. Smaller messages use fewer segments.
+ */
+struct msg_layout {
+	size_t		size;		/* largest message */
+	size_t		chunk;		/* payload bytes per segment */
+	size_t		stride;		/* of the header segments */
+	unsigned int	nr;		/* segments of the largest message */
+};
+
+/* every child lays out its own arena, see map_msg_arena() */
+static __thread struct msg_layout req_layout;
+static __thread struct msg_layout ack_layout;
+static __thread struct msg_layout recv_layout;
+static __thread unsigned int recv_slots;
+
+static size_t slot_stride(size_t size);
+
+/* room for either header, and the payload that the shorter one leaves */
+static void init_msg_layout(struct msg_layout *l, size_t size, unsigned int nr)
+{
+	size_t payload = size - HEADER_2_0_7_SIZE;
+
+	l->size = size;
+	l->chunk = slot_stride(max((payload + nr - 1) / nr, 1));
+	l->stride = slot_stride(sizeof(struct header) + l->chunk);
+	l->nr = max((payload + l->chunk - 1) / l->chunk, 1);
+}
+
+static size_t msg_layout_len(const struct msg_layout *l, unsigned int nr_slots)
+{
+	return nr_slots * (l->stride + (l->nr - 1) * l->chunk);
+}
+
+/* Point iov at the segments of a message of the given size in a slot */
+static unsigned int msg_segments(const struct msg_layout *l,
+				 unsigned char *base, unsigned int nr_slots,
+				 unsigned int slot, size_t bytes,
+				 struct iovec *iov)
+{
+	size_t payload = bytes - hdr_len;
+	unsigned int k;
+
+	iov[0].iov_base = base + slot * l->stride;
+	iov[0].iov_len = hdr_len + min(payload, l->chunk);
+	for (k = 1; payload > k * l->chunk; k++) {
+		iov[k].iov_base = base + nr_slots * l->stride +
+				  ((k - 1) * nr_slots + slot) * l->chunk;
+		iov[k].iov_len = min(payload - k * l->chunk, l->chunk);
+	}
+	return k;
+}
+
+static inline unsigned int msg_iov(struct task *t, const struct header *hdr,
+				   unsigned int bytes, struct iovec *iov)
+{
+	if (hdr->op == OP_REQ)
+		return msg_segments(&req_layout, t->req_slots, opt.req_depth,
+				    hdr->index, bytes, iov);
+	return msg_segments(&ack_layout, t->ack_slots, opt.req_depth,
+			    hdr->index, bytes, iov);
+}
+
+static int queue_msg(struct task *t, struct header *hdr, unsigned int size)
+{
+	struct send_queue *q = t->sendq;
+	struct send_entry *e;
+
+	if (q->count == q->nr)
+		die("send queue of task %u overflowed\n", t->nr);
+
+	e = &q->ent[(q->head + q->count++) % q->nr];
+	e->msg.msg_iovlen = msg_iov(t, hdr, size, e->iov);
+	fill_hdr(e->iov, size, hdr);
+	e->len = size;
+	e->op = hdr->op;
+	e->stamp = (hdr->op == OP_REQ) ? &t->send_time[hdr->index] : NULL;
+
+	hdr->pending = 1;
+	return size;
+}
+
+/*
+ * Send everything queued on all tasks, up to sb->nr messages per
+ * sendmmsg() call. A congested destination only holds back its own
+ * messages. Returns -1 with errno set to EAGAIN if the socket is full.
+ */
+static int flush_sends(int fd, struct task *tasks, struct options *opts,
+		       struct child_control *ctl, struct send_batch *sb)
+{
+	struct send_queue *q;
+	struct send_entry *e;
+	struct task *t;
+	unsigned int i, k, n;
+	uint64_t start, nsecs;
+	int ret;
+
+	sb->gen++;
+	while (1) {
+		n = 0;
+		for (i = 0, t = tasks; i < opts->nr_tasks && n < sb->nr; i++, t++) {
+			q = t->sendq;
+			if (t->flush_skip == sb->gen)
+				continue;
+			if (opt.use_cong_monitor && t->congested)
+				continue;
+			for (k = 0; k < q->count && n < sb->nr; k++) {
+				e = &q->ent[(q->head + k) % q->nr];
+				sb->vec[n].msg_hdr = e->msg;
+				sb->owner[n++] = t;
+			}
+		}
+		if (n == 0)
+			return 0;
+
+		start = now_ns();
+		ret = sendmmsg(fd, sb->vec, n, 0);
+		nsecs = now_ns() - start;
+		if (ret < 0) {
+			if (errno == ENOBUFS) {
+				task_congested(sb->owner[0]);
+				sb->owner[0]->flush_skip = sb->gen;
+				continue;
+			}
+			if (errno != EAGAIN)
+				die_errno("sendmmsg() failed");
+			return -1;
+		}
+
+		stat_inc(&ctl->cur[S_SEND_BATCH], ret);
+		nsecs /= ret;
+		for (k = 0; k < ret; k++) {
+			t = sb->owner[k];
+			q = t->sendq;
+			e = &q->ent[q->head];
+			if (sb->vec[k].msg_len != e->len)
+				die("sendmmsg() truncated - %u", sb->vec[k].msg_len);
+			if (e->stamp) {
+				/* open loop requests are timed from when they were due */
+				if (!opts->rate)
+					*e->stamp = start;
+				stat_inc(&ctl->cur[S_SENDMSG_NSECS], nsecs);
+			}
+			q->head = (q->head + 1) % q->nr;
+			q->count--;
+		}
+	}
+}
+
+/*
+ * The message arena holds every task's send slots, followed by the
+ * receive buffers. It is mapped per child, after placement, so the
+ * pages come from the child's node, and from huge pages if there are
+ * any reserved, or else transparent huge pages.
+ */
+#define SLOT_ALIGN	64
+#define HUGE_PAGE_SIZE	(2UL << 20)
+
+static __thread unsigned char *recv_buf;
+
+static unsigned int recv_segments(unsigned int slot, struct iovec *iov)
+{
+	return msg_segments(&recv_layout, recv_buf, recv_slots, slot,
+			    recv_layout.size, iov);
+}
+
+static size_t slot_stride(size_t size)
+{
+	return (size + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+}
+
+/* Copy the pattern into every segment of every slot of a pool */
+static void fill_msg_pattern(const struct msg_layout *l, unsigned char *base,
+			     unsigned int nr_slots)
+{
+	struct iovec iov[MSG_MAXIOVLEN];
+	size_t off, len, total = l->size - hdr_len;
+	unsigned char *p;
+	unsigned int i, k;
+
+	for (i = 0; i < nr_slots; i++) {
+		msg_segments(l, base, nr_slots, i, l->size, iov);
+		for (k = 0, off = 0; off < total; k++, off += len) {
+			p = payload_seg(iov, k, off, total, &len);
+			memcpy(p, msg_pattern + off, len);
+		}
+	}
+}
+
+static unsigned char *map_msg_arena(struct task *tasks, struct options *opts,
+				    unsigned int nr_recv, int node, size_t *lenp)
+{
+	size_t req_len, ack_len, len;
+	unsigned char *base, *p;
+	unsigned int i;
+
+	init_msg_layout(&req_layout, opts->req_size, send_iov_nr);
+	init_msg_layout(&ack_layout, opts->ack_size, send_iov_nr);
+	init_msg_layout(&recv_layout, max(opts->req_size, opts->ack_size),
+			recv_iov_nr);
+	recv_slots = nr_recv;
+	req_len = msg_layout_len(&req_layout, opts->req_depth);
+	ack_len = msg_layout_len(&ack_layout, opts->req_depth);
+	len = opts->nr_tasks * (req_len + ack_len) +
+	      msg_layout_len(&recv_layout, nr_recv);
+	len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+	base = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		    MAP_ANONYMOUS|MAP_PRIVATE|MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+		if (base == MAP_FAILED)
+			die_errno("mmap of %zu byte message arena failed", len);
+		madvise(base, len, MADV_HUGEPAGE);
+	}
+	prefer_node(base, len, node);
+
+	p = base;
+	for (i = 0; i < opts->nr_tasks; i++) {
+		tasks[i].req_slots = p;
+		p += req_len;
+		tasks[i].ack_slots = p;
+		p += ack_len;
+	}
+	recv_buf = p;
+
+	/* Payloads never change unless they are unique, so put the
+	 * pattern in once. */
+	if (opts->verify && opts->verify_mode != VERIFY_UNIQUE) {
+		for (i = 0; i < opts->nr_tasks; i++) {
+			fill_msg_pattern(&req_layout, tasks[i].req_slots,
+					 opts->req_depth);
+			fill_msg_pattern(&ack_layout, tasks[i].ack_slots,
+					 opts->req_depth);
+		}
+	}
+
+	*lenp = len;
+	return base;
+}
+
+static void alloc_batches(struct task *tasks, struct options *opts,
+			  struct recv_batch *rb, struct send_batch *sb,
+			  unsigned int nr)
+{
+	struct send_queue *q;
+	struct send_entry *e;
+	struct iovec *iov;
+	char *cmsgbufs;
+	unsigned int i, k;
+
+	rb->nr = nr;
+	rb->msgs = calloc(rb->nr, sizeof(*rb->msgs));
+	rb->iov = calloc(rb->nr * recv_iov_nr, sizeof(*rb->iov));
+	rb->sin = calloc(rb->nr, sizeof(*rb->sin));
+	cmsgbufs = malloc(rb->nr * RECV_CMSG_SPACE);
+	if (!rb->msgs || !rb->iov || !rb->sin || !cmsgbufs)
+		die("ERROR: failed to alloc memory\n");
+
+	for (i = 0; i < rb->nr; i++) {
+		struct msghdr *msg = &rb->msgs[i].msg_hdr;
+
+		msg->msg_name = &rb->sin[i];
+		msg->msg_iov = &rb->iov[i * recv_iov_nr];
+		msg->msg_iovlen = recv_segments(i, msg->msg_iov);
+		msg->msg_control = cmsgbufs + i * RECV_CMSG_SPACE;
+	}
+
+	if (sb) {
+		sb->nr = nr;
+		sb->gen = 0;
+		sb->vec = calloc(sb->nr, sizeof(*sb->vec));
+		sb->owner = calloc(sb->nr, sizeof(*sb->owner));
+		if (!sb->vec || !sb->owner)
+			die("ERROR: failed to alloc memory\n");
+	}
+
+	for (i = 0; i < opts->nr_tasks; i++) {
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			die("ERROR: failed to alloc memory\n");
+		q->nr = 2 * opts->req_depth;
+		q->ent = calloc(q->nr, sizeof(*q->ent));
+		iov = calloc(q->nr * send_iov_nr, sizeof(*iov));
+		if (!q->ent || !iov)
+			die("ERROR: failed to alloc memory\n");
+
+		/* the iovecs point at send slots as messages are queued */
+		for (k = 0, e = q->ent; k < q->nr; k++, e++) {
+			e->msg.msg_name = &tasks[i].dst_addr;
+			e->msg.msg_namelen = sizeof(tasks[i].dst_addr);
+			e->iov = iov + k * send_iov_nr;
+			e->msg.msg_iov = e->iov;
+		}
+		tasks[i].sendq = q;
+	}
+}
+
+static int send_msg(int fd, struct task *t, struct header *hdr,
+		    unsigned int size, struct options *opts, 
+		    struct child_control *ctl)
+{
+	uint8_t *rdma_flight_recorder = NULL;
+	rds_rdma_cookie_t cookie = 0;
+	struct msghdr msg;
+	struct iovec iov[MSG_MAXIOVLEN];
+	ssize_t ret;
+
+	if (msg_is_batched(t, hdr, opts))
+		return queue_msg(t, hdr, size);
+
+	/* Messages with control data go out on their own, but only
+	 * after everything queued before them. */
+	if (t->sendq && t->sendq->count) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name  = (struct sockaddr *) &t->dst_addr;
+	msg.msg_namelen = sizeof(t->dst_addr);
+
+	msg.msg_iovlen = msg_iov(t, hdr, size, iov);
+	msg.msg_iov = iov;
+	fill_hdr(iov, size, hdr);
+
+
+	/* If this is an ACK packet with RDMA, build the cmsg
+	   * header that goes with it. */
+	if (hdr->op == OP_ACK && hdr->rdma_op != 0 && !hdr->rdma_remote_err) {
+		unsigned int qindex = hdr->index;
+
+		if (t->rdma_inflight[qindex] != 0) {
+			/* It is unlikely but (provably) possible for
+			 * new requests to arrive before the RDMA notification.
+			 * That's because RDMA notifications are triggered
+			 * by the RDS ACK processing, which happens after new
+			 * messages were queued on the socket.
+			 *
+			 * We return one of the more obscure error messages,
+			 * which we recognize and handle in the top loop. */
+			trace("Drain RDMA 0x%lx\n", rdma_user_token(t, qindex, 0, hdr->seq));
+			errno = EBADSLT;
+			return -1;
+		}
+		rdma_build_cmsg_xfer(&msg, hdr,
+				rdma_user_token(t, qindex, 0, hdr->seq),
+				t->local_buf[qindex]);
+		rdma_flight_recorder = &t->rdma_inflight[qindex];
+	} else if (opts->async) {
+		if (hdr->op == OP_REQ)
+			build_cmsg_async_send(&msg,
+				rdma_user_token(t, hdr->index, OP_REQ, hdr->seq));
+		else
+			build_cmsg_async_send(&msg,
+				rdma_user_token(t, hdr->index, OP_ACK, hdr->seq));
+	}
+
+	if (hdr->op == OP_REQ && hdr->rdma_op != 0) {
+		if (hdr->rdma_key != 0) {
+			rdma_build_cmsg_dest(&msg, hdr->rdma_key);
+			cookie = hdr->rdma_key;
+			hdr->rdma_key = 0;
+		} else {
+			rdma_build_cmsg_map(&msg, hdr->rdma_addr,
+					hdr->rdma_size * hdr->rdma_vector,
+					&cookie);
+		}
+	}
+
+	ret = sendmsg(fd, &msg, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EMSGSIZE)
+			die("sendto() of %u bytes failed: larger than the kernel "
+			    "or the socket buffer allows\n", size);
+		if (errno != EAGAIN && errno != ENOBUFS)
+			die_errno("sendto() failed");
+		return ret;
+	}
+	if (ret != size)
+		die("sendto() truncated - %zd", ret);
+
+	if (rdma_flight_recorder)
+		*rdma_flight_recorder = 1;
+	if (cookie) {
+		/* We just happen to know that the r_key is in the
+		 * lower 32bit of the cookie */
+		rdma_key_o_meter_add(cookie);
+	}
+
+	hdr->pending = 1;
+
+	return ret;
+}
+
+static int send_packet(int fd, struct task *t,
+		struct header *hdr, unsigned int size,
+		struct options *opts, struct child_control *ctl)
+{
+	ssize_t ret;
+
+	/* Make sure we always have the current sequence number.
+	 * When we send ACK packets, the seq that gets filled in is
+	 * stale. */
+	hdr->seq = t->send_seq;
+
+	ret = send_msg(fd, t, hdr, size, opts, ctl);
+	if (ret < 0) return ret;
+
+	t->send_seq++;
+	return ret;
+}
+
+static int resend_packet(int fd, struct task *t,
+		struct header *hdr, unsigned int size,
+		struct options *opts, struct child_control *ctl)
+{
+	ssize_t ret;
+
+	ret = send_msg(fd, t, hdr, size, opts, ctl);
+
+	return ret;
+}
+
+static int send_one(int fd, struct task *t,
+		struct options *opts,
+		struct child_control *ctl)
+{
+	struct header *hdr = &t->req_header[t->send_index]; 
+	uint64_t start, stop;
+	uint32_t size;
+	int ret;
+
+	if (opts->async && hdr->pending) {
+		return -1;
+	}
+
+	build_header(t, hdr, OP_REQ, t->send_index);
+	if (opts->rdma_size && t->send_seq > 10)
+		rdma_build_req(fd, hdr, t,
+				opts->rdma_size,
+				opts->req_depth,
+				opts->rw_mode,
+				opts->rdma_vector);
+
+
+	size = pick_size(&req_sizes);
+	start = now_ns();
+	ret = send_packet(fd, t, hdr, size, opts, ctl);
+	stop = now_ns();
+
+	if (ret < 0)
+		return ret;
+
+	if (opts->rate) {
+		/* time the request from when it was due */
+		uint64_t due = t->due[t->due_head];
+
+		t->due_head = (t->due_head + 1) % opts->backlog;
+		t->due_count--;
+		stat_inc(&ctl->cur[S_SEND_LAG_NSECS], start - min(due, start));
+		t->send_time[t->send_index] = due;
+	} else
+		t->send_time[t->send_index] = start;
+	if (!opts->rdma_cache_mrs)
+		t->rdma_req_key[t->send_index] = 0; /* we consumed this key */
+	stat_inc(&ctl->cur[S_REQ_TX_BYTES], ret);
+	if (t->dest)
+		t->dest->req_tx++;
+	if (req_sizes.type != DIST_FIXED)
+		stat_inc(&ctl->size_tx[size_class(&req_sizes, size)], ret);
+	/* queued requests are timed when the batch goes out */
+	if (!msg_is_batched(t, hdr, opts))
+		stat_inc(&ctl->cur[S_SENDMSG_NSECS], stop - start);
+
+	t->send_index = (t->send_index + 1) % opts->req_depth;
+	t->pending++;
+	return ret;
+}
+
+static int send_ack(int fd, struct task *t, unsigned int qindex,
+		struct options *opts,
+		struct child_control *ctl)
+{
+	struct header *hdr = &t->ack_header[qindex];
+	struct header *hdr2 = &t->ack2_header[qindex];
+	uint32_t size;
+	ssize_t ret;
+
+	if (opts->async && hdr2->pending) {
+		return -1;
+	}
+
+	/* send an ack in response to the req we just got */
+	size = pick_size(&ack_sizes);
+	ret = send_packet(fd, t, hdr, size, opts, ctl);
+	if (ret < 0)
+		return ret;
+	if (ret != size)
+		die_errno("sendto() returned %zd", ret);
+
+	stat_inc(&ctl->cur[S_ACK_TX_BYTES], ret);
+
+	/* need separate rdma stats cells for send/recv */
+	switch (hdr->rdma_op) {
+	case RDMA_OP_WRITE:
+		stat_inc(&ctl->cur[S_MBUS_OUT_BYTES], opts->rdma_size);
+		break;
+
+	case RDMA_OP_READ:
+		stat_inc(&ctl->cur[S_MBUS_IN_BYTES], opts->rdma_size);
+		break;
+	}
+
+	memcpy(hdr2, hdr, sizeof(struct header));
+
+	return ret;
+}
+
+static int ack_anything(int fd, struct task *t,
+			struct options *opts,
+			struct child_control *ctl,
+			int can_send)
+{
+	while (t->unacked) {
+		uint16_t qindex;
+
+		qindex = (t->recv_index - t->unacked + opts->req_depth) % opts->req_depth;
+		if (!can_send)
+			goto eagain;
+		if (send_ack(fd, t, qindex, opts, ctl) < 0)
+			return -1;
+		t->unacked -= 1;
+	}
+	return 0;
+
+eagain:
+	errno = EAGAIN;
+	return -1;
+}
+
+static int send_anything(int fd, struct task *t,
+			struct options *opts,
+			struct child_control *ctl,
+			int can_send, int do_work)
+{
+	struct header *hdr;
+	unsigned int index;
+	int num_retries = t->retries;
+	uint64_t token;
+	unsigned int type;
+	unsigned int index2;
+	unsigned int i;
+
+	while (opts->async && num_retries > 0) {
+		index = (t->retry_index - num_retries +
+			(2 * opts->req_depth)) % (2 * opts->req_depth);
+
+		token = t->retry_token[index];
+		type = token & 0x03;
+		index2 = (token & 0xFFFFFFFF) >> 2;
+		i = index2 % opts->req_depth;
+
+		if (type == OP_REQ)
+			hdr = &t->req_header[i];
+		else
+			hdr = &t->ack2_header[i];
+
+		if (!hdr->retry)
+			goto next;
+
+		/* resend at the size it went out with */
+		if (resend_packet(fd, t, hdr, hdr->size, opts, ctl) < 0) {
+			return -1;
+		}
+		hdr->retry = 0;
+next:
+		num_retries--;
+	}
+	t->last_retry_seq = t->retries = 0;
+
+	if (ack_anything(fd, t, opts, ctl, can_send) < 0)
+		return -1;
+
+	while (do_work && t->pending < opts->req_depth &&
+	       (!opts->rate || t->due_count)) {
+		if (!can_send)
+			goto eagain;
+		if (send_one(fd, t, opts, ctl) < 0)
+			return -1;
+	}
+
+	return 0;
+
+eagain:
+	errno = EAGAIN;
+	return -1;
+}
+
+static void recv_check_msg(struct msghdr *msg, ssize_t ret,
+		rds_rdma_cookie_t *cookie,
+		struct task *tasks,
+		struct options *opts);
+
+static int recv_message(int fd,
+		struct iovec *iov, unsigned int nr_iov,
+		rds_rdma_cookie_t *cookie,
+		struct sockaddr_in *sin,
+		uint64_t *tstamp,
+		struct task *tasks,
+		struct options *opts)
+{
+	char cmsgbuf[RECV_CMSG_SPACE];
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (struct sockaddr *) sin;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nr_iov;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+	*tstamp = now_ns();
+
+	if (ret < 0)
+		return ret;
+
+	recv_check_msg(&msg, ret, cookie, tasks, opts);
+	return ret;
+}
+
+/*
+ * Sanity check a message we just received and act on the control
+ * messages that came with it.
+ */
+static void recv_check_msg(struct msghdr *msg, ssize_t ret,
+		rds_rdma_cookie_t *cookie,
+		struct task *tasks,
+		struct options *opts)
+{
+	struct cmsghdr *cmsg;
+
+	if (ret && ret < hdr_len)
+		die("recvmsg() returned short data: %zd", ret);
+	if (ret && msg->msg_namelen < sizeof(struct sockaddr_in))
+		die("socklen = %d < sizeof(sin) (%zu)\n",
+		    msg->msg_namelen, sizeof(struct sockaddr_in));
+
+	/* See if the message comes with a RDMA destination */
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		struct rds_rdma_notify notify;
+
+		if (cmsg->cmsg_level != sol)
+			continue;
+		switch (cmsg->cmsg_type) {
+		case RDS_CMSG_CONG_UPDATE:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(uint64_t)))
+				die("RDS_CMSG_CONG_UPDATE data too small");
+			else {
+				unsigned int i, port;
+				uint64_t mask;
+
+				memcpy(&mask, CMSG_DATA(cmsg), sizeof(mask));
+				for (i = 0; i < opt.nr_tasks; ++i) {
+					port = ntohs(tasks[i].dst_addr.sin_port);
+					if (mask & RDS_CONG_MONITOR_MASK(port))
+						tasks[i].congested = 0;
+				}
+			}
+			break;
+		case RDS_CMSG_RDMA_DEST:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(*cookie)))
+				die("RDS_CMSG_RDMA_DEST data too small");
+			memcpy(cookie, CMSG_DATA(cmsg), sizeof(*cookie));
+			break;
+
+		case RDS_CMSG_RDMA_STATUS:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(notify)))
+				die("RDS_CMSG_RDMA_DEST data too small");
+			memcpy(&notify, CMSG_DATA(cmsg), sizeof(notify));
+			rdma_mark_completed(tasks, notify.user_token, notify.status, opts);
+			break;
+		}
+	}
+}
+
+static int recv_process(int fd, struct task *tasks,
+		struct options *opts,
+		struct child_control *ctl,
+		const struct iovec *iov, ssize_t ret,
+		struct sockaddr_in *sin,
+		rds_rdma_cookie_t rdma_dest,
+		uint64_t tstamp);
+
+static int recv_one(int fd, struct task *tasks,
+			struct options *opts,
+		struct child_control *ctl,
+		struct child_control *all_ctl)
+{
+	rds_rdma_cookie_t rdma_dest = 0;
+	struct iovec iov[MSG_MAXIOVLEN];
+	struct sockaddr_in sin;
+	uint64_t tstamp;
+	ssize_t ret;
+
+	ret = recv_message(fd, iov, recv_segments(0, iov),
+			   &rdma_dest, &sin, &tstamp, tasks, opts);
+	if (ret < 0)
+		return ret;
+
+	return recv_process(fd, tasks, opts, ctl, iov, ret,
+			    &sin, rdma_dest, tstamp);
+}
+
+/*
+ * Batched receive: drain up to rb->nr messages with one recvmmsg() call,
+ * then handle each of them, control messages first, just like recv_one().
+ * Returns the number of messages received.
+ */
+static int recv_batch(int fd, struct task *tasks,
+		struct options *opts,
+		struct child_control *ctl,
+		struct recv_batch *rb)
+{
+	uint64_t tstamp;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < rb->nr; i++) {
+		rb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		rb->msgs[i].msg_hdr.msg_controllen = RECV_CMSG_SPACE;
+	}
+
+	ret = recvmmsg(fd, rb->msgs, rb->nr, MSG_DONTWAIT, NULL);
+	tstamp = now_ns();
+	if (ret <= 0)
+		return -1;
+
+	stat_inc(&ctl->cur[S_RECV_BATCH], ret);
+
+	for (i = 0; i < ret; i++) {
+		struct msghdr *msg = &rb->msgs[i].msg_hdr;
+		rds_rdma_cookie_t rdma_dest = 0;
+		ssize_t len = rb->msgs[i].msg_len;
+
+		recv_check_msg(msg, len, &rdma_dest, tasks, opts);
+		recv_process(fd, tasks, opts, ctl, msg->msg_iov, len,
+			     &rb->sin[i], rdma_dest, tstamp);
+	}
+
+	return ret;
+}
+
+static int recv_process(int fd, struct task *tasks,
+		struct options *opts,
+		struct child_control *ctl,
+		const struct iovec *iov, ssize_t ret,
+		struct sockaddr_in *sin,
+		rds_rdma_cookie_t rdma_dest,
+		uint64_t tstamp)
+{
+	struct header hdr, in_hdr;
+	struct task *t;
+	uint16_t expect_index;
+	int task_index;
+	int	check_status;
+
+	/* If we received only RDMA completions or cong updates,
+	 * ret will be 0 */
+	if (ret == 0) {
+		return 0;
+	}
+
+	/* check the incoming sequence number */
+	task_index = ntohs(sin->sin_port) - peer_port(opts) - 1;
+	if (task_index >= opts->nr_tasks)
+		die("received bad task index %u\n", task_index);
+	t = &tasks[task_index];
+
+	/* make sure the incoming message's size matches its op */
+	decode_hdr(&in_hdr, iov[0].iov_base);
+	switch(in_hdr.op) {
+	case OP_REQ:
+		stat_inc(&ctl->cur[S_REQ_RX_BYTES], ret);
+		check_msg_size(&req_sizes, ret, "req");
+		expect_index = t->recv_index;
+		break;
+	case OP_ACK:
+		stat_inc(&ctl->cur[S_ACK_RX_BYTES], ret);
+		check_msg_size(&ack_sizes, ret, "ack");
+
+		/* This ACK should be for the oldest outstanding REQ */
+		expect_index = (t->send_index - t->pending + opts->req_depth) % opts->req_depth;
+		break;
+	default:
+		die("unknown op %u\n", in_hdr.op);
+	}
+
+	/*
+	 * Verify that the incoming header indicates that this
+	 * is the next in-order message to us.  We can't predict
+	 * op.
+	 */
+	hdr.op = in_hdr.op;
+	hdr.seq = t->recv_seq;
+	hdr.from_addr = sin->sin_addr.s_addr;
+	hdr.from_port = sin->sin_port;
+	hdr.to_addr = t->src_addr.sin_addr.s_addr;
+	hdr.to_port = t->src_addr.sin_port;
+	hdr.index = expect_index;
+
+	check_status = check_hdr(iov, ret, &hdr, opts);
+	if (check_status) {
+		if (check_status > 0) {
+			die("header from %s:%u to id %u bogus\n",
+		    	inet_ntoa(sin->sin_addr), htons(sin->sin_port),
+		    	ntohs(t->src_addr.sin_port));
+		} else
+			return 0;
+	}
+
+	if (hdr.op == OP_ACK) {
+                uint64_t rtt_time = tstamp - t->send_time[expect_index];
+
+		stat_inc(&ctl->cur[S_RTT_NSECS], rtt_time);
+		if (t->dest) {
+			t->dest->rtt_nr++;
+			t->dest->rtt_sum += rtt_time;
+		}
+                if (rtt_time / 1000 > rtt_threshold)
+			print_outlier("Found RTT = 0x%lx\n", rtt_time / 1000);
+
+		ctl->hist[hist_index(rtt_time)]++;
+		if (req_sizes.type != DIST_FIXED)
+			stat_inc(&ctl->size_rtt[size_class(&req_sizes,
+					t->req_header[expect_index].size)],
+				 rtt_time);
+
+		if (t->pending > 0)
+			t->pending -= 1;
+
+		if (in_hdr.rdma_key)
+			rdma_process_ack(fd, &in_hdr, ctl);
+	} else {
+		struct header *ack_hdr;
+
+		/* Build the ACK header right away */
+		ack_hdr = &t->ack_header[t->recv_index];
+		build_header(t, ack_hdr, OP_ACK, t->recv_index);
+
+		/* The RDMA is performed at the time the ACK
+		 * message is sent. We need to mirror all
+		 * RDMA related header fields in our response
 		 * anyway, so that's a good place for send_ack
 		 * to pick them up from.
 		 */
-		if (rdma_dest)
-			in_hdr.rdma_key = rdma_dest;
-		if (in_hdr.rdma_key) {
-			rdma_validate(&in_hdr, opts);
-			rdma_build_ack(ack_hdr, &in_hdr);
+		if (rdma_dest)
+			in_hdr.rdma_key = rdma_dest;
+		if (in_hdr.rdma_key) {
+			rdma_validate(&in_hdr, opts);
+			rdma_build_ack(ack_hdr, &in_hdr);
+		}
+
+		t->unacked += 1;
+		t->recv_index = (t->recv_index + 1) % opts->req_depth;
+	}
+	t->recv_seq++;
+
+	return ret;
+}
+
+/*
+ * How a child waits for its socket. block sleeps in poll() (or
+ * io_uring_enter()), spin never sleeps, and hybrid keeps spinning for
+ * spin_budget usecs after the last message came in before it goes back
+ * to sleeping.
+ */
+enum {
+	POLL_BLOCK = 0,
+	POLL_SPIN,
+	POLL_HYBRID,
+};
+
+static const char *poll_mode_names[] = {
+	[POLL_BLOCK]	= "block",
+	[POLL_SPIN]	= "spin",
+	[POLL_HYBRID]	= "hybrid",
+};
+
+/*
+ * io_uring engine. The child keeps uring_depth RECVMSG requests posted
+ * on its socket at all times and hands the batched send queues to the
+ * kernel as SENDMSG requests, so it never sits in poll(). Each task's
+ * queued messages go out as one linked chain, and a task gets no new
+ * chain until the previous one completed, which keeps them in order.
+ * A timeout request wakes us up once a second to look at the parent.
+ */
+#ifdef HAVE_IO_URING
+enum {
+	URING_RECV = 1,
+	URING_SEND,
+	URING_TIMEOUT,
+	URING_POLLOUT,
+	URING_ALARM,
+};
+
+#define URING_DATA(type, task, slot) \
+	((type) | (uint64_t)(task) << 8 | (uint64_t)(slot) << 32)
+
+struct uring {
+	int			fd;
+	unsigned int		entries;
+	unsigned int		to_submit;
+	unsigned int		inflight_sends;
+	int			want_pollout;
+	int			pollout_armed;
+	int			alarm_armed;
+	unsigned int *		sq_head;
+	unsigned int *		sq_tail;
+	unsigned int *		sq_mask;
+	unsigned int *		sq_array;
+	unsigned int *		cq_head;
+	unsigned int *		cq_tail;
+	unsigned int *		cq_mask;
+	struct io_uring_sqe *	sqes;
+	struct io_uring_cqe *	cqes;
+	void *			sq_ring;
+	size_t			sq_ring_len;
+	void *			cq_ring;
+	size_t			cq_ring_len;
+	size_t			sqes_len;
+	struct recv_batch	rb;
+	struct __kernel_timespec tick;
+	struct __kernel_timespec alarm;
+};
+
+/*
+ * uring_depth receives and as many sends in flight, plus the two
+ * timeouts and the POLLOUT request. Nothing is left unsubmitted across calls to
+ * uring_wait(), so the submission ring can never fill up.
+ */
+static int uring_setup(struct uring *ring)
+{
+	struct io_uring_params p;
+	unsigned int entries = 1;
+	void *ptr;
+
+	while (entries < 2 * uring_depth + 3)
+		entries <<= 1;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_len = ring->cq_ring_len =
+			max(ring->sq_ring_len, ring->cq_ring_len);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto out_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto out_sq;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto out_cq;
+
+	ptr = ring->sq_ring;
+	ring->sq_head = ptr + p.sq_off.head;
+	ring->sq_tail = ptr + p.sq_off.tail;
+	ring->sq_mask = ptr + p.sq_off.ring_mask;
+	ring->sq_array = ptr + p.sq_off.array;
+
+	ptr = ring->cq_ring;
+	ring->cq_head = ptr + p.cq_off.head;
+	ring->cq_tail = ptr + p.cq_off.tail;
+	ring->cq_mask = ptr + p.cq_off.ring_mask;
+	ring->cqes = ptr + p.cq_off.cqes;
+
+	ring->tick.tv_sec = 1;
+	ring->tick.tv_nsec = 0;
+	return 0;
+
+out_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+out_sq:
+	munmap(ring->sq_ring, ring->sq_ring_len);
+out_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+static void uring_teardown(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * There is no SQ polling thread, so the kernel doesn't look at the
+ * submission ring before the next io_uring_enter() and we can publish
+ * the tail before the entry is filled in.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, int fd,
+					  unsigned int opcode, uint64_t data)
+{
+	unsigned int tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+		die("io_uring submission ring overflowed\n");
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = data;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+static void uring_post_recv(struct uring *ring, int fd, unsigned int slot)
+{
+	struct msghdr *msg = &ring->rb.msgs[slot].msg_hdr;
+	struct io_uring_sqe *sqe;
+
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_controllen = RECV_CMSG_SPACE;
+
+	sqe = uring_get_sqe(ring, fd, IORING_OP_RECVMSG,
+			    URING_DATA(URING_RECV, 0, slot));
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+}
+
+static void uring_post_timeout(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring, -1, IORING_OP_TIMEOUT,
+			    URING_DATA(URING_TIMEOUT, 0, 0));
+	sqe->addr = (unsigned long) &ring->tick;
+	sqe->len = 1;
+}
+
+static void uring_start(struct uring *ring, int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < ring->rb.nr; i++)
+		uring_post_recv(ring, fd, i);
+	uring_post_timeout(ring);
+}
+
+/*
+ * Hand every task's queued messages to the kernel, one linked chain
+ * per task, with no more than uring_depth sends in flight overall.
+ */
+static void uring_flush_sends(struct uring *ring, int fd, struct task *tasks,
+			      struct options *opts)
+{
+	struct io_uring_sqe *sqe;
+	struct send_queue *q;
+	struct send_entry *e;
+	struct task *t;
+	unsigned int i, k, n, slot;
+	uint64_t now = now_ns();
+
+	for (i = 0, t = tasks; i < opts->nr_tasks; i++, t++) {
+		q = t->sendq;
+		if (q->inflight || q->count == 0)
+			continue;
+		if (opt.use_cong_monitor && t->congested)
+			continue;
+
+		n = min(q->count, uring_depth - ring->inflight_sends);
+		if (n == 0)
+			break;
+
+		for (k = 0; k < n; k++) {
+			slot = (q->head + k) % q->nr;
+			e = &q->ent[slot];
+			sqe = uring_get_sqe(ring, fd, IORING_OP_SENDMSG,
+					    URING_DATA(URING_SEND, i, slot));
+			sqe->addr = (unsigned long) &e->msg;
+			sqe->len = 1;
+			if (k + 1 < n)
+				sqe->flags = IOSQE_IO_LINK;
+			if (e->stamp && !opts->rate)
+				*e->stamp = now;
+		}
+		q->inflight = n;
+		ring->inflight_sends += n;
+	}
+}
+
+/*
+ * A failed send cancels the rest of its chain. The messages stay at the
+ * head of their queue and go out again with the next chain.
+ */
+static void uring_send_done(struct task *t, unsigned int slot, int res)
+{
+	struct send_queue *q = t->sendq;
+
+	q->inflight--;
+	if (res < 0) {
+		if (res == -ENOBUFS)
+			task_congested(t);
+		else if (res != -EAGAIN && res != -ECANCELED && res != -EINTR) {
+			errno = -res;
+			die_errno("io_uring sendmsg failed");
+		}
+		return;
+	}
+
+	if (slot != q->head)
+		die("io_uring send for task %u completed out of order\n", t->nr);
+	if (res != q->ent[slot].len)
+		die("sendmsg() truncated - %d", res);
+
+	q->head = (q->head + 1) % q->nr;
+	q->count--;
+}
+
+/*
+ * Submit everything queued since the last call, wait up to wait_ns for
+ * a completion, and handle all of them. Returns the number of messages
+ * received.
+ */
+static int uring_wait(struct uring *ring, int fd, struct task *tasks,
+		      struct options *opts, struct child_control *ctl,
+		      uint64_t wait_ns)
+{
+	int wait = wait_ns != 0;
+
+	struct io_uring_cqe *cqe;
+	uint64_t tstamp;
+	unsigned int head, tail, n = 0;
+	int ret, nr_rx = 0;
+
+	if (ring->want_pollout && !ring->pollout_armed) {
+		struct io_uring_sqe *sqe;
+
+		sqe = uring_get_sqe(ring, fd, IORING_OP_POLL_ADD,
+				    URING_DATA(URING_POLLOUT, 0, 0));
+		sqe->poll_events = POLLOUT;
+		ring->pollout_armed = 1;
+	}
+	ring->want_pollout = 0;
+
+	/* the once a second tick covers anything longer */
+	if (wait_ns && wait_ns < NSEC_PER_SEC && !ring->alarm_armed) {
+		struct io_uring_sqe *sqe;
+
+		ring->alarm.tv_sec = 0;
+		ring->alarm.tv_nsec = wait_ns;
+		sqe = uring_get_sqe(ring, -1, IORING_OP_TIMEOUT,
+				    URING_DATA(URING_ALARM, 0, 0));
+		sqe->addr = (unsigned long) &ring->alarm;
+		sqe->len = 1;
+		ring->alarm_armed = 1;
+	}
+
+	/* a spinning caller only needs a system call to submit */
+	if (wait || ring->to_submit) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			      wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				die_errno("io_uring_enter() failed");
+			ret = 0;
+		}
+		/* one sample per system call */
+		stat_inc(&ctl->cur[S_URING_SQES], ret);
+		ring->to_submit -= ret;
+	}
+	tstamp = now_ns();
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		uint64_t data;
+		unsigned int slot;
+		int res;
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		data = cqe->user_data;
+		res = cqe->res;
+		slot = data >> 32;
+
+		switch (data & 0xff) {
+		case URING_RECV:
+			if (res >= 0) {
+				struct msghdr *msg = &ring->rb.msgs[slot].msg_hdr;
+				rds_rdma_cookie_t rdma_dest = 0;
+
+				recv_check_msg(msg, res, &rdma_dest, tasks, opts);
+				recv_process(fd, tasks, opts, ctl,
+					     msg->msg_iov, res,
+					     &ring->rb.sin[slot], rdma_dest, tstamp);
+				nr_rx++;
+			} else if (res != -EAGAIN && res != -EINTR) {
+				errno = -res;
+				die_errno("io_uring recvmsg failed");
+			}
+			uring_post_recv(ring, fd, slot);
+			break;
+		case URING_SEND:
+			ring->inflight_sends--;
+			uring_send_done(&tasks[(data >> 8) & 0xffffff], slot, res);
+			break;
+		case URING_TIMEOUT:
+			uring_post_timeout(ring);
+			break;
+		case URING_POLLOUT:
+			ring->pollout_armed = 0;
+			break;
+		case URING_ALARM:
+			ring->alarm_armed = 0;
+			break;
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	if (n)
+		stat_inc(&ctl->cur[S_URING_CQES], n);
+	return nr_rx;
+}
+#else
+struct uring {
+	int			fd;
+	int			want_pollout;
+	struct recv_batch	rb;
+};
+
+static int uring_setup(struct uring *ring)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static void uring_teardown(struct uring *ring) { }
+static void uring_start(struct uring *ring, int fd) { }
+static void uring_flush_sends(struct uring *ring, int fd, struct task *tasks,
+			      struct options *opts) { }
+static int uring_wait(struct uring *ring, int fd, struct task *tasks,
+		      struct options *opts, struct child_control *ctl,
+		      uint64_t wait_ns)
+{
+	return 0;
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Open loop. Each child generates its share of --rate arrivals on a
+ * fixed or Poisson schedule, whether or not acks come back, and hands
+ * them to its tasks round robin. A task has --backlog request slots
+ * instead of -d, so it sends an arrival as soon as it is due; only a
+ * full socket holds it back in the task's backlog. An arrival that
+ * would leave a task with more than --backlog requests out or waiting
+ * is dropped and counted. RTTs are measured from the arrival, so time
+ * spent waiting to be sent counts, and a stall can't hide by holding
+ * back the requests that would have seen it (coordinated omission).
+ */
+enum {
+	ARRIVAL_CONST = 0,
+	ARRIVAL_POISSON,
+};
+
+static const char *arrival_names[] = {
+	[ARRIVAL_CONST]		= "const",
+	[ARRIVAL_POISSON]	= "poisson",
+};
+
+struct arrivals {
+	double			next;		/* now_ns() time */
+	double			mean;		/* nsecs between arrivals */
+	unsigned int		task;
+	unsigned short		seed[3];
+};
+
+static double arrival_gap(struct arrivals *a, struct options *opts)
+{
+	if (opts->arrival == ARRIVAL_POISSON)
+		return -log(1.0 - erand48(a->seed)) * a->mean;
+	return a->mean;
+}
+
+static void arrivals_init(struct arrivals *a, struct options *opts,
+			  uint16_t id, uint64_t now)
+{
+	a->mean = (double) NSEC_PER_SEC * opts->nr_tasks / opts->rate;
+	a->task = id % opts->nr_tasks;
+	a->seed[0] = id;
+	a->seed[1] = getpid();
+	a->seed[2] = now;
+
+	/* spread the children's constant schedules over one interval */
+	if (opts->arrival == ARRIVAL_CONST)
+		a->next = now + a->mean * id / opts->nr_tasks;
+	else
+		a->next = now + arrival_gap(a, opts);
+}
+
+static void schedule_arrivals(struct arrivals *a, struct task *tasks,
+			      struct options *opts, struct child_control *ctl,
+			      uint64_t now)
+{
+	struct task *t;
+
+	while (a->next <= now) {
+		t = &tasks[a->task];
+		a->task = (a->task + 1) % opts->nr_tasks;
+
+		if (t->pending + t->due_count >= opts->backlog)
+			stat_inc(&ctl->cur[S_OL_DROPS], 1);
+		else
+			t->due[(t->due_head + t->due_count++) % opts->backlog] = a->next;
+
+		a->next += arrival_gap(a, opts);
+	}
+}
+
+/*
+ * How long to sleep before the next arrival. If every task already has
+ * --backlog requests out, an arrival can only be dropped, which we can
+ * just as well do when an ack wakes us up.
+ */
+static uint64_t arrival_wait(struct arrivals *a, struct task *tasks,
+			     struct options *opts, uint64_t now)
+{
+	uint16_t i;
+
+	for (i = 0; i < opts->nr_tasks; i++) {
+		if (tasks[i].pending < opts->req_depth)
+			return min(a->next - now, NSEC_PER_SEC);
+	}
+	return NSEC_PER_SEC;
+}
+
+/* point a task at the peer's task of the same number */
+static void task_dst(struct task *t, struct options *opts)
+{
+	t->dst_addr.sin_family = AF_INET;
+	t->dst_addr.sin_addr.s_addr = htonl(opts->send_addr);
+	t->dst_addr.sin_port = htons(peer_port(opts) + 1 + t->nr);
+	if (t->dest) {
+		t->dest->addr = t->dst_addr.sin_addr.s_addr;
+		t->dest->port = ntohs(t->dst_addr.sin_port);
+	}
+}
+
+/* forget everything about the last run, keeping the buffers */
+static void reset_task(struct task *t, struct options *opts)
+{
+	unsigned int depth = opts->req_depth;
+
+	t->pending = 0;
+	t->unacked = 0;
+	t->congested = 0;
+	t->drain_rdmas = 0;
+	t->send_seq = 0;
+	t->recv_seq = 0;
+	t->send_index = 0;
+	t->recv_index = 0;
+	t->retries = 0;
+	t->last_retry_seq = 0;
+	t->retry_index = 0;
+	t->flush_skip = 0;
+	t->due_head = 0;
+	t->due_count = 0;
+	t->rdma_next_op = (t->nr & 1)? RDMA_OP_READ : RDMA_OP_WRITE;
+
+	memset(t->send_time, 0, depth * sizeof(uint64_t));
+	memset(t->rdma_req_key, 0, depth * sizeof(uint64_t));
+	memset(t->rdma_inflight, 0, depth * sizeof(uint8_t));
+	memset(t->ack_header, 0, depth * sizeof(struct header));
+	memset(t->ack2_header, 0, depth * sizeof(struct header));
+	memset(t->req_header, 0, depth * sizeof(struct header));
+	memset(t->retry_token, 0, 2 * depth * sizeof(uint64_t));
+	if (t->sendq) {
+		t->sendq->head = 0;
+		t->sendq->count = 0;
+		t->sendq->inflight = 0;
+	}
+	task_dst(t, opts);
+}
+
+/*
+ * With --daemon a passive child outlives its run: it keeps its socket,
+ * message arena and batches, and waits here for the parent to hand it
+ * the options of the next run. Returns -1 once the pool is retired.
+ */
+static int park_child(pid_t parent_pid, struct child_control *ctl,
+		      struct options *opts, struct task *tasks, int fd,
+		      uint16_t id, int active)
+{
+	char drain[64];
+	uint16_t i;
+
+	ctl->parked = 1;
+	while (ctl->parked > 0) {
+		if (!use_threads)
+			check_parent(parent_pid);
+		usleep(1000);
+	}
+	if (ctl->parked < 0)
+		return -1;
+
+	*opts = ctl->run_opts;
+	opt = *opts;
+	size_rand[0] = opts->size_seed;
+	size_rand[1] = opts->size_seed >> 16;
+	size_rand[2] = id << 1 | active;
+	for (i = 0; i < opts->nr_tasks; i++)
+		reset_task(&tasks[i], opts);
+
+	/* whatever the last run left on the socket is stale now */
+	while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) >= 0)
+		;
+	return 0;
+}
+
+static void run_child(pid_t parent_pid, struct child_control *ctl,
+			struct child_control *all_ctl,
+		      struct options *opts, uint16_t id, int active)
+{
+	struct sockaddr_in sin;
+	struct pollfd pfd;
+	int fd;
+	uint16_t i;
+	ssize_t ret;
+	struct task tasks[opts->nr_tasks];
+	struct timespec wait = { 1, 0 };
+	struct recv_batch rb = { 0 };
+	struct send_batch sb = { 0 };
+	struct uring ring = { .fd = -1 };
+	uint64_t now = 0, last_rx, checked = 0;
+	struct arrivals arr;
+	unsigned char *arena;
+	size_t arena_len;
+        int do_work = opts->simplex ? active : 1;
+	int j, go;
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opts->starting_port + 1 + id);
+	sin.sin_addr.s_addr = htonl(opts->receive_addr);
+
+	/* give main display thread a little edge? */
+	nice(5);
+
+	apply_placement(ctl);
+
+	payload_pid = getpid();
+	sweep_step = &ctl->size_step;
+	hdr_len = wire_hdr_len(opts);
+
+	/* the same seed gives both sides the same sizes every run */
+	size_rand[0] = opts->size_seed;
+	size_rand[1] = opts->size_seed >> 16;
+	size_rand[2] = id << 1 | active;
+
+	/* send to *all* remote tasks */
+	memset(tasks, 0, sizeof(tasks));
+	for (i = 0; i < opts->nr_tasks; i++) {
+		tasks[i].nr = i;
+		tasks[i].src_addr = sin;
+		if (dest_stats)
+			tasks[i].dest = dest_stats + id * dest_stride + i;
+		task_dst(&tasks[i], opts);
+
+		tasks[i].send_time = malloc(opts->req_depth * sizeof(uint64_t));
+		if (!tasks[i].send_time) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].send_time, 0, opts->req_depth * sizeof(uint64_t));
+
+		tasks[i].rdma_req_key = malloc(opts->req_depth * sizeof(uint64_t));
+		if (!tasks[i].rdma_req_key) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].rdma_req_key, 0, opts->req_depth * sizeof(uint64_t));
+
+		tasks[i].rdma_inflight = malloc(opts->req_depth * sizeof(uint8_t));
+		if (!tasks[i].rdma_inflight) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].rdma_inflight, 0, opts->req_depth * sizeof(uint8_t));
+
+		tasks[i].rdma_buf = malloc(opts->req_depth * sizeof(uint64_t *));
+		if (!tasks[i].rdma_buf) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].rdma_buf , 0, opts->req_depth * sizeof(uint64_t *));
+
+		tasks[i].local_buf = malloc(opts->req_depth * sizeof(uint64_t *));
+		if (!tasks[i].local_buf) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].local_buf, 0, opts->req_depth * sizeof(uint64_t *));
+
+		tasks[i].ack_header = malloc(opts->req_depth * sizeof(struct header));
+		if (!tasks[i].ack_header) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].ack_header, 0, opts->req_depth * sizeof(struct header));
+
+		tasks[i].ack2_header = malloc(opts->req_depth * sizeof(struct header));
+		if (!tasks[i].ack2_header) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].ack2_header, 0, opts->req_depth * sizeof(struct header));
+
+		for (j=0;j<opts->req_depth;j++)
+			tasks[i].ack2_header[j].pending = 0;
+
+		tasks[i].req_header = malloc(opts->req_depth * sizeof(struct header));
+		if (!tasks[i].req_header) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].req_header, 0, opts->req_depth * sizeof(struct header));
+
+		for (j=0;j<opts->req_depth;j++)
+			tasks[i].req_header[j].pending = 0;
+
+		tasks[i].retry_token = malloc(2 * opts->req_depth * sizeof(uint64_t));
+		if (!tasks[i].retry_token) {
+			die("ERROR: failed to alloc memory\n");
+		}
+		memset(tasks[i].retry_token, 0, 2 * opts->req_depth * sizeof(uint64_t));
+
+		tasks[i].rdma_next_op = (i & 1)? RDMA_OP_READ : RDMA_OP_WRITE;
+
+		if (opts->rate) {
+			tasks[i].due = malloc(opts->backlog * sizeof(uint64_t));
+			if (!tasks[i].due)
+				die("ERROR: failed to alloc memory\n");
+		}
+	}
+
+	if (opts->rdma_size)
+		alloc_rdma_buffers(tasks, opts, ctl->node);
+
+	if (uring_depth && uring_setup(&ring) < 0 && !opts->suppress_warnings)
+		fprintf(stderr, "io_uring unavailable (%s), using poll()\n",
+			strerror(errno));
+
+	arena = map_msg_arena(tasks, opts, max(max(uring_depth, batch_size), 1),
+			      ctl->node, &arena_len);
+	if (ring.fd >= 0)
+		alloc_batches(tasks, opts, &ring.rb, NULL, uring_depth);
+	else if (batch_size > 1)
+		alloc_batches(tasks, opts, &rb, &sb, batch_size);
+
+	/* The socket stays non-blocking: io_uring ignores O_NONBLOCK on
+	 * sockets and polls for space and data itself. */
+	fd = rds_socket(opts, &sin);
+
+next_run:
+	go = __atomic_load_n(&gate->go, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&gate->nr_ready, 1, __ATOMIC_RELEASE);
+	futex(&gate->nr_ready, FUTEX_WAKE, 1, NULL);
+
+	while (__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE) == go) {
+		futex(&gate->go, FUTEX_WAIT, go, &wait);
+		if (!use_threads)
+			check_parent(parent_pid);
+	}
+	ctl->started_ns = monotonic_ns();
+
+	/* a peer serving several clients only says where its tasks
+	 * are once we are all set up */
+	if (ctl->peer_port && ctl->peer_port != peer_port(opts)) {
+		opts->peer_port = ctl->peer_port;
+		for (i = 0; i < opts->nr_tasks; i++)
+			task_dst(&tasks[i], opts);
+	}
+
+	sin.sin_family = AF_INET;
+
+	if (ring.fd >= 0)
+		uring_start(&ring, fd);
+
+	if (opts->rate) {
+		/* wake up for arrivals on time, not 50us late */
+		prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+		arrivals_init(&arr, opts, id, now_ns());
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN | POLLOUT;
+	last_rx = now_ns();
+	while (!ctl->terminate) {
+		struct task *t;
+		int can_send, spin = 0, nr_rx = 0;
+		uint64_t wait_ns = NSEC_PER_SEC;
+
+		if (poll_mode != POLL_BLOCK || opts->rate) {
+			now = now_ns();
+			spin = poll_mode == POLL_SPIN ||
+			       (poll_mode == POLL_HYBRID &&
+				now - last_rx < spin_budget * 1000ULL);
+		}
+
+		/* a spinning child looks at its parent once a second */
+		if (!use_threads && (!spin || now - checked >= NSEC_PER_SEC)) {
+			check_parent(parent_pid);
+			checked = now;
+		}
+
+		/* queue up the arrivals that have come due */
+		if (opts->rate && do_work && !ctl->stopping) {
+			schedule_arrivals(&arr, tasks, opts, ctl, now);
+			wait_ns = arrival_wait(&arr, tasks, opts, now);
+		}
+		if (spin)
+			wait_ns = 0;
+
+		if (ring.fd >= 0) {
+			/* receives are handled as they complete */
+			nr_rx = uring_wait(&ring, fd, tasks, opts, ctl, wait_ns);
+			pfd.revents = POLLOUT;
+		} else if (wait_ns == 0) {
+			pfd.revents = POLLIN | POLLOUT;
+		} else {
+			struct timespec ts;
+
+			ts.tv_sec = wait_ns / NSEC_PER_SEC;
+			ts.tv_nsec = wait_ns % NSEC_PER_SEC;
+			ret = ppoll(&pfd, 1, &ts, NULL);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				die_errno("poll failed");
+			}
+		}
+
+		pfd.events = POLLIN;
+
+		if (ring.fd < 0 && (pfd.revents & POLLIN)) {
+			if (rb.nr) {
+				/* a short batch means the socket is drained */
+				do {
+					ret = recv_batch(fd, tasks, opts, ctl, &rb);
+					if (ret > 0)
+						nr_rx += ret;
+				} while (ret == rb.nr);
+			} else {
+				while (recv_one(fd, tasks, opts, ctl, all_ctl) >= 0)
+					nr_rx++;
+			}
+		}
+
+		if (spin)
+			stat_inc(&ctl->cur[S_SPINS], 1);
+		if (nr_rx == 0)
+			stat_inc(&ctl->cur[S_EMPTY_POLLS], 1);
+		else if (poll_mode == POLL_HYBRID)
+			last_rx = now_ns();
+
+		/* stop sending if in shutdown phase */
+		if (ctl->stopping)
+			continue;
+
+		/* keep the pipeline full */
+		can_send = !!(pfd.revents & POLLOUT);
+		for (i = 0, t = tasks; i < opts->nr_tasks; i++, t++) {
+			if (opt.use_cong_monitor && t->congested)
+				continue;
+			if (t->drain_rdmas)
+				continue;
+			if (send_anything(fd, t, opts, ctl, can_send, do_work) < 0) {
+
+				pfd.events |= POLLOUT;
+
+				/* If the send queue is full, we will see EAGAIN.
+				 * If a particular destination is congested, the
+				 * kernel will return ENOBUFS. In the former case,
+				 * there's no point in trying other destinations;
+				 * in the latter case we certainly want to try
+				 * sending to other tasks.
+				 *
+				 * It would be nice if we could map the congestion
+				 * map into user space :-)
+				 */
+				if (errno == ENOBUFS)
+					task_congested(t);
+				else if (errno == EBADSLT)
+					t->drain_rdmas = 1;
+				else
+					break;
+			}
+		}
+
+		if (sb.nr && can_send && flush_sends(fd, tasks, opts, ctl, &sb) < 0)
+			pfd.events |= POLLOUT;
+
+		if (ring.fd >= 0) {
+			uring_flush_sends(&ring, fd, tasks, opts);
+			ring.want_pollout = !!(pfd.events & POLLOUT);
+		}
+	}
+
+	if (reuse_children) {
+		/* the next run posts its receives on a fresh ring */
+		if (ring.fd >= 0) {
+			struct recv_batch keep = ring.rb;
+
+			uring_teardown(&ring);
+			memset(&ring, 0, sizeof(ring));
+			ring.fd = -1;
+			ring.rb = keep;
+		}
+		if (park_child(parent_pid, ctl, opts, tasks, fd, id, active) == 0) {
+			if (ring.rb.nr && uring_setup(&ring) < 0)
+				die_errno("io_uring_setup failed");
+			goto next_run;
+		}
+	}
+
+	/* Only the thread engine gets here; forked children are killed */
+	if (ring.fd >= 0)
+		uring_teardown(&ring);
+	if (ring.rb.nr)
+		rb = ring.rb;
+	close(fd);
+	for (i = 0; i < opts->nr_tasks; i++) {
+		free(tasks[i].send_time);
+		free(tasks[i].rdma_req_key);
+		free(tasks[i].rdma_inflight);
+		free(tasks[i].rdma_buf);
+		free(tasks[i].local_buf);
+		free(tasks[i].ack_header);
+		free(tasks[i].ack2_header);
+		free(tasks[i].req_header);
+		free(tasks[i].retry_token);
+		free(tasks[i].due);
+		if (tasks[i].sendq) {
+			free(tasks[i].sendq->ent);
+			free(tasks[i].sendq);
+		}
+	}
+	munmap(arena, arena_len);
+	if (rb.nr) {
+		free(rb.msgs[0].msg_hdr.msg_control);
+		free(rb.msgs);
+		free(rb.iov);
+		free(rb.sin);
+		free(sb.vec);
+		free(sb.owner);
+	}
+}
+
+/*
+ * The thread engine runs every child as a thread of the parent. They
+ * share msg_pattern, the option block and one RDMA buffer arena, and
+ * each still has its own RDS socket.
+ */
+struct child_thread {
+	pthread_t		thread;
+	struct child_control	*ctl;
+	struct options		*opts;
+	struct options		opts_copy;	/* see child_options() */
+	caddr_t			rdma_slice;
+	uint16_t		id;
+	int			active;
+};
+
+static struct child_thread *child_threads;
+
+/* wait for nr children to be ready, or for one of them to die trying */
+static void wait_ready(int nr)
+{
+	struct timespec wait = { 0, 100 * 1000 * 1000 };
+	pid_t pid;
+	int seen;
+
+	while ((seen = __atomic_load_n(&gate->nr_ready, __ATOMIC_ACQUIRE)) < nr) {
+		futex(&gate->nr_ready, FUTEX_WAIT, seen, &wait);
+		if (use_threads)
+			continue;
+		pid = waitpid(-1, NULL, WNOHANG);
+		if (pid > 0)
+			die("child pid %u exited before it was ready\n", pid);
+	}
+}
+
+/* let all the ready children go at once */
+static void open_gate(void)
+{
+	gate->open_ns = monotonic_ns();
+	__atomic_add_fetch(&gate->go, 1, __ATOMIC_RELEASE);
+	futex(&gate->go, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static void *child_thread_main(void *arg)
+{
+	struct child_thread *ct = arg;
+
+	opt = *ct->opts;
+	rdma_slice = ct->rdma_slice;
+	rdma_key_o_meter_set_self(ct->id);
+	run_child(0, ct->ctl + ct->id, ct->ctl, ct->opts, ct->id, ct->active);
+	return NULL;
+}
+
+static void start_child_threads(struct child_control *ctl,
+				struct options *opts, int active)
+{
+	struct child_thread *ct;
+	struct options copy;
+	sigset_t sigint, old;
+	size_t off;
+	uint32_t i;
+	int err;
+
+	child_threads = calloc(opts->nr_tasks, sizeof(*child_threads));
+	if (!child_threads)
+		die("ERROR: failed to alloc memory\n");
+
+	if (opts->rdma_size) {
+		rdma_arena_len = 0;
+		for (i = 0; i < opts->nr_tasks; i++)
+			rdma_arena_len +=
+				rdma_buffers_len(child_options(opts, i, &copy));
+		rdma_arena = map_rdma_buffers(rdma_arena_len);
+	}
+
+	/* ctl-c is for the parent's thread, see catch_interrupts() */
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, &old);
+
+	for (i = 0, off = 0, ct = child_threads; i < opts->nr_tasks; i++, ct++) {
+		ct->ctl = ctl;
+		ct->opts_copy = *child_options(opts, i, &copy);
+		ct->opts = &ct->opts_copy;
+		if (rdma_arena) {
+			ct->rdma_slice = rdma_arena + off;
+			off += rdma_buffers_len(ct->opts);
+		}
+		ct->id = i;
+		ct->active = active;
+
+		err = pthread_create(&ct->thread, NULL, child_thread_main, ct);
+		if (err)
+			die("creating child thread nr %u failed: %s\n", i,
+			    strerror(err));
+		ctl[i].pid = getpid();
+
+		/* Only the first child reports socket buffer warnings;
+		 * it is done with rds_socket() once it's ready. */
+		if (i == 0) {
+			wait_ready(1);
+			opts->suppress_warnings = 1;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_child_threads(struct child_control *ctl, uint16_t nr_tasks)
+{
+	uint16_t i;
+
+	for (i = 0; i < nr_tasks; i++)
+		ctl[i].terminate = 1;
+	for (i = 0; i < nr_tasks; i++)
+		pthread_join(child_threads[i].thread, NULL);
+
+	free(child_threads);
+	child_threads = NULL;
+	if (rdma_arena) {
+		munmap(rdma_arena, rdma_arena_len);
+		rdma_arena = NULL;
+	}
+}
+
+/* the children's mapping: controls, histograms, the gate, dest_stats */
+static size_t control_len(uint16_t nr_tasks)
+{
+	size_t len;
+
+	len = nr_tasks * (sizeof(struct child_control) +
+			  hist_len * sizeof(uint64_t)) + sizeof(*gate);
+	if (task_stats)
+		len += (size_t) nr_tasks * nr_tasks * sizeof(*dest_stats);
+	return len;
+}
+
+static struct child_control *start_children(struct options *opts, int active)
+{
+	struct child_control *ctl;
+	struct options copy;
+	pid_t parent = getpid();
+	pid_t pid;
+	size_t len;
+	uint32_t i;
+
+	startup_ns = monotonic_ns();
+	hist_init();
+
+	len = control_len(opts->nr_tasks);
+	ctl = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_SHARED,
+		   0, 0);
+	if (ctl == MAP_FAILED)
+		die("mmap of %u child control structs failed", opts->nr_tasks);
+
+	memset(ctl, 0, len);
+	for (i = 0; i < opts->nr_tasks; i++) {
+		ctl[i].hist = (uint64_t *) (ctl + opts->nr_tasks) + i * hist_len;
+		ctl[i].run_opts = *child_options(opts, i, &copy);
+	}
+	gate = (struct start_gate *) (ctl[0].hist + opts->nr_tasks * hist_len);
+	if (task_stats) {
+		dest_stats = (struct dest_stats *) (gate + 1);
+		dest_stride = opts->nr_tasks;
+	}
+
+	verify_init();
+	parse_size_dist(&req_sizes, opts->req_dist, opts->req_size, "--req-sizes");
+	parse_size_dist(&ack_sizes, opts->ack_dist, opts->ack_size, "--ack-sizes");
+	init_msg_pattern(opts);
+	place_children(ctl, opts);
+
+	if (opts->rdma_key_o_meter)
+		rdma_key_o_meter_init(opts->nr_tasks);
+
+	if (use_threads) {
+		start_child_threads(ctl, opts, active);
+		wait_ready(opts->nr_tasks);
+		startup_ns = monotonic_ns() - startup_ns;
+		return ctl;
+	}
+
+	for (i = 0; i < opts->nr_tasks; i++) {
+		pid = fork();
+		if (pid == -1)
+			die_errno("forking child nr %u failed", i);
+		if (pid == 0) {
+			signal(SIGINT, SIG_IGN);
+			close_control();
+			rdma_key_o_meter_set_self(i);
+			opts = child_options(opts, i, &copy);
+			opts->suppress_warnings = (i > 0);
+			if (!active && nr_peers > 1) {
+				/* a client of ours, with its own sizes */
+				opt = *opts;
+				parse_size_dist(&req_sizes, opts->req_dist,
+						opts->req_size, "--req-sizes");
+				parse_size_dist(&ack_sizes, opts->ack_dist,
+						opts->ack_size, "--ack-sizes");
+			}
+			run_child(parent, ctl + i, ctl, opts, i, active);
+			exit(0);
+		}
+		ctl[i].pid = pid;
+	}
+
+	wait_ready(opts->nr_tasks);
+	startup_ns = monotonic_ns() - startup_ns;
+
+	return ctl;
+}
+
+static double avg(struct counter *ctr)
+{
+	if (ctr->nr)
+		return (double)ctr->sum / (double)ctr->nr;
+	else
+		return 0.0;
+}
+
+static double throughput(struct counter *disp)
+{
+	return disp[S_REQ_TX_BYTES].sum + disp[S_REQ_RX_BYTES].sum +
+		disp[S_ACK_TX_BYTES].sum + disp[S_ACK_RX_BYTES].sum;
+}
+
+static double throughput_mbi(struct counter *disp)
+{
+	return disp[S_MBUS_IN_BYTES].sum;
+}
+
+static double throughput_mbo(struct counter *disp)
+{
+        return disp[S_MBUS_OUT_BYTES].sum;
+}
+
+void stat_snapshot(struct counter *disp, struct child_control *ctl,
+		   uint16_t nr_tasks)
+{
+	struct counter tmp[NR_STATS];
+	uint16_t i;
+	uint16_t s;
+
+	memset(disp, 0, sizeof(tmp));
+
+	for (i = 0; i < nr_tasks; i++) {
+		memcpy(tmp, ctl[i].cur, sizeof(tmp));
+
+		for (s = 0; s < NR_STATS; s++) {
+			disp[s].nr += tmp[s].nr - ctl[i].last[s].nr;
+			disp[s].sum += tmp[s].sum - ctl[i].last[s].sum;
+			disp[s].min = minz(tmp[s].min, ctl[i].last[s].min);
+			disp[s].max = max(tmp[s].max, ctl[i].last[s].max);
+		}
+
+		memcpy(ctl[i].last, tmp, sizeof(tmp));
+	}
+}
+
+/*
+ * Like stat_snapshot(), for the RTT histograms: sum up what the children
+ * recorded since the last call and remember where they are now. last
+ * holds hist_len counts per child.
+ */
+static void hist_snapshot(uint64_t *disp, struct child_control *ctl,
+			  uint64_t *last, uint16_t nr_tasks)
+{
+	uint64_t *cur, val;
+	unsigned int i;
+	uint16_t k;
+
+	memset(disp, 0, hist_len * sizeof(*disp));
+
+	for (k = 0; k < nr_tasks; k++, last += hist_len) {
+		cur = ctl[k].hist;
+		for (i = 0; i < hist_len; i++) {
+			val = cur[i];
+			disp[i] += val - last[i];
+			last[i] = val;
+		}
+	}
+}
+
+void stat_accumulate(struct counter *accum, const struct counter *cur)
+{
+	uint16_t s;
+
+	for (s = 0; s < NR_STATS; ++s, ++cur, ++accum) {
+		accum->nr += cur->nr;
+		accum->sum += cur->sum;
+		accum->min = minz(accum->min, cur->min);
+		accum->max = max(accum->max, cur->max);
+	}
+}
+
+void stat_total(struct counter *disp, struct child_control *ctl,
+		uint16_t nr_tasks)
+{
+	uint16_t i;
+	uint16_t s;
+
+	memset(disp, 0, sizeof(struct counter) * NR_STATS);
+
+	for (i = 0; i < nr_tasks; i++) {
+		for (s = 0; s < NR_STATS; s++) {
+			disp[s].nr += ctl[i].cur[s].nr;
+			disp[s].sum += ctl[i].cur[s].sum;
+			disp[s].min = minz(disp[s].min, ctl[i].cur[s].min);
+			disp[s].max = max(disp[s].max, ctl[i].cur[s].max);
+		}
+	}
+}
+
+static double cpu_use(struct soak_control *soak_arr)
+{
+	struct soak_control *soak;
+	uint64_t capacity = 0;
+	uint64_t soaked = 0;
+	uint64_t this;
+
+	if (soak_arr == NULL)
+		return -1.0;
+
+	for (soak = soak_arr; soak && soak->per_sec; soak++) {
+		capacity += soak->per_sec;
+		this = soak->counter;
+		soaked += min(soak->per_sec, this - soak->last);
+		soak->last = this;
+	}
+
+	return (double)(capacity - soaked) * 100 / (double)capacity;
+}
+
+static void
+get_stats(int initialize)
+{
+#define NTIMES 8
+	struct sys_stats {
+		/* Where we spent out time */
+		unsigned long long	times[NTIMES];
+		unsigned long long	other;
+
+		/* Interrupt count */
+		unsigned long long	intr;
+	};
+	static struct sys_stats prev, current;
+	static int disable = 0;
+	char buffer[2048];
+	FILE *fp;
+
+	if (disable)
+		return;
+	if ((fp = fopen("/proc/stat", "r")) == NULL) {
+		fprintf(stderr, "Cannot open /proc/stat (%s) - "
+				"not printing cpu stats\n",
+				strerror(errno));
+		disable = 1;
+		return;
+	}
+
+	memset(&current, 0, sizeof(current));
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (!strncmp(buffer, "cpu ", 4)) {
+			char	*s = buffer + 4;
+			int	j;
+
+			for (j = 0; 1; ++j) {
+				unsigned long long v;
+
+				while (*s == ' ')
+					++s;
+				if (!isdigit(*s))
+					break;
+				v = strtoull(s, &s, 10);
+				if (j < NTIMES)
+					current.times[j] = v;
+				else
+					current.other += v;
+			}
+		} else
+		if (!strncmp(buffer, "intr ", 5)) {
+			sscanf(buffer + 5, "%Lu", &current.intr);
+		}
+	}
+	fclose(fp);
+
+	if (initialize) {
+		printf(",user:percent,system:percent,idle:percent"
+		       ",irq:percent,intr:count");
+	} else {
+		struct sys_stats sys;
+		unsigned long sum = 0;
+		double scale;
+		int j;
+
+		sum = sys.other = current.other - prev.other;
+		for (j = 0; j < NTIMES; ++j) {
+			sys.times[j] = current.times[j] - prev.times[j];
+			sum += current.times[j];
+		}
+		sys.intr = current.intr - prev.intr;
+
+		scale = sum? 100.0 / sum : 0;
+
+		/* Magic procfs offsets
+		 *  0	user
+		 *  1	nice
+		 *  2	system
+		 *  3	idle
+		 *  4	iowait
+		 *  5	irq
+		 *  6	softirq
+		 */
+		printf(",%f,%f,%f,%f,%Lu",
+			(sys.times[0] + sys.times[1]) * scale,
+			sys.times[2] * scale,
+			(sys.times[3] + sys.times[4]) * scale,
+			(sys.times[5] + sys.times[6]) * scale,
+			sys.intr);
+	}
+	prev = current;
+}
+
+/*
+ * Read the RDS counters into a new array. Returns NULL with errno set
+ * if the kernel doesn't let us.
+ */
+static struct rds_info_counter *read_rds_counters(int *countp)
+{
+	static unsigned char *curr = NULL;
+	static socklen_t buflen = 0;
+	static int sock_fd = -1;
+	struct rds_info_counter *ctr;
+	int i, count, item_size;
+
+	if (sock_fd < 0) {
+		sock_fd = socket(pf, SOCK_SEQPACKET, 0);
+		if (sock_fd < 0)
+			return NULL;
+	}
+
+	/* We should only loop once on the first call; after that the
+	 * buffer requirements for RDS counters should not change. */
+	while ((item_size = getsockopt(sock_fd, sol, RDS_INFO_COUNTERS, curr, &buflen)) < 0) {
+		if (errno != ENOSPC)
+			return NULL;
+		curr = realloc(curr, buflen);
+		if (!curr)
+			die_errno("Cannot allocate buffer for stats counters");
+	}
+
+	if (item_size > sizeof(*ctr))
+		die("Bad counter item size in RDS_INFO_COUNTERS (got %d, max %zd)\n",
+				item_size, sizeof(*ctr));
+	count = buflen / item_size;
+
+	ctr = calloc(count, sizeof(*ctr));
+	if (!ctr)
+		die("ERROR: failed to alloc memory\n");
+	for (i = 0; i < count; ++i)
+		memcpy(ctr + i, curr + i * item_size, item_size);
+
+	*countp = count;
+	return ctr;
+}
+
+static void
+get_perfdata(int initialize)
+{
+	static struct timeval last_ts, now;
+	static struct rds_info_counter *prev;
+	struct rds_info_counter *ctr;
+	int i, count;
+
+	ctr = read_rds_counters(&count);
+	if (!ctr)
+		die_errno("getsockopt(RDS_INFO_COUNTERS) failed");
+
+	if (prev == NULL) {
+		/* First call - allocate buffer */
+		prev = calloc(count, sizeof(*ctr));
+	}
+
+	gettimeofday(&now, NULL);
+
+	if (initialize) {
+		for (i = 0; i < count; ++i) {
+			printf(",%s", ctr[i].name);
+			if (strstr((char *) ctr[i].name, "_bytes"))
+				printf(":bytes");
+			else
+				printf(":count");
+		}
+	} else {
+		double scale;
+
+		scale = 1e6 / usec_sub(&now, &last_ts);
+		for (i = 0; i < count; ++i) {
+			printf(",%f",
+				(ctr[i].value - prev[i].value) * scale);
+		}
+	}
+
+	memcpy(prev, ctr, count * sizeof(*ctr));
+	free(ctr);
+	last_ts = now;
+
+	get_stats(initialize);
+}
+
+static int reap_one_child(int wflags)
+{
+	pid_t pid;
+	int status;
+
+	pid = waitpid(-1, &status, wflags);
+	if (pid < 0)
+		die("waitpid returned %u", pid);
+	if (pid == 0)
+		return 0;
+
+	if (WIFEXITED(status)) {
+		if (WEXITSTATUS(status) == 0)
+			return 1;
+		die("child pid %u exited with status %d\n",
+				pid, WEXITSTATUS(status));
+	}
+	if (WIFSIGNALED(status)) {
+		if (WTERMSIG(status) == SIGTERM)
+			return 1;
+		die("child pid %u exited with signal %d\n",
+				pid, WTERMSIG(status));
+	}
+	die("child pid %u wait status %d\n", pid, status);
+}
+
+/* blank out what may change between two runs of the same children */
+static void pool_key(struct options *o)
+{
+	o->send_addr = 0;
+	o->run_time = 0;
+	o->summary_only = 0;
+	o->rtprio = 0;
+	o->tracing = 0;
+	o->show_params = 0;
+	o->show_perfdata = 0;
+	o->suppress_warnings = 0;
+	o->connect_retries = 0;
+	o->rate = !!o->rate;		/* the backlog is allocated or not */
+	o->arrival = 0;
+	o->size_seed = 0;
+	o->verify_sample = 0;
+	o->peer_port = 0;
+	o->matrix = 0;
+}
+
+/*
+ * Can the parked children of the last run take on this one? Children
+ * that RDMA keep no state we could trust from one run to the next.
+ */
+static int pool_fits(struct child_control *ctl, uint16_t nr_pool,
+		     struct options *opts)
+{
+	struct options copy, a, b;
+	uint16_t i;
+
+	if (nr_pool != opts->nr_tasks || opts->rdma_size)
+		return 0;
+	for (i = 0; i < nr_pool; i++) {
+		a = ctl[i].run_opts;
+		b = *child_options(opts, i, &copy);
+		pool_key(&a);
+		pool_key(&b);
+		if (memcmp(&a, &b, sizeof(a)))
+			return 0;
+	}
+	return 1;
+}
+
+/* --daemon ends a run by parking the children instead of killing them */
+static void park_children(struct child_control *ctl, uint16_t nr_tasks)
+{
+	uint16_t i;
+
+	for (i = 0; i < nr_tasks; i++)
+		ctl[i].terminate = 1;
+	for (i = 0; i < nr_tasks; i++) {
+		while (ctl[i].parked <= 0) {
+			if (!use_threads && reap_one_child(WNOHANG))
+				die("child %u (pid %u) exited\n", i, ctl[i].pid);
+			usleep(1000);
+		}
+	}
+}
+
+/* hand the parked children the next run and wait till they are ready */
+static void unpark_children(struct child_control *ctl, struct options *opts)
+{
+	struct options copy;
+	uint16_t i;
+
+	startup_ns = monotonic_ns();
+	gate->nr_ready = 0;
+	for (i = 0; i < opts->nr_tasks; i++) {
+		ctl[i].run_opts = *child_options(opts, i, &copy);
+		ctl[i].stopping = 0;
+		ctl[i].terminate = 0;
+		ctl[i].size_step = 0;
+		ctl[i].peer_port = 0;
+		ctl[i].started_ns = 0;
+		memset(ctl[i].cur, 0, sizeof(ctl[i].cur));
+		memset(ctl[i].last, 0, sizeof(ctl[i].last));
+		memset(ctl[i].size_tx, 0, sizeof(ctl[i].size_tx));
+		memset(ctl[i].size_rtt, 0, sizeof(ctl[i].size_rtt));
+		memset(ctl[i].hist, 0, hist_len * sizeof(uint64_t));
+		if (dest_stats)
+			memset(dest_stats + i * dest_stride, 0,
+			       dest_stride * sizeof(*dest_stats));
+		ctl[i].parked = 0;
+	}
+	wait_ready(opts->nr_tasks);
+	startup_ns = monotonic_ns() - startup_ns;
+}
+
+/* let go of parked children that don't fit the next run */
+static void retire_children(struct child_control *ctl, uint16_t nr_tasks)
+{
+	uint16_t i;
+
+	for (i = 0; i < nr_tasks; i++)
+		ctl[i].parked = -1;
+	if (use_threads) {
+		stop_child_threads(ctl, nr_tasks);
+	} else {
+		for (i = 0; i < nr_tasks; i++)
+			kill(ctl[i].pid, SIGTERM);
+		for (i = 0; i < nr_tasks; i++)
+			reap_one_child(0);
+	}
+	munmap(ctl, control_len(nr_tasks));
+	dest_stats = NULL;
+}
+
+/*
+ * RTT p50, p99 and max over one interval, in usecs.
+ */
+static void print_rtt_tail(const uint64_t *hist, int perfdata)
+{
+	uint64_t total = hist_total(hist);
+	double p50 = 0, p99 = 0, top = 0;
+
+	if (total) {
+		p50 = hist_percentile(hist, total, 50) / 1000.0;
+		p99 = hist_percentile(hist, total, 99) / 1000.0;
+		top = hist_max(hist) / 1000.0;
+	}
+
+	if (perfdata)
+		printf(",%f,%f,%f", p50, p99, top);
+	else
+		printf(" %8.2f %8.2f %8.2f", p50, p99, top);
+}
+
+/*
+ * Columns that are only shown when the feature behind them is in use.
+ */
+static void print_extra_header(int perfdata)
+{
+	if (batch_size > 1) {
+		if (perfdata)
+			printf(",rx_batch:count,tx_batch:count");
+		else
+			printf(" %7s %7s", "rx/call", "tx/call");
+	}
+	if (uring_depth) {
+		if (perfdata)
+			printf(",sqe:count,cqe:count,enter:count");
+		else
+			printf(" %7s %7s %7s", "sqe/s", "cqe/s", "enter/s");
+	}
+	if (opt.rate) {
+		if (perfdata)
+			printf(",send_lag:microseconds,dropped:count");
+		else
+			printf(" %7s %7s", "lag us", "drop/s");
+	}
+	if (poll_mode != POLL_BLOCK) {
+		if (perfdata)
+			printf(",spin:count,empty_poll:count");
+		else
+			printf(" %8s %8s", "spin/s", "empty/s");
+	}
+}
+
+/*
+ * For the io_uring counters, sum is the number of queue entries and nr
+ * the number of calls that went with them.
+ */
+static void print_extra_stats(struct counter *disp, double scale, int perfdata)
+{
+	if (batch_size > 1) {
+		if (perfdata)
+			printf(",%f,%f", avg(&disp[S_RECV_BATCH]),
+			       avg(&disp[S_SEND_BATCH]));
+		else
+			printf(" %7.2f %7.2f", avg(&disp[S_RECV_BATCH]),
+			       avg(&disp[S_SEND_BATCH]));
+	}
+	if (uring_depth) {
+		if (perfdata)
+			printf(",%f,%f,%f", scale * disp[S_URING_SQES].sum,
+			       scale * disp[S_URING_CQES].sum,
+			       scale * disp[S_URING_SQES].nr);
+		else
+			printf(" %7.0f %7.0f %7.0f", scale * disp[S_URING_SQES].sum,
+			       scale * disp[S_URING_CQES].sum,
+			       scale * disp[S_URING_SQES].nr);
+	}
+	if (opt.rate) {
+		if (perfdata)
+			printf(",%f,%f", avg(&disp[S_SEND_LAG_NSECS]) / 1000.0,
+			       scale * disp[S_OL_DROPS].nr);
+		else
+			printf(" %7.2f %7.0f", avg(&disp[S_SEND_LAG_NSECS]) / 1000.0,
+			       scale * disp[S_OL_DROPS].nr);
+	}
+	if (poll_mode != POLL_BLOCK) {
+		if (perfdata)
+			printf(",%f,%f", scale * disp[S_SPINS].nr,
+			       scale * disp[S_EMPTY_POLLS].nr);
+		else
+			printf(" %8.0f %8.0f", scale * disp[S_SPINS].nr,
+			       scale * disp[S_EMPTY_POLLS].nr);
+	}
+}
+
+/* min/avg/max of a nanosecond counter, in usecs */
+static void print_nsecs(const char *name, struct counter *ctr)
+{
+	if (ctr->nr == 0)
+		return;
+	printf("%-8s min %.3f avg %.3f max %.3f\n", name,
+	       ctr->min / 1000.0, avg(ctr) / 1000.0, ctr->max / 1000.0);
+}
+
+/*
+ * Merge the children's RTT histograms and print the tail percentiles,
+ * and with --show-histogram the power of two table in usecs as well.
+ */
+static void print_rtt_histogram(struct child_control *ctl, uint16_t nr_tasks,
+				uint64_t max_rtt)
+{
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	uint64_t log2_rows[64] = { 0 };
+	unsigned int i, k, rows;
+	uint64_t *hist, total, val;
+
+	hist = calloc(hist_len, sizeof(*hist));
+	if (!hist)
+		die("ERROR: failed to alloc memory\n");
+	for (k = 0; k < nr_tasks; k++) {
+		for (i = 0; i < hist_len; i++)
+			hist[i] += ctl[k].hist[i];
+	}
+
+	total = hist_total(hist);
+	/* goes under the rtt min/avg/max line */
+	if (total) {
+		printf("%-8s", "");
+		for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+			val = hist_percentile(hist, total, pct[i]);
+			printf(" p%g %.3f", pct[i], min(val, max_rtt) / 1000.0);
+		}
+		printf("\n");
+	}
+
+	if (show_histogram) {
+		/* sub-usec times go into the first row, as they always did */
+		rows = HIST_LOG2_ROWS;
+		for (i = 0; i < hist_len; i++) {
+			val = hist_value(i) / 1000;
+			k = val ? 63 - __builtin_clzll(val) : 0;
+			log2_rows[k] += hist[i];
+			if (hist[i] && k >= rows)
+				rows = k + 1;
+		}
+
+		printf("\nRTT histogram\n");
+		printf("RTT (us)        \t\t    Count\n");
+		for (i = 0; i < rows; i++)
+			printf("[%6llu - %6llu] \t\t %8"PRIu64"\n", 1ULL << i,
+			       1ULL << (i + 1), log2_rows[i]);
+	}
+
+	free(hist);
+}
+
+/*
+ * Sum the children's per size class counters: request bytes sent in
+ * cls[0], round trip times in cls[1].
+ */
+static void size_class_total(struct counter cls[2][MAX_SIZE_CLASSES],
+			     struct child_control *ctl, uint16_t nr)
+{
+	unsigned int c;
+	uint16_t i;
+
+	memset(cls, 0, 2 * sizeof(cls[0]));
+	for (i = 0; i < nr; i++) {
+		for (c = 0; c < MAX_SIZE_CLASSES; c++) {
+			cls[0][c].nr += ctl[i].size_tx[c].nr;
+			cls[0][c].sum += ctl[i].size_tx[c].sum;
+			cls[1][c].nr += ctl[i].size_rtt[c].nr;
+			cls[1][c].sum += ctl[i].size_rtt[c].sum;
+		}
+	}
+}
+
+static void print_size_classes(struct counter first[2][MAX_SIZE_CLASSES],
+			       struct counter last[2][MAX_SIZE_CLASSES],
+			       double scale)
+{
+	const struct size_dist *d = &req_sizes;
+	uint64_t tx_nr, tx_sum, rtt_nr, rtt_sum, all = 0;
+	uint32_t lo, hi;
+	unsigned int c, shift;
+	char label[32];
+
+	for (c = 0; c < MAX_SIZE_CLASSES; c++)
+		all += last[0][c].nr - first[0][c].nr;
+	if (!all)
+		return;
+
+	printf("\nRequest sizes (seed %u)\n", opt.size_seed);
+	printf("%-21s %6s %10s %10s %8s\n",
+	       "bytes", "reqs %", "tx/s", "tx K/s", "rtt us");
+
+	shift = 31 - __builtin_clz(d->min);
+	for (c = 0; c < MAX_SIZE_CLASSES; c++) {
+		tx_nr = last[0][c].nr - first[0][c].nr;
+		tx_sum = last[0][c].sum - first[0][c].sum;
+		rtt_nr = last[1][c].nr - first[1][c].nr;
+		rtt_sum = last[1][c].sum - first[1][c].sum;
+		if (!tx_nr)
+			continue;
+
+		if (d->type == DIST_WEIGHTED || d->type == DIST_SWEEP) {
+			snprintf(label, sizeof(label), "%u", d->size[c]);
+		} else {
+			lo = c ? 1U << (shift + c) : d->min;
+			hi = c == MAX_SIZE_CLASSES - 1 ? d->max :
+				min((2ULL << (shift + c)) - 1, d->max);
+			snprintf(label, sizeof(label), "%u-%u", lo, hi);
+		}
+
+		printf("%-21s %6.2f %10.2f %10.2f %8.2f\n", label,
+		       100.0 * tx_nr / all, scale * tx_nr,
+		       scale * tx_sum / 1024.0,
+		       rtt_nr ? rtt_sum / 1000.0 / rtt_nr : 0.0);
+	}
+}
+
+static void peer_hist_alloc(void)
+{
+	unsigned int p;
+
+	for (p = 0; p < nr_peers; p++) {
+		free(peers[p].hist_first);
+		free(peers[p].hist_last);
+		peers[p].hist_first = calloc(hist_len, sizeof(uint64_t));
+		peers[p].hist_last = calloc(hist_len, sizeof(uint64_t));
+		if (!peers[p].hist_first || !peers[p].hist_last)
+			die("ERROR: failed to alloc memory\n");
+	}
+}
+
+/*
+ * Totals of each peer's run of children, at the start of the run or
+ * the latest at its end.
+ */
+static void peer_totals(struct child_control *ctl, int last)
+{
+	struct peer *pr;
+	uint64_t *hist;
+	unsigned int p, h;
+	uint16_t i;
+
+	for (p = 0, pr = peers; p < nr_peers; p++, pr++) {
+		stat_total(last ? pr->last : pr->first,
+			   ctl + pr->first_task, pr->nr_tasks);
+		hist = last ? pr->hist_last : pr->hist_first;
+		memset(hist, 0, hist_len * sizeof(*hist));
+		for (i = pr->first_task; i < pr->first_task + pr->nr_tasks; i++) {
+			for (h = 0; h < hist_len; h++)
+				hist[h] += ctl[i].hist[h];
+		}
+	}
+}
+
+/*
+ * Every peer's share, and Jain's fairness index of the bytes moved:
+ * 1 when all peers got the same, 1/n when one of n got everything.
+ */
+static void print_peers(double scale, int active)
+{
+	struct peer *pr;
+	uint64_t total, tx, rx, bytes, rtt_nr, rtt_sum;
+	double p50, p99, sum = 0, sum_sq = 0;
+	unsigned int p, h, s;
+
+	printf("\n%s\n", active ? "Destinations" : "Clients");
+	printf("%-15s %8s %8s %10s %8s %8s %8s\n",
+	       "peer", "tx/s", "rx/s", "tx+rx K/s", "rtt us", "p50 us", "p99 us");
+
+	for (p = 0, pr = peers; p < nr_peers; p++, pr++) {
+		for (h = 0; h < hist_len; h++)
+			pr->hist_last[h] -= pr->hist_first[h];
+		total = hist_total(pr->hist_last);
+		p50 = total ? hist_percentile(pr->hist_last, total, 50) / 1000.0 : 0;
+		p99 = total ? hist_percentile(pr->hist_last, total, 99) / 1000.0 : 0;
+
+		tx = pr->last[S_REQ_TX_BYTES].nr - pr->first[S_REQ_TX_BYTES].nr;
+		rx = pr->last[S_REQ_RX_BYTES].nr - pr->first[S_REQ_RX_BYTES].nr;
+		for (s = S_REQ_TX_BYTES, bytes = 0; s <= S_ACK_RX_BYTES; s++)
+			bytes += pr->last[s].sum - pr->first[s].sum;
+		rtt_nr = pr->last[S_RTT_NSECS].nr - pr->first[S_RTT_NSECS].nr;
+		rtt_sum = pr->last[S_RTT_NSECS].sum - pr->first[S_RTT_NSECS].sum;
+
+		printf("%-15s %8.0f %8.0f %10.2f %8.2f %8.2f %8.2f\n",
+		       inet_ntoa_32(htonl(pr->addr)), scale * tx, scale * rx,
+		       scale * bytes / 1024.0,
+		       rtt_nr ? rtt_sum / 1000.0 / rtt_nr : 0.0, p50, p99);
+		sum += bytes;
+		sum_sq += (double) bytes * bytes;
+	}
+	if (sum_sq)
+		printf("fairness %.4f\n", sum * sum / (nr_peers * sum_sq));
+}
+
+/*
+ * --task-stats in the parent. Every interval ranks the children by their
+ * p99 and prints the worst task_stats of them. The summary ranks all of
+ * them, then every destination port, then the mean RTT from each child
+ * to each of its destinations.
+ */
+struct task_row {
+	uint16_t	task;
+	uint64_t	tx;
+	uint64_t	rx;
+	uint64_t	rtt_nr;
+	uint64_t	rtt_sum;	/* nsecs */
+	uint64_t	cong;
+	uint64_t	p50;		/* nsecs */
+	uint64_t	p99;
+};
+
+static struct task_row		*task_rows;
+static struct task_row		*task_first;	/* at the start of the run */
+static struct task_row		*task_last;	/* at the last interval */
+static uint64_t			*task_hist_first;
+static uint64_t			*task_hist;
+static struct dest_stats	*dest_first;
+static struct dest_stats	*dest_last;
+
+static uint64_t task_cong(const struct dest_stats *tab, uint16_t i)
+{
+	uint64_t cong = 0;
+	uint16_t k;
+
+	for (k = 0, tab += i * dest_stride; k < dest_stride; k++)
+		cong += tab[k].congested;
+	return cong;
+}
+
+/* child i's totals, as a base for its rows */
+static void task_base(struct task_row *row, const struct counter *cur,
+		      const struct dest_stats *tab, uint16_t i)
+{
+	row->tx = cur[S_REQ_TX_BYTES].nr;
+	row->rx = cur[S_REQ_RX_BYTES].nr;
+	row->rtt_nr = cur[S_RTT_NSECS].nr;
+	row->rtt_sum = cur[S_RTT_NSECS].sum;
+	row->cong = task_cong(tab, i);
+}
+
+/* what child i did between base and now, hist counts since hist_base */
+static void task_row(struct task_row *row, uint16_t i,
+		     const struct task_row *now, const struct task_row *base,
+		     const uint64_t *hist, const uint64_t *hist_base)
+{
+	uint64_t total;
+	unsigned int h;
+
+	row->task = i;
+	row->tx = now->tx - base->tx;
+	row->rx = now->rx - base->rx;
+	row->rtt_nr = now->rtt_nr - base->rtt_nr;
+	row->rtt_sum = now->rtt_sum - base->rtt_sum;
+	row->cong = now->cong - base->cong;
+
+	for (h = 0; h < hist_len; h++)
+		task_hist[h] = hist[h] - hist_base[h];
+	total = hist_total(task_hist);
+	row->p50 = total ? hist_percentile(task_hist, total, 50) : 0;
+	row->p99 = total ? hist_percentile(task_hist, total, 99) : 0;
+}
+
+/* worst p99 first, then the worst mean */
+static int task_row_cmp(const void *a, const void *b)
+{
+	const struct task_row *x = a, *y = b;
+	double ax = x->rtt_nr ? (double) x->rtt_sum / x->rtt_nr : 0;
+	double ay = y->rtt_nr ? (double) y->rtt_sum / y->rtt_nr : 0;
+
+	if (x->p99 != y->p99)
+		return (x->p99 < y->p99) - (x->p99 > y->p99);
+	return (ax < ay) - (ax > ay);
+}
+
+/* the children are warmed up, hist_last is where they are now */
+static void task_stats_start(struct child_control *ctl,
+			     const uint64_t *hist_last, uint16_t nr_tasks)
+{
+	size_t len = (size_t) nr_tasks * dest_stride * sizeof(*dest_stats);
+	uint16_t i;
+
+	task_rows = calloc(nr_tasks, sizeof(*task_rows));
+	task_first = calloc(nr_tasks, sizeof(*task_first));
+	task_last = calloc(nr_tasks, sizeof(*task_last));
+	task_hist_first = malloc(nr_tasks * hist_len * sizeof(uint64_t));
+	task_hist = malloc(hist_len * sizeof(uint64_t));
+	dest_first = malloc(len);
+	dest_last = malloc(len);
+	if (!task_rows || !task_first || !task_last || !task_hist_first ||
+	    !task_hist || !dest_first || !dest_last)
+		die("ERROR: failed to alloc memory\n");
+
+	memcpy(dest_first, dest_stats, len);
+	for (i = 0; i < nr_tasks; i++)
+		task_base(&task_first[i], ctl[i].last, dest_first, i);
+	memcpy(task_last, task_first, nr_tasks * sizeof(*task_last));
+	memcpy(task_hist_first, hist_last,
+	       nr_tasks * hist_len * sizeof(uint64_t));
+}
+
+/*
+ * Before the interval's stat_snapshot(): rank what every child did
+ * since the last one.
+ */
+static void task_stats_interval(struct child_control *ctl,
+				const uint64_t *hist_last, uint16_t nr_tasks)
+{
+	struct task_row now;
+	uint16_t i;
+
+	for (i = 0; i < nr_tasks; i++) {
+		task_base(&now, ctl[i].cur, dest_stats, i);
+		task_row(&task_rows[i], i, &now, &task_last[i], ctl[i].hist,
+			 hist_last + i * hist_len);
+		task_last[i] = now;
+	}
+	qsort(task_rows, nr_tasks, sizeof(*task_rows), task_row_cmp);
+}
+
+static void print_task_rows(uint16_t nr, struct options *opts, double scale,
+			    const char *indent)
+{
+	const struct task_row *row;
+	uint16_t i;
+
+	printf("%s%4s %5s %8s %8s %8s %8s %8s %8s\n", indent,
+	       "task", "port", "tx/s", "rx/s", "rtt us", "p50 us", "p99 us",
+	       "cong/s");
+	for (i = 0, row = task_rows; i < nr; i++, row++) {
+		printf("%s%4u %5u %8.0f %8.0f %8.2f %8.2f %8.2f %8.2f\n",
+		       indent, row->task, opts->starting_port + 1 + row->task,
+		       scale * row->tx, scale * row->rx,
+		       row->rtt_nr ? row->rtt_sum / 1000.0 / row->rtt_nr : 0.0,
+		       row->p50 / 1000.0, row->p99 / 1000.0,
+		       scale * row->cong);
+	}
+}
+
+/* the last interval is in, hold on to where the destinations were */
+static void task_stats_end(uint16_t nr_tasks)
+{
+	memcpy(dest_last, dest_stats,
+	       (size_t) nr_tasks * dest_stride * sizeof(*dest_stats));
+}
+
+static int dest_port_cmp(const void *a, const void *b)
+{
+	const struct dest_stats *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return (ntohl(x->addr) > ntohl(y->addr)) -
+		       (ntohl(x->addr) < ntohl(y->addr));
+	return (x->port > y->port) - (x->port < y->port);
+}
+
+/* slowest round trip first */
+static int dest_rtt_cmp(const void *a, const void *b)
+{
+	const struct dest_stats *x = a, *y = b;
+	double ax = x->rtt_nr ? (double) x->rtt_sum / x->rtt_nr : 0;
+	double ay = y->rtt_nr ? (double) y->rtt_sum / y->rtt_nr : 0;
+
+	return (ax < ay) - (ax > ay);
+}
+
+/*
+ * One row per child, one column per destination port, of the mean RTT
+ * in usecs. The columns are labelled again whenever the row's
+ * destinations aren't the ones above it, as in a mesh of --peers.
+ */
+static void print_dest_matrix(uint16_t nr_tasks, struct options *opts)
+{
+	const struct dest_stats *d, *prev = NULL;
+	uint16_t i, k, n, prev_n = 0;
+
+	printf("\nMean RTT us, task by destination port\n");
+	for (i = 0; i < nr_tasks; i++) {
+		d = dest_first + i * dest_stride;
+		for (n = 0; n < dest_stride && d[n].port; n++)
+			;
+		for (k = 0; prev && k < n && k < prev_n; k++) {
+			if (dest_port_cmp(&d[k], &prev[k]))
+				break;
+		}
+		if (!prev || n != prev_n || k < n) {
+			printf("%-5s to %s\n", "",
+			       n ? inet_ntoa_32(d[0].addr) : "-");
+			printf("%5s", "port");
+			for (k = 0; k < n; k++)
+				printf(" %8u", d[k].port);
+			printf("\n");
 		}
+		printf("%5u", opts->starting_port + 1 + i);
+		for (k = 0; k < n; k++)
+			printf(" %8.2f", d[k].rtt_nr ?
+			       d[k].rtt_sum / 1000.0 / d[k].rtt_nr : 0.0);
+		printf("\n");
+		prev = d;
+		prev_n = n;
+	}
+}
 
-		t->unacked += 1;
-		t->recv_index = (t->recv_index + 1) % opts->req_depth;
+static void print_task_stats(struct child_control *ctl, uint64_t *hist_last,
+			     uint16_t nr_tasks, struct options *opts,
+			     double scale)
+{
+	struct dest_stats *d, *f, *l;
+	struct task_row last;
+	size_t n, u, k;
+	uint16_t i;
+
+	for (i = 0; i < nr_tasks; i++) {
+		task_base(&last, ctl[i].last, dest_last, i);
+		task_row(&task_rows[i], i, &last, &task_first[i],
+			 hist_last + i * hist_len,
+			 task_hist_first + i * hist_len);
+	}
+	qsort(task_rows, nr_tasks, sizeof(*task_rows), task_row_cmp);
+	printf("\nTasks\n");
+	print_task_rows(nr_tasks, opts, scale, "");
+
+	/* dest_first becomes what was sent to each in the run */
+	for (n = 0; n < (size_t) nr_tasks * dest_stride; n++) {
+		f = &dest_first[n];
+		l = &dest_last[n];
+		f->req_tx = l->req_tx - f->req_tx;
+		f->rtt_nr = l->rtt_nr - f->rtt_nr;
+		f->rtt_sum = l->rtt_sum - f->rtt_sum;
+		f->congested = l->congested - f->congested;
+		f->addr = l->addr;
+		f->port = l->port;
 	}
-	t->recv_seq++;
 
-	return ret;
+	/* and dest_last the same, summed up over the children */
+	for (n = 0, u = 0; n < (size_t) nr_tasks * dest_stride; n++) {
+		if (dest_first[n].port)
+			dest_last[u++] = dest_first[n];
+	}
+	qsort(dest_last, u, sizeof(*dest_last), dest_port_cmp);
+	for (n = 0, k = 0, d = dest_last; n < u; n++) {
+		if (k && !dest_port_cmp(&d[k - 1], &dest_last[n])) {
+			d[k - 1].req_tx += dest_last[n].req_tx;
+			d[k - 1].rtt_nr += dest_last[n].rtt_nr;
+			d[k - 1].rtt_sum += dest_last[n].rtt_sum;
+			d[k - 1].congested += dest_last[n].congested;
+		} else
+			d[k++] = dest_last[n];
+	}
+	qsort(dest_last, k, sizeof(*dest_last), dest_rtt_cmp);
+
+	printf("\nDestination ports\n");
+	printf("%-21s %8s %8s %8s\n", "destination", "tx/s", "rtt us",
+	       "cong/s");
+	for (n = 0, d = dest_last; n < k; n++, d++) {
+		char label[32];
+
+		snprintf(label, sizeof(label), "%s:%u",
+			 inet_ntoa_32(d->addr), d->port);
+		printf("%-21s %8.0f %8.2f %8.2f\n", label, scale * d->req_tx,
+		       d->rtt_nr ? d->rtt_sum / 1000.0 / d->rtt_nr : 0.0,
+		       scale * d->congested);
+	}
+
+	print_dest_matrix(nr_tasks, opts);
 }
 
-static void run_child(pid_t parent_pid, struct child_control *ctl,
-			struct child_control *all_ctl,
-		      struct options *opts, uint16_t id, int active)
+static void task_stats_free(void)
+{
+	free(task_rows);
+	free(task_first);
+	free(task_last);
+	free(task_hist_first);
+	free(task_hist);
+	free(dest_first);
+	free(dest_last);
+	task_rows = task_first = task_last = NULL;
+	task_hist_first = task_hist = NULL;
+	dest_first = dest_last = NULL;
+}
+
+/*
+ * --size-sweep runs the test at each of its sizes for -T seconds in
+ * turn. The parents move their children on from one size to the next,
+ * and keep the statistics and the RDS counter deltas of every step.
+ * The counters, per request, show where fragmentation starts to cost.
+ */
+struct sweep_step {
+	double			usecs;
+	struct counter		stats[NR_STATS];
+	struct rds_info_counter	*rds;		/* deltas, or NULL */
+};
+
+static struct sweep_step	sweep_steps[MAX_SIZE_CLASSES];
+static struct rds_info_counter	*sweep_rds;	/* at the start of a step */
+static int			sweep_rds_count;
+
+static void sweep_start(struct child_control *ctl, uint16_t nr,
+			unsigned int step)
 {
-	struct sockaddr_in sin;
-	struct pollfd pfd;
-	int fd;
 	uint16_t i;
-	ssize_t ret;
-	struct task tasks[opts->nr_tasks];
-	struct timeval start;
-        int do_work = opts->simplex ? active : 1;
-	int j;
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opts->starting_port + 1 + id);
-	sin.sin_addr.s_addr = htonl(opts->receive_addr);
+	for (i = 0; i < nr; i++)
+		ctl[i].size_step = step;
 
-	/* give main display thread a little edge? */
-	nice(5);
+	free(sweep_rds);
+	sweep_rds = read_rds_counters(&sweep_rds_count);
+}
 
-	/* send to *all* remote tasks */
-	memset(tasks, 0, sizeof(tasks));
-	for (i = 0; i < opts->nr_tasks; i++) {
-		tasks[i].nr = i;
-		tasks[i].src_addr = sin;
-		tasks[i].dst_addr.sin_family = AF_INET;
-		tasks[i].dst_addr.sin_addr.s_addr = htonl(opts->send_addr);
-		tasks[i].dst_addr.sin_port = htons(opts->starting_port + 1 + i);
+static void sweep_finish(unsigned int step, struct counter *stats,
+			 double usecs)
+{
+	struct sweep_step *s = &sweep_steps[step];
+	struct rds_info_counter *now;
+	int i, count;
+
+	s->usecs = usecs;
+	memcpy(s->stats, stats, sizeof(s->stats));
+
+	now = read_rds_counters(&count);
+	if (now && sweep_rds && count == sweep_rds_count) {
+		for (i = 0; i < count; i++)
+			now[i].value -= sweep_rds[i].value;
+		s->rds = now;
+	} else
+		free(now);
+}
 
-		tasks[i].send_time = malloc(opts->req_depth * sizeof(struct timeval));
-		if (!tasks[i].send_time) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].send_time, 0, opts->req_depth * sizeof(struct timeval));
+static void print_sweep(unsigned int nr_steps)
+{
+	struct sweep_step *s;
+	unsigned int k;
+	uint64_t reqs;
+	double scale;
+	int i, moved;
+
+	printf("\nSize sweep\n");
+	printf("%10s %10s %10s %8s %8s\n",
+	       "bytes", "reqs/s", "MB/s", "tx us/c", "rtt us");
+	for (k = 0, s = sweep_steps; k < nr_steps; k++, s++) {
+		scale = 1e6 / s->usecs;
+		printf("%10u %10.2f %10.2f %8.2f %8.2f\n", req_sizes.size[k],
+		       scale * s->stats[S_REQ_TX_BYTES].nr,
+		       scale * s->stats[S_REQ_TX_BYTES].sum / (1024.0 * 1024.0),
+		       avg(&s->stats[S_SENDMSG_NSECS]) / 1000.0,
+		       avg(&s->stats[S_RTT_NSECS]) / 1000.0);
+	}
 
-		tasks[i].rdma_req_key = malloc(opts->req_depth * sizeof(uint64_t));
-		if (!tasks[i].rdma_req_key) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].rdma_req_key, 0, opts->req_depth * sizeof(uint64_t));
+	if (!sweep_steps[0].rds)
+		return;
 
-		tasks[i].rdma_inflight = malloc(opts->req_depth * sizeof(uint8_t));
-		if (!tasks[i].rdma_inflight) {
-			die("ERROR: failed to alloc memory\n");
+	/* only the counters that moved, per request sent */
+	printf("\nRDS counters per request\n");
+	printf("%-28s", "");
+	for (k = 0; k < nr_steps; k++)
+		printf(" %10u", req_sizes.size[k]);
+	printf("\n");
+	for (i = 0; i < sweep_rds_count; i++) {
+		for (k = 0, moved = 0; k < nr_steps; k++)
+			moved |= sweep_steps[k].rds && sweep_steps[k].rds[i].value;
+		if (!moved)
+			continue;
+		printf("%-28.28s", sweep_steps[0].rds[i].name);
+		for (k = 0, s = sweep_steps; k < nr_steps; k++, s++) {
+			reqs = s->stats[S_REQ_TX_BYTES].nr;
+			printf(" %10.3f", s->rds && reqs ?
+			       (double) s->rds[i].value / reqs : 0.0);
 		}
-		memset(tasks[i].rdma_inflight, 0, opts->req_depth * sizeof(uint8_t));
+		printf("\n");
+	}
+}
 
-		tasks[i].rdma_buf = malloc(opts->req_depth * sizeof(uint64_t *));
-		if (!tasks[i].rdma_buf) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].rdma_buf , 0, opts->req_depth * sizeof(uint64_t *));
+/* --slo: the latency percentile that --search holds below slo_usecs */
+static double		slo_pct = 99;
+static double		slo_usecs;
 
-		tasks[i].local_buf = malloc(opts->req_depth * sizeof(uint64_t *));
-		if (!tasks[i].local_buf) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].local_buf, 0, opts->req_depth * sizeof(uint64_t *));
+/* how long the children took to get ready, and how far apart they started */
+static void print_start(struct child_control *ctl, uint16_t nr_tasks)
+{
+	uint64_t first = ~0ULL, last = 0;
+	uint16_t i;
 
-		tasks[i].ack_header = malloc(opts->req_depth * sizeof(struct header));
-		if (!tasks[i].ack_header) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].ack_header, 0, opts->req_depth * sizeof(struct header));
+	for (i = 0; i < nr_tasks; i++) {
+		if (!ctl[i].started_ns)
+			continue;
+		first = min(first, ctl[i].started_ns);
+		last = max(last, ctl[i].started_ns);
+	}
+	if (!last)
+		return;
 
-		tasks[i].ack2_header = malloc(opts->req_depth * sizeof(struct header));
-		if (!tasks[i].ack2_header) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].ack2_header, 0, opts->req_depth * sizeof(struct header));
+	printf("startup  ready in %.2f ms, first started %.2f us after the gate, skew %.2f us\n",
+	       startup_ns / 1e6, (first - gate->open_ns) / 1e3,
+	       (last - first) / 1e3);
+}
 
-		for (j=0;j<opts->req_depth;j++)
-			tasks[i].ack2_header[j].pending = 0;
+/* the summary of a run, for --matrix, --search and --curve */
+struct run_result {
+	double		tx_per_sec;
+	double		rx_per_sec;
+	double		kbytes_per_sec;
+	double		tx_usecs;
+	double		rtt_usecs;
+	double		p50_usecs;
+	double		p99_usecs;
+	double		p999_usecs;
+	double		slo_usecs;	/* at the --slo percentile */
+	double		cpu;		/* percent, or -1 without -c */
+	double		warmup_secs;	/* to a steady state, or -1 */
+	double		usecs;		/* measured */
+	struct rds_info_counter	*rds;	/* --curve: deltas, or NULL */
+	int		rds_count;
+};
 
-		tasks[i].req_header = malloc(opts->req_depth * sizeof(struct header));
-		if (!tasks[i].req_header) {
-			die("ERROR: failed to alloc memory\n");
-		}
-		memset(tasks[i].req_header, 0, opts->req_depth * sizeof(struct header));
+/*
+ * Measuring starts once the children are in a steady state: the tx/s and
+ * the mean RTT of the last STEADY_SAMPLES samples, STEADY_SAMPLE_MS
+ * apart, both have a coefficient of variation of no more than
+ * --steady-cv percent. A system that is warm already is measured after
+ * a second; one that isn't gets up to --warmup-max seconds, and its run
+ * is flagged as never having been steady. --steady-cv 0 is the old fixed
+ * burn-in of BURN_IN_SECS. A ctl-c or the peers hanging up during the
+ * warm-up ends the run there, and the warm-up is all its summary covers.
+ */
+#define STEADY_SAMPLES		4
+#define STEADY_SAMPLE_MS	250
+#define BURN_IN_SECS		2
+#define WARMUP_STOPPED		-2
 
-		for (j=0;j<opts->req_depth;j++)
-			tasks[i].req_header[j].pending = 0;
+static unsigned int	steady_cv = 10;
+static unsigned int	warmup_max = 10;
 
-		tasks[i].retry_token = malloc(2 * opts->req_depth * sizeof(uint64_t));
-		if (!tasks[i].retry_token) {
-			die("ERROR: failed to alloc memory\n");
+/* --curve: read the RDS counters over each point */
+static int curve_rds;
+
+/* standard deviation over mean, in percent */
+static double cov(const double *val, unsigned int nr)
+{
+	double mean = 0, var = 0;
+	unsigned int k;
+
+	for (k = 0; k < nr; k++)
+		mean += val[k];
+	mean /= nr;
+	if (mean == 0)
+		return 0;
+	for (k = 0; k < nr; k++)
+		var += (val[k] - mean) * (val[k] - mean);
+	return 100 * sqrt(var / nr) / mean;
+}
+
+/*
+ * The seconds it took to get to a steady state, -1 if it never did, or
+ * WARMUP_STOPPED if the run was stopped first. Every sample is added to
+ * summary and hist_summary, for a run that never gets past the warm-up;
+ * cpu_use() only works in whole seconds, so the cpu use isn't.
+ */
+static double warm_up(struct counter *disp, struct counter *summary,
+		      struct child_control *ctl, uint64_t *hist_disp,
+		      uint64_t *hist_summary, uint64_t *hist_last,
+		      uint16_t nr_tasks, struct soak_control *soak_arr,
+		      int active)
+{
+	double tx[STEADY_SAMPLES], rtt[STEADY_SAMPLES];
+	struct timeval begin, last, now;
+	uint64_t usecs;
+	unsigned int n, h;
+	int hangup = 0;
+
+	gettimeofday(&begin, NULL);
+	last = begin;
+	for (n = 0; ; n++) {
+		/* a passive side whose peers are done already has
+		 * nothing left to wait for */
+		if (active)
+			usleep(STEADY_SAMPLE_MS * 1000);
+		else
+			hangup = peer_hangup(STEADY_SAMPLE_MS);
+
+		stat_snapshot(disp, ctl, nr_tasks);
+		hist_snapshot(hist_disp, ctl, hist_last, nr_tasks);
+		stat_accumulate(summary, disp);
+		for (h = 0; h < hist_len; h++)
+			hist_summary[h] += hist_disp[h];
+		cpu_use(soak_arr);
+		if (hangup || interrupted)
+			return WARMUP_STOPPED;
+
+		gettimeofday(&now, NULL);
+		tx[n % STEADY_SAMPLES] = 1e6 * disp[S_REQ_TX_BYTES].nr /
+					 usec_sub(&now, &last);
+		rtt[n % STEADY_SAMPLES] = avg(&disp[S_RTT_NSECS]);
+		last = now;
+		usecs = usec_sub(&now, &begin);
+
+		if (!steady_cv) {
+			if (usecs >= BURN_IN_SECS * 1000000ULL)
+				return 1e-6 * usecs;
+			continue;
 		}
-		memset(tasks[i].retry_token, 0, 2 * opts->req_depth * sizeof(uint64_t));
+		if (n + 1 >= STEADY_SAMPLES &&
+		    cov(tx, STEADY_SAMPLES) <= steady_cv &&
+		    cov(rtt, STEADY_SAMPLES) <= steady_cv)
+			return 1e-6 * usecs;
+		if (usecs >= warmup_max * 1000000ULL)
+			return -1;
+	}
+}
 
-		tasks[i].rdma_next_op = (i & 1)? RDMA_OP_READ : RDMA_OP_WRITE;
+static void release_children_and_wait(struct options *opts,
+				      struct child_control *ctl,
+				      struct soak_control *soak_arr,
+				      int active, struct run_result *res)
+{
+	struct counter disp[NR_STATS];
+	struct counter summary[NR_STATS];
+	struct timeval end, now, first_ts, last_ts;
+	double cpu_total = 0;
+	uint16_t i, cpu_samples = 0;
+	uint16_t nr_running;
+	uint64_t *hist_disp, *hist_summary, *hist_last;
+	struct counter cls_first[2][MAX_SIZE_CLASSES];
+	struct counter cls_last[2][MAX_SIZE_CLASSES];
+	struct counter step_sum[NR_STATS];
+	struct timeval step_ts;
+	int sweep = req_sizes.type == DIST_SWEEP;
+	unsigned int h, step = 0;
+	struct rds_info_counter *rds_first = NULL, *rds_last = NULL;
+	int rds_count = 0, rds_last_count = 0;
+	double warmup;
+
+	hist_disp = calloc(hist_len, sizeof(uint64_t));
+	hist_summary = calloc(hist_len, sizeof(uint64_t));
+	hist_last = calloc(opts->nr_tasks * hist_len, sizeof(uint64_t));
+	if (!hist_disp || !hist_summary || !hist_last)
+		die("ERROR: failed to alloc memory\n");
+
+	/* the children are all ready; start them, then warm up
+	 * until they are steady */
+	catch_interrupts(1);
+	open_gate();
+
+	memset(summary, 0, sizeof(summary));
+	gettimeofday(&now, NULL);
+	warmup = warm_up(disp, summary, ctl, hist_disp, hist_summary, hist_last,
+			 opts->nr_tasks, soak_arr, active);
+	gettimeofday(&first_ts, NULL);
+	if (warmup == WARMUP_STOPPED) {
+		/* there is nothing but the warm-up to sum up */
+		last_ts = first_ts;
+		first_ts = now;
+	} else {
+		if (warmup < 0)
+			printf("not steady after %.2f seconds of warm-up, measuring anyway\n",
+			       usec_sub(&first_ts, &now) / 1e6);
+		else if (steady_cv)
+			printf("steady after %.2f seconds of warm-up\n", warmup);
+		memset(summary, 0, sizeof(summary));
+		memset(hist_summary, 0, hist_len * sizeof(uint64_t));
+		last_ts = first_ts;
 	}
 
-	if (opts->rdma_size)
-		alloc_rdma_buffers(tasks, opts);
+	if (curve_rds && res)
+		rds_first = read_rds_counters(&rds_count);
+	size_class_total(cls_first, ctl, opts->nr_tasks);
+	if (nr_peers > 1)
+		peer_totals(ctl, 0);
+	if (dest_stats)
+		task_stats_start(ctl, hist_last, opts->nr_tasks);
+	memcpy(cls_last, cls_first, sizeof(cls_last));
+	step_ts = first_ts;
+	memset(step_sum, 0, sizeof(step_sum));
+	if (sweep) {
+		/* -T is the time spent at each size */
+		sweep_start(ctl, opts->nr_tasks, 0);
+		timerclear(&end);
+	} else if (opts->run_time && active) {
+		end = first_ts;
+		end.tv_sec += opts->run_time;
+	} else {
+		timerclear(&end);
+	}
 
-	fd = rds_socket(opts, &sin);
+	nr_running = opts->nr_tasks;
 
-	ctl->ready = 1;
+	if (opts->rtprio)
+		set_rt_priority();
 
-	while (ctl->start.tv_sec == 0) {
-		check_parent(parent_pid);
-		sleep(1);
+	/* Prime the perf data counters and display the CSV header line
+	 * You can filter the CSV data from the rds-stress output by
+	 * grepping for the "::" marker.
+	 */
+	if (opt.show_perfdata) {
+		printf("::");
+		printf("nr_tasks:count"
+		       ",req_size:bytes"
+		       ",ack_size:bytes"
+		       ",rdma_size:bytes");
+
+		printf(",req_sent:count"
+		       ",thruput:kB/s"
+		       ",thruput_rdma:kB/s"
+		       ",tx_delay:microseconds"
+		       ",rtt:microseconds"
+		       ",cpu:percent"
+		       ",rtt_p50:microseconds"
+		       ",rtt_p99:microseconds"
+		       ",rtt_max:microseconds");
+		print_extra_header(1);
+		get_perfdata(1);
+		printf("\n");
+	} else {
+		printf("%4s %6s %6s %10s %10s %10s %7s %8s %5s %8s %8s %8s",
+			"tsks", "tx/s", "rx/s", "tx+rx K/s", "mbi K/s",
+			"mbo K/s", "tx us/c", "rtt us", "cpu %",
+			"p50 us", "p99 us", "max us");
+		print_extra_header(0);
+		printf("\n");
 	}
 
-	/* sleep until we're supposed to start */
-	gettimeofday(&start, NULL);
-	if (tv_cmp(&start, &ctl->start) < 0)
-		usleep(usec_sub(&ctl->start, &start));
+	while (nr_running && warmup != WARMUP_STOPPED) {
+		double cpu;
+		int hangup = 0;
+
+		/* the passive side counts the last part of a second too,
+		 * there may not have been a whole one since the warm-up */
+		if (active)
+			sleep(1);
+		else
+			hangup = peer_hangup(1000);
+
+		if (dest_stats)
+			task_stats_interval(ctl, hist_last, nr_running);
+		/* XXX big bug, need to mark some ctl elements dead */
+		stat_snapshot(disp, ctl, nr_running);
+		hist_snapshot(hist_disp, ctl, hist_last, nr_running);
+		size_class_total(cls_last, ctl, nr_running);
+		if (nr_peers > 1)
+			peer_totals(ctl, 1);
+		gettimeofday(&now, NULL);
+		cpu = cpu_use(soak_arr);
+
+		if (!opts->summary_only) {
+			double scale;
+
+			/* Every loop takes a little more than one second;
+			 * and system load can actually introduce latencies.
+			 * So try to measure the actual time elapsed as precise
+			 * as possible, and scale all values by its inverse.
+			 */
+			scale = 1e6 / usec_sub(&now, &last_ts);
 
-	sin.sin_family = AF_INET;
+			if (!opt.show_perfdata) {
+				printf("%4u %6"PRIu64" %6"PRIu64" %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f",
+					nr_running,
+					disp[S_REQ_TX_BYTES].nr,
+					disp[S_REQ_RX_BYTES].nr,
+					scale * throughput(disp) / 1024.0,
+					scale * throughput_mbi(disp) / 1024.0,
+					scale * throughput_mbo(disp) / 1024.0,
+					scale * avg(&disp[S_SENDMSG_NSECS]) / 1000.0,
+					scale * avg(&disp[S_RTT_NSECS]) / 1000.0,
+					scale * cpu);
+				print_rtt_tail(hist_disp, 0);
+				print_extra_stats(disp, scale, 0);
+				printf("\n");
+				if (dest_stats)
+					print_task_rows(min(task_stats, nr_running),
+							opts, scale, "  ");
+			} else {
+				printf("::");
+				printf("%u,%u,%u,%u,",
+				       opts->nr_tasks, opts->req_size,
+				       opts->ack_size, opts->rdma_size);
 
-	pfd.fd = fd;
-	pfd.events = POLLIN | POLLOUT;
-	while (1) {
-		struct task *t;
-		int can_send;
+				printf("%Lu,%f,%f,%f,%f,%f,%f",
+					(unsigned long long) disp[S_REQ_TX_BYTES].nr,
+					scale * throughput(disp) / 1024.0,
+					scale * throughput_mbi(disp) / 1024.0,
+					scale * throughput_mbo(disp) / 1024.0,
+					scale * avg(&disp[S_SENDMSG_NSECS]) / 1000.0,
+					scale * avg(&disp[S_RTT_NSECS]) / 1000.0,
+					cpu >= 0? scale * cpu : 0);
+				print_rtt_tail(hist_disp, 1);
+				print_extra_stats(disp, scale, 1);
 
-		check_parent(parent_pid);
+				/* Print RDS perf counters etc */
+				get_perfdata(0);
+				printf("\n");
+			}
 
-		ret = poll(&pfd, 1, 1000);
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			die_errno("poll failed");
+			rdma_key_o_meter_check(opts->nr_tasks);
 		}
 
-		pfd.events = POLLIN;
+		stat_accumulate(summary, disp);
+		for (h = 0; h < hist_len; h++)
+			hist_summary[h] += hist_disp[h];
+		cpu_total += cpu;
+		cpu_samples++;
+		last_ts = now;
 
-		if (pfd.revents & POLLIN) {
-			while (recv_one(fd, tasks, opts, ctl, all_ctl) >= 0)
-				;
+		/* The passive side stays at the last size until the
+		 * active one is done. */
+		stat_accumulate(step_sum, disp);
+		if (sweep && step < req_sizes.nr - !active &&
+		    usec_sub(&now, &step_ts) >= opts->run_time * 1000000ULL) {
+			sweep_finish(step++, step_sum, usec_sub(&now, &step_ts));
+			memset(step_sum, 0, sizeof(step_sum));
+			step_ts = now;
+			if (step == req_sizes.nr)
+				break;
+			sweep_start(ctl, opts->nr_tasks, step);
 		}
 
-		/* stop sending if in shutdown phase */
-		if (ctl->stopping)
-			continue;
+		if (hangup || interrupted ||
+		    (timerisset(&end) && timercmp(&now, &end, >=)))
+			break;
 
-		/* keep the pipeline full */
-		can_send = !!(pfd.revents & POLLOUT);
-		for (i = 0, t = tasks; i < opts->nr_tasks; i++, t++) {
-			if (opt.use_cong_monitor && t->congested)
-				continue;
-			if (t->drain_rdmas)
-				continue;
-			if (send_anything(fd, t, opts, ctl, can_send, do_work) < 0) {
+		/* see if any children have finished or died.
+		 * This is a bit touchy - we should really be
+		 * able to tell an exited soaker from an exiting
+		 * RDS child. Threads never exit on their own. */
+		if (!use_threads && reap_one_child(WNOHANG))
+			nr_running--;
+	}
 
-				pfd.events |= POLLOUT;
+	if (interrupted)
+		printf("interrupted, stopping\n");
+	if (dest_stats)
+		task_stats_end(opts->nr_tasks);
+	if (rds_first)
+		rds_last = read_rds_counters(&rds_last_count);
+
+	/* --matrix tells the passive side that this point is over,
+	 * instead of hanging up */
+	if (!keep_control) {
+		close_control();
+	} else if (active) {
+		uint8_t over = 1;
+
+		for (i = 0; i < nr_peers; i++)
+			peer_send(peers[i].fd, &over, sizeof(over));
+	}
 
-				/* If the send queue is full, we will see EAGAIN.
-				 * If a particular destination is congested, the
-				 * kernel will return ENOBUFS. In the former case,
-				 * there's no point in trying other destinations;
-				 * in the latter case we certainly want to try
-				 * sending to other tasks.
-				 *
-				 * It would be nice if we could map the congestion
-				 * map into user space :-)
-				 */
-				if (errno == ENOBUFS)
-					t->congested = 1;
-				else if (errno == EBADSLT)
-					t->drain_rdmas = 1;
-				else
-					break;
+	if (nr_running) {
+		/* let everything gracefully stop before we kill the chillins */
+		for (i = 0; i < opts->nr_tasks; i++)
+			ctl[i].stopping = 1;
+		sleep(1);
+
+		if (reuse_children) {
+			/* keep them, and the soakers, for the next run */
+			park_children(ctl, opts->nr_tasks);
+			nr_running = 0;
+		} else {
+			if (use_threads) {
+				stop_child_threads(ctl, opts->nr_tasks);
+				nr_running = 0;
+			} else {
+				for (i = 0; i < opts->nr_tasks; i++)
+					kill(ctl[i].pid, SIGTERM);
 			}
+			stop_soakers(soak_arr);
 		}
 	}
-}
-
-static struct child_control *start_children(struct options *opts, int active)
-{
-	struct child_control *ctl;
-	pid_t parent = getpid();
-	pid_t pid;
-	size_t len;
-	uint32_t i;
 
-	len = opts->nr_tasks * sizeof(*ctl);
-	ctl = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_SHARED,
-		   0, 0);
-	if (ctl == MAP_FAILED)
-		die("mmap of %u child control structs failed", opts->nr_tasks);
+	while (nr_running && reap_one_child(0))
+		nr_running--;
 
-	memset(ctl, 0, len);
+	rdma_key_o_meter_check(opts->nr_tasks);
 
-	init_msg_pattern(opts);
+	stat_total(disp, ctl, opts->nr_tasks);
+	if (!opts->summary_only)
+		printf("---------------------------------------------\n");
+	{
+		double scale, cpu = -1.0;
 
-	if (opts->rdma_key_o_meter)
-		rdma_key_o_meter_init(opts->nr_tasks);
+		scale = 1e6 / usec_sub(&last_ts, &first_ts);
+		if (soak_arr && warmup != WARMUP_STOPPED)
+			cpu = scale * cpu_total;
 
-	for (i = 0; i < opts->nr_tasks; i++) {
-		pid = fork();
-		if (pid == -1)
-			die_errno("forking child nr %u failed", i);
-		if (pid == 0) {
-			opts->suppress_warnings = (i > 0);
-			if (control_fd >= 0) {
-				close(control_fd);
-				control_fd = -1;
+		printf("%4u %6lu %6lu %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f",
+			opts->nr_tasks,
+			(long) (scale * summary[S_REQ_TX_BYTES].nr),
+			(long) (scale * summary[S_REQ_RX_BYTES].nr),
+			scale * throughput(summary) / 1024.0,
+			scale * throughput_mbi(summary) / 1024.0,
+			scale * throughput_mbo(summary) / 1024.0,
+			avg(&summary[S_SENDMSG_NSECS]) / 1000.0,
+			avg(&summary[S_RTT_NSECS]) / 1000.0,
+			cpu);
+		print_rtt_tail(hist_summary, 0);
+		print_extra_stats(summary, scale, 0);
+		printf("  (average%s)\n", warmup == WARMUP_STOPPED ?
+		       ", warm-up only" : warmup < 0 ? ", not steady" : "");
+		print_nsecs("tx us/c", &summary[S_SENDMSG_NSECS]);
+		print_nsecs("rtt us", &summary[S_RTT_NSECS]);
+		print_rtt_histogram(ctl, opts->nr_tasks,
+				    summary[S_RTT_NSECS].max);
+		print_start(ctl, opts->nr_tasks);
+		if (sweep) {
+			if (step < req_sizes.nr)
+				sweep_finish(step++, step_sum,
+					     usec_sub(&last_ts, &step_ts));
+			print_sweep(step);
+		} else if (req_sizes.type != DIST_FIXED)
+			print_size_classes(cls_first, cls_last, scale);
+		if (nr_peers > 1)
+			print_peers(scale, active);
+		if (dest_stats)
+			print_task_stats(ctl, hist_last, opts->nr_tasks, opts,
+					 scale);
+
+		print_placement(ctl, opts->nr_tasks);
+
+		if (res) {
+			uint64_t total = hist_total(hist_summary);
+
+			res->tx_per_sec = scale * summary[S_REQ_TX_BYTES].nr;
+			res->rx_per_sec = scale * summary[S_REQ_RX_BYTES].nr;
+			res->kbytes_per_sec = scale * throughput(summary) / 1024.0;
+			res->tx_usecs = avg(&summary[S_SENDMSG_NSECS]) / 1000.0;
+			res->rtt_usecs = avg(&summary[S_RTT_NSECS]) / 1000.0;
+			res->p50_usecs = res->p99_usecs = res->p999_usecs = 0;
+			res->slo_usecs = 0;
+			if (total) {
+				res->p50_usecs = hist_percentile(hist_summary, total, 50) / 1000.0;
+				res->p99_usecs = hist_percentile(hist_summary, total, 99) / 1000.0;
+				res->p999_usecs = hist_percentile(hist_summary, total, 99.9) / 1000.0;
+				res->slo_usecs = hist_percentile(hist_summary, total, slo_pct) / 1000.0;
+			}
+			res->cpu = cpu;
+			res->warmup_secs = max(warmup, -1);
+			res->usecs = usec_sub(&last_ts, &first_ts);
+			res->rds = NULL;
+			if (rds_last && rds_last_count == rds_count) {
+				for (i = 0; i < rds_count; i++)
+					rds_last[i].value -= rds_first[i].value;
+				res->rds = rds_last;
+				res->rds_count = rds_count;
+				rds_last = NULL;
 			}
-			rdma_key_o_meter_set_self(i);
-			run_child(parent, ctl + i, ctl, opts, i, active);
-			exit(0);
 		}
-		ctl[i].pid = pid;
 	}
 
-	for (i = 0; i < opts->nr_tasks; i++) {
-		if (ctl[i].ready)
-			continue;
-		pid = waitpid(-1, NULL, WNOHANG);
-		if (pid)
-			die("child %u (pid %u) exited\n", i, pid);
-		sleep(1);
-		i--; /* try this child again */
-	}
+	free(rds_first);
+	free(rds_last);
+	catch_interrupts(0);
 
-	return ctl;
+	free(hist_disp);
+	free(hist_summary);
+	free(hist_last);
+	task_stats_free();
 }
 
-static double avg(struct counter *ctr)
+static void add_peer(uint32_t addr)
 {
-	if (ctr->nr)
-		return (double)ctr->sum / (double)ctr->nr;
-	else
-		return 0.0;
+	if (nr_peers == MAX_PEERS)
+		die("too many peers, at most %u\n", MAX_PEERS);
+	peers = realloc(peers, (nr_peers + 1) * sizeof(*peers));
+	if (!peers)
+		die("ERROR: failed to alloc memory\n");
+	memset(&peers[nr_peers], 0, sizeof(*peers));
+	peers[nr_peers].addr = addr;
+	peers[nr_peers++].fd = -1;
 }
 
-static double throughput(struct counter *disp)
+/* --peers takes a comma separated list of host names or addresses */
+static void parse_peers(char *list)
 {
-	return disp[S_REQ_TX_BYTES].sum + disp[S_REQ_RX_BYTES].sum +
-		disp[S_ACK_TX_BYTES].sum + disp[S_ACK_RX_BYTES].sum;
+	char *name;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ","))
+		add_peer(parse_addr(name));
+	if (!nr_peers)
+		die("--peers needs at least one address\n");
 }
 
-static double throughput_mbi(struct counter *disp)
+static void peer_connect(int fd, const struct sockaddr_in *sin)
 {
-	return disp[S_MBUS_IN_BYTES].sum;
+	int retries = 0;
+
+	printf("connecting to %s:%u",
+			inet_ntoa(sin->sin_addr),
+			ntohs(sin->sin_port));
+	fflush(stdout);
+
+	while (connect(fd, (struct sockaddr *) sin, sizeof(*sin))) {
+		if (retries == 0)
+			printf(": %s", strerror(errno));
+
+		switch (errno) {
+		case ECONNREFUSED:
+		case EHOSTUNREACH:
+		case ENETUNREACH:
+			if (retries >= opt.connect_retries)
+				break;
+			if (retries++ == 0)
+				printf(" - retrying");
+			printf(".");
+			fflush(stdout);
+			sleep(1);
+			continue;
+		}
+
+		printf("\n");
+		die("connect(%s) failed", inet_ntoa(sin->sin_addr));
+	}
+	printf("\n");
 }
 
-static double throughput_mbo(struct counter *disp)
+static void peer_send(int fd, const void *ptr, size_t size)
 {
-        return disp[S_MBUS_OUT_BYTES].sum;
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, ptr, size);
+		if (ret < 0)
+			die_errno("Cannot send to peer");
+		size -= ret;
+		ptr += ret;
+	}
 }
 
-void stat_snapshot(struct counter *disp, struct child_control *ctl,
-		   uint16_t nr_tasks)
+static void peer_recv(int fd, void *ptr, size_t size)
 {
-	struct counter tmp[NR_STATS];
-	uint16_t i;
-	uint16_t s;
-
-	memset(disp, 0, sizeof(tmp));
+	ssize_t ret;
 
-	for (i = 0; i < nr_tasks; i++) {
-		memcpy(tmp, ctl[i].cur, sizeof(tmp));
+	if (size == sizeof(struct options)) {
+		memset(ptr, 0, size);
+		ret = read(fd, peer_version, VERSION_MAX_LEN);
+		if (ret != VERSION_MAX_LEN)
+			die_errno("Failed to read version");
 
-		for (s = 0; s < NR_STATS; s++) {
-			disp[s].nr += tmp[s].nr - ctl[i].last[s].nr;
-			disp[s].sum += tmp[s].sum - ctl[i].last[s].sum;
-			disp[s].min = minz(tmp[s].min, ctl[i].last[s].min);
-			disp[s].max = max(tmp[s].max, ctl[i].last[s].max);
+		if (!strcmp(peer_version, RDS_VERSION)) {
+			memcpy(ptr, peer_version, VERSION_MAX_LEN);
+			size -= ret;
+		} else if (!strcmp(peer_version, VERSION_2_0_7)) {
+			memcpy(ptr, peer_version, VERSION_MAX_LEN);
+			size = OPTIONS_2_0_7_SIZE - ret;
+		} else {
+			/* no version, these are options already */
+			ptr += ret;
+			memcpy(ptr, peer_version, VERSION_MAX_LEN);
+			size = sizeof(struct options_2_0_6) - ret;
 		}
+		ptr += ret;
+	}
 
-		memcpy(ctl[i].last, tmp, sizeof(tmp));
+	while (size) {
+		ret = read(fd, ptr, size);
+		if (ret < 0)
+			die_errno("Cannot recv from peer");
+		if (ret == 0)
+			die("Peer unexpectedly closed connection\n");
+		size -= ret;
+		ptr += ret;
 	}
 }
 
-void stat_accumulate(struct counter *accum, const struct counter *cur)
+static void encode_options(struct options *dst, const struct options *src)
 {
-	uint16_t s;
+	memcpy(dst->version, src->version, VERSION_MAX_LEN);
+	dst->req_depth = htonl(src->req_depth);
+	dst->req_size = htonl(src->req_size);
+	dst->ack_size = htonl(src->ack_size);
+	dst->rdma_size = htonl(src->rdma_size);
+	dst->send_addr = htonl(src->send_addr);		/* host byte order */
+	dst->receive_addr = htonl(src->receive_addr);	/* host byte order */
+	dst->starting_port = htons(src->starting_port);	/* host byte order */
+	dst->nr_tasks = htons(src->nr_tasks);
+	dst->run_time = htonl(src->run_time);
+	dst->summary_only = src->summary_only;		/* byte sized */
+	dst->rtprio = src->rtprio;			/* byte sized */
+	dst->tracing = src->tracing;			/* byte sized */
+	dst->verify = src->verify;			/* byte sized */
+	dst->show_params = src->show_params;		/* byte sized */
+	dst->show_perfdata = src->show_perfdata;	/* byte sized */
+	dst->use_cong_monitor = src->use_cong_monitor;	/* byte sized */
+	dst->rdma_use_once = src->rdma_use_once;	/* byte sized */
+	dst->rdma_use_get_mr = src->rdma_use_get_mr;	/* byte sized */
+	dst->rdma_use_fence = src->rdma_use_fence;	/* byte sized */
+	dst->rdma_cache_mrs = src->rdma_cache_mrs;	/* byte sized */
+	dst->rdma_key_o_meter = src->rdma_key_o_meter;	/* byte sized */
 
-	for (s = 0; s < NR_STATS; ++s, ++cur, ++accum) {
-		accum->nr += cur->nr;
-		accum->sum += cur->sum;
-		accum->min = minz(accum->min, cur->min);
-		accum->max = max(accum->max, cur->max);
-	}
+	dst->rdma_alignment = htonl(src->rdma_alignment);
+	dst->connect_retries = htonl(src->connect_retries);
+
+	dst->suppress_warnings = src->suppress_warnings;/* byte sized */
+        dst->simplex = src->simplex;                    /* byte sized */
+        dst->rw_mode = src->rw_mode;                    /* byte sized */
+        dst->rdma_vector = htonl(src->rdma_vector);
+	dst->tos = src->tos;
+	dst->async = src->async;
+	dst->rate = htonl(src->rate);
+	dst->backlog = htonl(src->backlog);
+	dst->arrival = src->arrival;
+	dst->size_seed = htonl(src->size_seed);
+	memcpy(dst->req_dist, src->req_dist, DIST_SPEC_LEN);
+	memcpy(dst->ack_dist, src->ack_dist, DIST_SPEC_LEN);
+	dst->verify_mode = src->verify_mode;
+	dst->verify_sample = htonl(src->verify_sample);
+	dst->peer_port = htons(src->peer_port);
+	dst->matrix = src->matrix;			/* byte sized */
 }
 
-void stat_total(struct counter *disp, struct child_control *ctl,
-		uint16_t nr_tasks)
+static void decode_options(struct options *dst, const struct options *src)
 {
-	uint16_t i;
-	uint16_t s;
+	memcpy(dst->version, src->version, VERSION_MAX_LEN);
+	dst->req_depth = ntohl(src->req_depth);
+	dst->req_size = ntohl(src->req_size);
+	dst->ack_size = ntohl(src->ack_size);
+	dst->rdma_size = ntohl(src->rdma_size);
+	dst->send_addr = ntohl(src->send_addr);		/* host byte order */
+	dst->receive_addr = ntohl(src->receive_addr);	/* host byte order */
+	dst->starting_port = ntohs(src->starting_port);	/* host byte order */
+	dst->nr_tasks = ntohs(src->nr_tasks);
+	dst->run_time = ntohl(src->run_time);
+	dst->summary_only = src->summary_only;		/* byte sized */
+	dst->rtprio = src->rtprio;			/* byte sized */
+	dst->tracing = src->tracing;			/* byte sized */
+	dst->verify = src->verify;			/* byte sized */
+	dst->show_params = src->show_params;		/* byte sized */
+	dst->show_perfdata = src->show_perfdata;	/* byte sized */
+	dst->use_cong_monitor = src->use_cong_monitor;	/* byte sized */
+	dst->rdma_use_once = src->rdma_use_once;	/* byte sized */
+	dst->rdma_use_get_mr = src->rdma_use_get_mr;	/* byte sized */
+	dst->rdma_use_fence = src->rdma_use_fence;	/* byte sized */
+	dst->rdma_cache_mrs = src->rdma_cache_mrs;	/* byte sized */
+	dst->rdma_key_o_meter = src->rdma_key_o_meter;	/* byte sized */
 
-	memset(disp, 0, sizeof(struct counter) * NR_STATS);
+	dst->rdma_alignment = ntohl(src->rdma_alignment);
+	dst->connect_retries = ntohl(src->connect_retries);
 
-	for (i = 0; i < nr_tasks; i++) {
-		for (s = 0; s < NR_STATS; s++) {
-			disp[s].nr += ctl[i].cur[s].nr;
-			disp[s].sum += ctl[i].cur[s].sum;
-			disp[s].min = minz(disp[s].min, ctl[i].cur[s].min);
-			disp[s].max = max(disp[s].max, ctl[i].cur[s].max);
-		}
-	}
+	dst->suppress_warnings = src->suppress_warnings;/* byte sized */
+        dst->simplex = src->simplex;                    /* byte sized */
+        dst->rw_mode = src->rw_mode;                    /* byte sized */
+	dst->rdma_vector = ntohl(src->rdma_vector);
+	dst->tos = src->tos;
+	dst->async = src->async;
+	dst->rate = ntohl(src->rate);
+	dst->backlog = ntohl(src->backlog);
+	dst->arrival = src->arrival;
+	dst->size_seed = ntohl(src->size_seed);
+	memcpy(dst->req_dist, src->req_dist, DIST_SPEC_LEN);
+	memcpy(dst->ack_dist, src->ack_dist, DIST_SPEC_LEN);
+	dst->verify_mode = src->verify_mode;
+	dst->verify_sample = ntohl(src->verify_sample);
+	dst->peer_port = ntohs(src->peer_port);
+	dst->matrix = src->matrix;			/* byte sized */
 }
 
-static double cpu_use(struct soak_control *soak_arr)
+/*
+ * Peers from before 2.0.8 only understand the options up to async, so
+ * we send the full struct only when an option past them is in use.
+ */
+static int need_full_options(const struct options *opts)
 {
-	struct soak_control *soak;
-	uint64_t capacity = 0;
-	uint64_t soaked = 0;
-	uint64_t this;
-
-	if (soak_arr == NULL)
-		return -1.0;
-
-	for (soak = soak_arr; soak && soak->per_sec; soak++) {
-		capacity += soak->per_sec;
-		this = soak->counter;
-		soaked += min(soak->per_sec, this - soak->last);
-		soak->last = this;
-	}
+	return opts->rate ||
+	       opts->req_dist[0] || opts->ack_dist[0] ||
+	       opts->verify_mode || opts->verify_sample > 1 ||
+	       opts->peer_port || opts->matrix;
+}
 
-	return (double)(capacity - soaked) * 100 / (double)capacity;
+/*
+ * Send the options in the oldest form that carries them, so that peers
+ * before 2.0.8 still understand us, and say which in opts->version: it
+ * tells our children which header to use too.
+ */
+static void send_options(int fd, struct options *opts)
+{
+	struct options enc;
+
+	memset(opts->version, 0, VERSION_MAX_LEN);
+	if (need_full_options(opts))
+		strcpy(opts->version, RDS_VERSION);
+	else if (opts->tos || opts->async)
+		strcpy(opts->version, VERSION_2_0_7);
+
+	encode_options(&enc, opts);
+	if (!opts->version[0])
+		peer_send(fd, &enc.req_depth, sizeof(struct options_2_0_6));
+	else if (strcmp(opts->version, RDS_VERSION))
+		peer_send(fd, &enc, OPTIONS_2_0_7_SIZE);
+	else
+		peer_send(fd, &enc, sizeof(enc));
 }
 
-static void
-get_stats(int initialize)
+static void verify_option_encdec(const struct options *opts)
 {
-#define NTIMES 8
-	struct sys_stats {
-		/* Where we spent out time */
-		unsigned long long	times[NTIMES];
-		unsigned long long	other;
+	struct options ebuf, dbuf;
+	unsigned int i;
 
-		/* Interrupt count */
-		unsigned long long	intr;
-	};
-	static struct sys_stats prev, current;
-	static int disable = 0;
-	char buffer[2048];
-	FILE *fp;
+	memcpy(&dbuf, opts, sizeof(*opts));
+	for (i = 0; i < sizeof(*opts); ++i) {
+		unsigned char *x = &((unsigned char *) &dbuf)[i];
 
-	if (disable)
-		return;
-	if ((fp = fopen("/proc/stat", "r")) == NULL) {
-		fprintf(stderr, "Cannot open /proc/stat (%s) - "
-				"not printing cpu stats\n",
-				strerror(errno));
-		disable = 1;
-		return;
+		*x = ~*x;
 	}
 
-	memset(&current, 0, sizeof(current));
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (!strncmp(buffer, "cpu ", 4)) {
-			char	*s = buffer + 4;
-			int	j;
-
-			for (j = 0; 1; ++j) {
-				unsigned long long v;
+	encode_options(&ebuf, opts);
+	decode_options(&dbuf, &ebuf);
 
-				while (*s == ' ')
-					++s;
-				if (!isdigit(*s))
-					break;
-				v = strtoull(s, &s, 10);
-				if (j < NTIMES)
-					current.times[j] = v;
-				else
-					current.other += v;
-			}
-		} else
-		if (!strncmp(buffer, "intr ", 5)) {
-			sscanf(buffer + 5, "%Lu", &current.intr);
-		}
-	}
-	fclose(fp);
+	if (memcmp(&dbuf, opts, sizeof(*opts)))
+		die("encode/decode check of options struct failed");
+}
 
-	if (initialize) {
-		printf(",user:percent,system:percent,idle:percent"
-		       ",irq:percent,intr:count");
-	} else {
-		struct sys_stats sys;
-		unsigned long sum = 0;
-		double scale;
-		int j;
+static void reset_conn(struct options *opts)
+{
+	struct rds_reset val;
+	int fd;
+	struct sockaddr_in sin;
 
-		sum = sys.other = current.other - prev.other;
-		for (j = 0; j < NTIMES; ++j) {
-			sys.times[j] = current.times[j] - prev.times[j];
-			sum += current.times[j];
-		}
-		sys.intr = current.intr - prev.intr;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opts->starting_port);
+	sin.sin_addr.s_addr = htonl(opts->receive_addr);
 
-		scale = sum? 100.0 / sum : 0;
+	fd = bound_socket(pf, SOCK_SEQPACKET, 0, &sin);
 
-		/* Magic procfs offsets
-		 *  0	user
-		 *  1	nice
-		 *  2	system
-		 *  3	idle
-		 *  4	iowait
-		 *  5	irq
-		 *  6	softirq
-		 */
-		printf(",%f,%f,%f,%f,%Lu",
-			(sys.times[0] + sys.times[1]) * scale,
-			sys.times[2] * scale,
-			(sys.times[3] + sys.times[4]) * scale,
-			(sys.times[5] + sys.times[6]) * scale,
-			sys.intr);
-	}
-	prev = current;
+	val.tos = opts->tos;
+	val.src.s_addr = htonl(opts->receive_addr);
+	val.dst.s_addr = htonl(opts->send_addr);
+	if (setsockopt(fd, sol, SO_RDS_TRANSPORT, &val, sizeof(val)))
+		die_errno("setsockopt RDS_CONN_RESET failed");
 }
 
-static void
-get_perfdata(int initialize)
-{
-	static struct timeval last_ts, now;
-	static struct rds_info_counter *prev, *ctr;
-	static unsigned char *curr = NULL;
-	static socklen_t buflen = 0;
-	static int sock_fd = -1;
-	int i, count, item_size;
-
-	if (sock_fd < 0) {
-		sock_fd = socket(pf, SOCK_SEQPACKET, 0);
-		if (sock_fd < 0)
-			die_errno("Unable to create socket");
-	}
-
-	/* We should only loop once on the first call; after that the
-	 * buffer requirements for RDS counters should not change. */
-	while ((item_size = getsockopt(sock_fd, sol, RDS_INFO_COUNTERS, curr, &buflen)) < 0) {
-		if (errno != ENOSPC)
-			die_errno("getsockopt(RDS_INFO_COUNTERS) failed");
-		curr = realloc(curr, buflen);
-		if (!curr)
-			die_errno("Cannot allocate buffer for stats counters");
-	}
+/*
+ * --matrix runs the test once for every combination of the values given
+ * for its axes, one point after the other over the same control
+ * connections: when a point is over, the active side says so and sends
+ * the options of the next one, and the passive side hands them to its
+ * children, reusing them where it can. A table of all the points is
+ * printed at the end.
+ */
+#define MAX_AXIS_VALUES		64
+#define MAX_MATRIX_POINTS	4096
 
-	if (item_size > sizeof(*ctr))
-		die("Bad counter item size in RDS_INFO_COUNTERS (got %d, max %zd)\n",
-				item_size, sizeof(*ctr));
-	count = buflen / item_size;
+enum {
+	AXIS_REQ_SIZE,
+	AXIS_ACK_SIZE,
+	AXIS_DEPTH,
+	AXIS_TASKS,
+	AXIS_RDMA_SIZE,
+	AXIS_RATE,
+	NR_AXES
+};
 
-	if (prev == NULL) {
-		/* First call - allocate buffer */
-		prev = calloc(count, sizeof(*ctr));
-		ctr = calloc(count, sizeof(*ctr));
-	}
+static const char *axis_names[NR_AXES] = {
+	[AXIS_REQ_SIZE]		= "q",
+	[AXIS_ACK_SIZE]		= "a",
+	[AXIS_DEPTH]		= "d",
+	[AXIS_TASKS]		= "t",
+	[AXIS_RDMA_SIZE]	= "D",
+	[AXIS_RATE]		= "rate",
+};
 
-	for (i = 0; i < count; ++i)
-		memcpy(ctr + i, curr + i * item_size, item_size);
+struct axis {
+	int		what;
+	unsigned int	nr;
+	uint32_t	val[MAX_AXIS_VALUES];
+};
 
-	gettimeofday(&now, NULL);
+static struct axis	axes[NR_AXES];
+static unsigned int	nr_axes;
+static int		matrix_json;
 
-	if (initialize) {
-		for (i = 0; i < count; ++i) {
-			printf(",%s", ctr[i].name);
-			if (strstr((char *) ctr[i].name, "_bytes"))
-				printf(":bytes");
-			else
-				printf(":count");
+/* q=1K,4K,16K;d=1,8 - the axes are separated by ';' or white space */
+static void parse_axes(char *spec)
+{
+	char *item, *list, *val, *save, *save_val;
+	struct axis *ax;
+	unsigned int k;
+	int what;
+
+	for (item = strtok_r(spec, "; \t\n", &save); item;
+	     item = strtok_r(NULL, "; \t\n", &save)) {
+		list = strchr(item, '=');
+		if (!list)
+			die("invalid matrix axis '%s'\n", item);
+		*list++ = '\0';
+
+		for (what = 0; what < NR_AXES; what++) {
+			if (!strcmp(item, axis_names[what]))
+				break;
+		}
+		if (what == NR_AXES)
+			die("unknown matrix axis '%s'\n", item);
+		for (k = 0; k < nr_axes; k++) {
+			if (axes[k].what == what)
+				die("matrix axis '%s' given twice\n", item);
 		}
-	} else {
-		double scale;
 
-		scale = 1e6 / usec_sub(&now, &last_ts);
-		for (i = 0; i < count; ++i) {
-			printf(",%f",
-				(ctr[i].value - prev[i].value) * scale);
+		ax = &axes[nr_axes++];
+		ax->what = what;
+		ax->nr = 0;
+		for (val = strtok_r(list, ",", &save_val); val;
+		     val = strtok_r(NULL, ",", &save_val)) {
+			if (ax->nr == MAX_AXIS_VALUES)
+				die("matrix axis '%s' has more than %u values\n",
+				    item, MAX_AXIS_VALUES);
+			ax->val[ax->nr++] = parse_ull(val, (uint32_t)~0);
 		}
+		if (ax->nr == 0)
+			die("matrix axis '%s' has no values\n", item);
 	}
-
-	memcpy(prev, ctr, count * sizeof(*ctr));
-	last_ts = now;
-
-	get_stats(initialize);
 }
 
-static int reap_one_child(int wflags)
+/* the axes on the command line, or in a file after an '@' */
+static void parse_matrix(char *spec)
 {
-	pid_t pid;
-	int status;
-
-	pid = waitpid(-1, &status, wflags);
-	if (pid < 0)
-		die("waitpid returned %u", pid);
-	if (pid == 0)
-		return 0;
+	char line[1024], *p;
+	FILE *f;
 
-	if (WIFEXITED(status)) {
-		if (WEXITSTATUS(status) == 0)
-			return 1;
-		die("child pid %u exited with status %d\n",
-				pid, WEXITSTATUS(status));
+	if (spec[0] != '@') {
+		parse_axes(spec);
+		return;
+	}
+
+	f = fopen(spec + 1, "r");
+	if (!f)
+		die_errno("cannot open matrix file '%s'", spec + 1);
+	while (fgets(line, sizeof(line), f)) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		parse_axes(line);
 	}
-	if (WIFSIGNALED(status)) {
-		if (WTERMSIG(status) == SIGTERM)
-			return 1;
-		die("child pid %u exited with signal %d\n",
-				pid, WTERMSIG(status));
+	fclose(f);
+}
+
+static unsigned int matrix_points(void)
+{
+	unsigned int k, nr = 1;
+
+	for (k = 0; k < nr_axes; k++) {
+		nr *= axes[k].nr;
+		if (nr > MAX_MATRIX_POINTS)
+			die("the matrix has more than %u points\n",
+			    MAX_MATRIX_POINTS);
 	}
-	die("child pid %u wait status %d\n", pid, status);
+	return nr;
 }
 
-static void release_children_and_wait(struct options *opts,
-				      struct child_control *ctl,
-				      struct soak_control *soak_arr,
-				      int active)
+/* which value of axis k a point takes; the last axis changes fastest */
+static unsigned int point_index(unsigned int point, unsigned int k)
 {
-	struct counter disp[NR_STATS];
-	struct counter summary[NR_STATS];
-	struct timeval start, end, now, first_ts, last_ts;
-	double cpu_total = 0;
-	uint16_t i, j, cpu_samples = 0;
-	uint16_t nr_running;
-        uint64_t latency_histogram[MAX_BUCKETS];
+	unsigned int j;
 
-	if (show_histogram) 
-        	memset(latency_histogram, 0, sizeof(latency_histogram));
+	for (j = k + 1; j < nr_axes; j++)
+		point /= axes[j].nr;
+	return point % axes[k].nr;
+}
 
-	gettimeofday(&start, NULL);
-	start.tv_sec += 2;
-	for (i = 0; i < opts->nr_tasks; i++)
-		ctl[i].start = start;
+static void matrix_point(struct options *opts, unsigned int point)
+{
+	struct axis *ax;
+	uint32_t val;
+	unsigned int k;
 
-	/* Allow for a 4 second delay: 2 seconds for the children
-	 * to come up, and 2 more of burn-in time
-	 */
-	printf("Starting up"); fflush(stdout);
-	for (i = 0; i < 4; ++i) {
-		sleep(1);
-		stat_snapshot(disp, ctl, opts->nr_tasks);
-		cpu_use(soak_arr);
-		printf(".");
-		fflush(stdout);
-	}
-	printf("\n");
+	for (k = 0; k < nr_axes; k++) {
+		ax = &axes[k];
+		val = ax->val[point_index(point, k)];
 
-	gettimeofday(&first_ts, NULL);
-	if (opts->run_time && active) {
-		end = first_ts;
-		end.tv_sec += opts->run_time;
-	} else {
-		timerclear(&end);
+		switch (ax->what) {
+		case AXIS_REQ_SIZE:
+			opts->req_size = val;
+			break;
+		case AXIS_ACK_SIZE:
+			opts->ack_size = val;
+			break;
+		case AXIS_DEPTH:
+			opts->req_depth = val;
+			break;
+		case AXIS_TASKS:
+			opts->nr_tasks = val;
+			break;
+		case AXIS_RDMA_SIZE:
+			opts->rdma_size = val;
+			break;
+		case AXIS_RATE:
+			opts->rate = val;
+			break;
+		}
 	}
+}
 
-	nr_running = opts->nr_tasks;
-	memset(summary, 0, sizeof(summary));
+/*
+ * Passive side: the active says when a point is over, then sends the
+ * options of the next one or hangs up. Is there another point?
+ */
+static int matrix_next(int fd)
+{
+	uint8_t over;
 
-	if (opts->rtprio)
-		set_rt_priority();
+	if (read(fd, &over, sizeof(over)) != sizeof(over))
+		return 0;
+	return recv(fd, &over, sizeof(over), MSG_PEEK) == sizeof(over);
+}
 
-	/* Prime the perf data counters and display the CSV header line
-	 * You can filter the CSV data from the rds-stress output by
-	 * grepping for the "::" marker.
-	 */
-	if (opt.show_perfdata) {
-		printf("::");
-		printf("nr_tasks:count"
-		       ",req_size:bytes"
-		       ",ack_size:bytes"
-		       ",rdma_size:bytes");
+static void print_matrix(const struct options *base,
+			 const struct run_result *res, unsigned int nr)
+{
+	static const char *keys[] = {
+		"req_size", "ack_size", "depth", "tasks", "rdma_size", "rate",
+		"tx_per_sec", "rx_per_sec", "kbytes_per_sec", "tx_usecs",
+		"rtt_usecs", "p50_usecs", "p99_usecs", "p999_usecs", "cpu",
+		"warmup_secs",
+	};
+	const char *fmt;
+	struct options o;
+	double val[sizeof(keys) / sizeof(keys[0])];
+	unsigned int p, k;
 
-		printf(",req_sent:count"
-		       ",thruput:kB/s"
-		       ",thruput_rdma:kB/s"
-		       ",tx_delay:microseconds"
-		       ",rtt:microseconds"
-		       ",cpu:percent");
-		get_perfdata(1);
+	printf("\n");
+	if (matrix_json)
+		printf("[\n");
+	else {
+		for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++)
+			printf("%s%s", k ? "," : "", keys[k]);
 		printf("\n");
-	} else {
-		printf("%4s %6s %6s %10s %10s %10s %7s %8s %5s\n",
-			"tsks", "tx/s", "rx/s", "tx+rx K/s", "mbi K/s",
-			"mbo K/s", "tx us/c", "rtt us", "cpu %");
 	}
 
-	last_ts = first_ts;
-	while (nr_running) {
-		double cpu;
-
-		if (active) {
-			sleep(1);
-		} else {
-			struct pollfd pfd;
-
-			pfd.fd = control_fd;
-			pfd.events = POLLIN|POLLHUP;
-			if (poll(&pfd, 1, 1000) == 1)
-				break;
+	for (p = 0; p < nr; p++, res++) {
+		o = *base;
+		matrix_point(&o, p);
+		val[0] = o.req_size;
+		val[1] = o.ack_size;
+		val[2] = o.req_depth;
+		val[3] = o.nr_tasks;
+		val[4] = o.rdma_size;
+		val[5] = o.rate;
+		val[6] = res->tx_per_sec;
+		val[7] = res->rx_per_sec;
+		val[8] = res->kbytes_per_sec;
+		val[9] = res->tx_usecs;
+		val[10] = res->rtt_usecs;
+		val[11] = res->p50_usecs;
+		val[12] = res->p99_usecs;
+		val[13] = res->p999_usecs;
+		val[14] = res->cpu;
+		val[15] = res->warmup_secs;
+
+		if (matrix_json)
+			printf("  {");
+		for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+			fmt = k < 6 ? "%.0f" : "%.2f";
+			if (matrix_json)
+				printf("%s\"%s\": ", k ? ", " : " ", keys[k]);
+			else if (k)
+				printf(",");
+			printf(fmt, val[k]);
 		}
+		if (matrix_json)
+			printf(" }%s", p + 1 < nr ? "," : "");
+		printf("\n");
+	}
+	if (matrix_json)
+		printf("]\n");
+}
 
-		/* XXX big bug, need to mark some ctl elements dead */
-		stat_snapshot(disp, ctl, nr_running);
-		gettimeofday(&now, NULL);
-		cpu = cpu_use(soak_arr);
+/* the children of the active side, kept from one point to the next */
+static struct child_control	*point_ctl;
+static uint16_t			point_tasks;
 
-		if (!opts->summary_only) {
-			double scale;
+/*
+ * Run the test once with the options of one point, over the control
+ * connections of the peers. With keep_control they stay open for the
+ * next point.
+ */
+static void run_point(struct options *opts, struct soak_control *soak_arr,
+		      struct run_result *res)
+{
+	struct options peer_opts;
+	struct peer *pr;
+	unsigned int p, i;
+	uint16_t port;
+	uint8_t ok;
+	int warm;
 
-			/* Every loop takes a little more than one second;
-			 * and system load can actually introduce latencies.
-			 * So try to measure the actual time elapsed as precise
-			 * as possible, and scale all values by its inverse.
-			 */
-			scale = 1e6 / usec_sub(&now, &last_ts);
+	/* "negotiation" is overstating things a bit :-)
+	 * We just tell the peers what options to use, and
+	 * in a mesh which of our tasks are theirs.
+	 */
+	for (p = 0, pr = peers; p < nr_peers; p++, pr++) {
+		pr->first_task = p * opts->nr_tasks;
+		pr->nr_tasks = opts->nr_tasks;
+
+		peer_opts = *opts;
+		peer_opts.send_addr = pr->addr;
+		if (nr_peers > 1)
+			peer_opts.peer_port = opts->starting_port +
+					      p * opts->nr_tasks;
+		send_options(pr->fd, &peer_opts);
+	}
+	/* the same form for every peer */
+	memcpy(opts->version, peer_opts.version, VERSION_MAX_LEN);
 
-			if (!opt.show_perfdata) {
-				printf("%4u %6"PRIu64" %6"PRIu64" %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f\n",
-					nr_running,
-					disp[S_REQ_TX_BYTES].nr,
-					disp[S_REQ_RX_BYTES].nr,
-					scale * throughput(disp) / 1024.0,
-					scale * throughput_mbi(disp) / 1024.0,
-					scale * throughput_mbo(disp) / 1024.0,
-					scale * avg(&disp[S_SENDMSG_USECS]),
-					scale * avg(&disp[S_RTT_USECS]),
-					scale * cpu);
-			} else {
-				printf("::");
-				printf("%u,%u,%u,%u,",
-				       opts->nr_tasks, opts->req_size,
-				       opts->ack_size, opts->rdma_size);
+	printf("negotiated options\n");
+	opts->nr_tasks *= nr_peers;
 
-				printf("%Lu,%f,%f,%f,%f,%f,%f",
-					(unsigned long long) disp[S_REQ_TX_BYTES].nr,
-					scale * throughput(disp) / 1024.0,
-					scale * throughput_mbi(disp) / 1024.0,
-					scale * throughput_mbo(disp) / 1024.0,
-					scale * avg(&disp[S_SENDMSG_USECS]),
-					scale * avg(&disp[S_RTT_USECS]),
-					cpu >= 0? scale * cpu : 0);
+	/* the children of the last point may do for this one */
+	warm = point_ctl && pool_fits(point_ctl, point_tasks, opts);
+	if (warm) {
+		unpark_children(point_ctl, opts);
+	} else {
+		if (point_ctl)
+			retire_children(point_ctl, point_tasks);
+		point_ctl = start_children(opts, 1);
+		point_tasks = opts->nr_tasks;
+	}
+	printf("%u tasks ready in %.2f ms (%s)\n", opts->nr_tasks,
+	       startup_ns / 1e6, warm ? "reused" : "started");
 
-				/* Print RDS perf counters etc */
-				get_perfdata(0);
-				printf("\n");
-			}
+	peer_hist_alloc();
 
-			rdma_key_o_meter_check(opts->nr_tasks);
+	/* Tell the peers to start up. This is necessary when testing
+	 * with a large number of tasks, because otherwise a peer
+	 * may start sending before we have all our tasks running.
+	 * Older peers echo our go, newer ones answer with where
+	 * their tasks for us are.
+	 */
+	ok = 0;
+	for (p = 0; p < nr_peers; p++)
+		peer_send(peers[p].fd, &ok, sizeof(ok));
+	for (p = 0, pr = peers; p < nr_peers; p++, pr++) {
+		peer_recv(pr->fd, &ok, sizeof(ok));
+		if (ok) {
+			peer_recv(pr->fd, &port, sizeof(port));
+			for (i = 0; i < pr->nr_tasks; i++)
+				point_ctl[pr->first_task + i].peer_port = ntohs(port);
 		}
-
-		stat_accumulate(summary, disp);
-		cpu_total += cpu;
-		cpu_samples++;
-		last_ts = now;
-
-		if (timerisset(&end) && timercmp(&now, &end, >=))
-			break;
-
-		/* see if any children have finished or died.
-		 * This is a bit touchy - we should really be
-		 * able to tell an exited soaker from an exiting
-		 * RDS child. */
-		if (reap_one_child(WNOHANG))
-			nr_running--;
 	}
 
-	close(control_fd);
-	control_fd = -1;
+	release_children_and_wait(opts, point_ctl, soak_arr, 1, res);
+}
 
-	if (nr_running) {
-		/* let everything gracefully stop before we kill the chillins */
-		for (i = 0; i < opts->nr_tasks; i++)
-			ctl[i].stopping = 1;
-		sleep(1);
+/* open loop requests go out when due, up to --backlog of them */
+static void open_loop_depth(struct options *opts)
+{
+	if (opts->rate)
+		opts->req_depth = opts->backlog;
+}
 
-		for (i = 0; i < opts->nr_tasks; i++)
-			kill(ctl[i].pid, SIGTERM);
-		stop_soakers(soak_arr);
+/* the options of a point of a --matrix or --search session */
+static void start_point(struct options *opts)
+{
+	opts->matrix = 1;
+	open_loop_depth(opts);
+	if (opts->rdma_size && !check_rdma_support(opts))
+		die("RDMA not supported by this kernel\n");
+	opt = *opts;
+}
+
+static void run_matrix(struct options *opts, struct soak_control *soak_arr)
+{
+	struct run_result *results;
+	struct options base = *opts;
+	unsigned int k, point, nr_points = matrix_points();
+
+	results = calloc(nr_points, sizeof(*results));
+	if (!results)
+		die("ERROR: failed to alloc memory\n");
+
+	for (point = 0; point < nr_points && !interrupted; point++) {
+		*opts = base;
+		matrix_point(opts, point);
+		printf("\nmatrix point %u of %u:", point + 1, nr_points);
+		for (k = 0; k < nr_axes; k++)
+			printf(" %s=%u", axis_names[axes[k].what],
+			       axes[k].val[point_index(point, k)]);
+		printf("\n");
+		start_point(opts);
+		run_point(opts, soak_arr, &results[point]);
 	}
 
-	while (nr_running && reap_one_child(0))
-		nr_running--;
+	print_matrix(&base, results, point);
+	free(results);
+}
 
-	rdma_key_o_meter_check(opts->nr_tasks);
+/*
+ * --search finds the highest load that still meets the --slo. The load
+ * starts at the low end of the range and doubles until a point misses
+ * the SLO, then the gap between the last point that met it and the
+ * first that didn't is bisected. Each step is a full run, warm-up
+ * included, over the same connections and children as --matrix.
+ */
+#define MAX_SEARCH_STEPS	64
 
-	stat_total(disp, ctl, opts->nr_tasks);
-	if (!opts->summary_only)
-		printf("---------------------------------------------\n");
-	{
-		double scale;
+static int		search_what = -1;
+static uint32_t		search_lo, search_hi;
 
-		scale = 1e6 / usec_sub(&last_ts, &first_ts);
+struct search_step {
+	uint32_t		val;
+	int			met;
+	struct run_result	res;
+};
 
-		printf("%4u %6lu %6lu %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f  (average)\n",
-			opts->nr_tasks,
-			(long) (scale * summary[S_REQ_TX_BYTES].nr),
-			(long) (scale * summary[S_REQ_RX_BYTES].nr),
-			scale * throughput(summary) / 1024.0,
-			scale * throughput_mbi(summary) / 1024.0,
-			scale * throughput_mbo(summary) / 1024.0,
-			avg(&summary[S_SENDMSG_USECS]),
-			avg(&summary[S_RTT_USECS]),
-			soak_arr? scale * cpu_total : -1.0);
+/* p99=50, p99.9=200us */
+static void parse_slo(char *spec)
+{
+	char *end;
+
+	if (spec[0] != 'p')
+		die("invalid SLO '%s'\n", spec);
+	slo_pct = strtod(spec + 1, &end);
+	if (end == spec + 1 || *end != '=' || slo_pct <= 0 || slo_pct > 100)
+		die("invalid SLO '%s'\n", spec);
+	slo_usecs = strtod(end + 1, &end);
+	if (!strcmp(end, "us"))
+		end += 2;
+	if (*end || slo_usecs <= 0)
+		die("invalid SLO '%s'\n", spec);
+}
 
-		if (show_histogram) 
-		{
-			for (i = 0; i < opts->nr_tasks; i++)
-			  for (j=0;j < MAX_BUCKETS; j++)
-			    latency_histogram[j] += ctl[i].latency_histogram[j];
-			    
-			printf("\nRTT histogram\n");
-			printf("RTT (us)        \t\t    Count\n");
-			for (i=0;i < MAX_BUCKETS; i++)
-			  printf("[%6u - %6u] \t\t %8u\n", 1 << i, 1 << (i+1), 
-			         (unsigned int)latency_histogram[i]);
-		}
+/* rate, d or t, optionally followed by =lo:hi */
+static void parse_search(char *spec)
+{
+	char *range, *colon;
+
+	range = strchr(spec, '=');
+	if (range)
+		*range++ = '\0';
+
+	if (!strcmp(spec, axis_names[AXIS_RATE]))
+		search_what = AXIS_RATE;
+	else if (!strcmp(spec, axis_names[AXIS_DEPTH]))
+		search_what = AXIS_DEPTH;
+	else if (!strcmp(spec, axis_names[AXIS_TASKS]))
+		search_what = AXIS_TASKS;
+	else
+		die("cannot search '%s', only rate, d or t\n", spec);
+
+	if (range) {
+		colon = strchr(range, ':');
+		if (!colon)
+			die("invalid search range '%s'\n", range);
+		*colon++ = '\0';
+		search_lo = parse_ull(range, (uint32_t)~0);
+		search_hi = parse_ull(colon, (uint32_t)~0);
 	}
 }
 
-static void peer_connect(int fd, const struct sockaddr_in *sin)
+static void search_point(struct options *opts, uint32_t val)
 {
-	int retries = 0;
+	switch (search_what) {
+	case AXIS_RATE:
+		opts->rate = val;
+		break;
+	case AXIS_DEPTH:
+		opts->req_depth = val;
+		break;
+	case AXIS_TASKS:
+		opts->nr_tasks = val;
+		break;
+	}
+}
 
-	printf("connecting to %s:%u",
-			inet_ntoa(sin->sin_addr),
-			ntohs(sin->sin_port));
-	fflush(stdout);
+/*
+ * --rate is what each peer's children offer between them, while tx/s
+ * sums up all peers, so compare it with the rate of the whole mesh.
+ */
+static double offered_rate(uint32_t rate)
+{
+	return (double) rate * max(nr_peers, 1);
+}
 
-	while (connect(fd, (struct sockaddr *) sin, sizeof(*sin))) {
-		if (retries == 0)
-			printf(": %s", strerror(errno));
+/* an open loop point also has to keep up with its offered rate */
+static int slo_met(uint32_t rate, const struct run_result *res)
+{
+	if (!res->tx_per_sec || res->slo_usecs > slo_usecs)
+		return 0;
+	return !rate || res->tx_per_sec >= 0.95 * offered_rate(rate);
+}
 
-		switch (errno) {
-		case ECONNREFUSED:
-		case EHOSTUNREACH:
-		case ENETUNREACH:
-			if (retries >= opt.connect_retries)
-				break;
-			if (retries++ == 0)
-				printf(" - retrying");
-			printf(".");
-			fflush(stdout);
-			sleep(1);
-			continue;
-		}
+/* how close the bisection gets: 2% of the rate, or exactly for d and t */
+static uint32_t search_gap(uint32_t pass)
+{
+	if (search_what == AXIS_RATE && pass / 50 > 1)
+		return pass / 50;
+	return 1;
+}
 
-		printf("\n");
-		die("connect(%s) failed", inet_ntoa(sin->sin_addr));
-	}
-	printf("\n");
+static int step_cmp(const void *a, const void *b)
+{
+	const struct search_step *x = a, *y = b;
+
+	return (x->val > y->val) - (x->val < y->val);
 }
 
-static void peer_send(int fd, const void *ptr, size_t size)
+static void print_step(const char *what, const struct search_step *st)
 {
-	ssize_t ret;
+	printf("%s: %s=%u, tx/s %.0f, p%g %.2f us\n", what,
+	       axis_names[search_what], st->val, st->res.tx_per_sec,
+	       slo_pct, st->res.slo_usecs);
+}
 
-	while (size) {
-		ret = write(fd, ptr, size);
-		if (ret < 0)
-			die_errno("Cannot send to peer");
-		size -= ret;
-		ptr += ret;
+/*
+ * The table of all steps, the best one, and the knee: with throughput
+ * and latency both scaled to 0..1 over the steps, the step that is
+ * furthest ahead in throughput of its latency.
+ */
+static void print_search(struct search_step *steps, unsigned int nr)
+{
+	const struct search_step *st, *best = NULL, *knee = NULL;
+	double min_tx, max_tx, min_lat, max_lat, x, y, score = 0;
+
+	qsort(steps, nr, sizeof(*steps), step_cmp);
+
+	printf("\nsearch for %s, SLO p%g <= %.2f us:\n",
+	       axis_names[search_what], slo_pct, slo_usecs);
+	printf("%10s %10s %10s %10s %10s %10s %10s %4s\n",
+	       axis_names[search_what], "tx/s", "rtt us", "p50 us", "p99 us",
+	       "p99.9 us", "slo us", "met");
+
+	min_tx = max_tx = steps[0].res.tx_per_sec;
+	min_lat = max_lat = steps[0].res.slo_usecs;
+	for (st = steps; st < steps + nr; st++) {
+		printf("%10u %10.0f %10.2f %10.2f %10.2f %10.2f %10.2f %4s\n",
+		       st->val, st->res.tx_per_sec, st->res.rtt_usecs,
+		       st->res.p50_usecs, st->res.p99_usecs,
+		       st->res.p999_usecs, st->res.slo_usecs,
+		       st->met ? "yes" : "no");
+		if (st->met)
+			best = st;
+		min_tx = min(min_tx, st->res.tx_per_sec);
+		max_tx = max(max_tx, st->res.tx_per_sec);
+		min_lat = min(min_lat, st->res.slo_usecs);
+		max_lat = max(max_lat, st->res.slo_usecs);
+	}
+
+	for (st = steps; st < steps + nr; st++) {
+		x = max_tx > min_tx ?
+			(st->res.tx_per_sec - min_tx) / (max_tx - min_tx) : 0;
+		y = max_lat > min_lat ?
+			(st->res.slo_usecs - min_lat) / (max_lat - min_lat) : 0;
+		if (!knee || x - y > score) {
+			knee = st;
+			score = x - y;
+		}
 	}
+
+	if (best)
+		print_step("highest load meeting the SLO", best);
+	else
+		printf("no load meeting the SLO, not even %s=%u\n",
+		       axis_names[search_what], steps[0].val);
+	print_step("knee of the throughput/latency curve", knee);
 }
 
-static void peer_recv(int fd, void *ptr, size_t size)
+static void run_search(struct options *opts, struct soak_control *soak_arr)
 {
-	ssize_t ret;
+	struct search_step steps[MAX_SEARCH_STEPS], *st;
+	struct options base = *opts;
+	uint32_t val = search_lo, pass = 0, fail = 0;
+	unsigned int nr = 0;
+
+	while (nr < MAX_SEARCH_STEPS) {
+		st = &steps[nr++];
+		st->val = val;
+
+		*opts = base;
+		search_point(opts, val);
+		printf("\nsearch step %u: %s=%u\n", nr,
+		       axis_names[search_what], val);
+		start_point(opts);
+		run_point(opts, soak_arr, &st->res);
+		st->met = slo_met(search_what == AXIS_RATE ? val : base.rate,
+				  &st->res);
+		print_step(st->met ? "meets the SLO" : "misses the SLO", st);
+		if (interrupted)
+			break;
 
-	if (size == sizeof(struct options)) {
-		memset(ptr, 0, size);
-		ret = read(fd, peer_version, VERSION_MAX_LEN);
-		if (ret != VERSION_MAX_LEN)
-			die_errno("Failed to read version");
+		if (st->met)
+			pass = val;
+		else
+			fail = val;
 
-		if (strcmp(peer_version, RDS_VERSION)) {
-			ptr += ret;
-			memcpy(ptr, peer_version, VERSION_MAX_LEN);
-			size = sizeof(struct options_2_0_6) - ret;
-		} else
-			size -= ret;
-		ptr += ret;
+		/* the low end misses, there is nothing to search */
+		if (!pass)
+			break;
+		/* still doubling */
+		if (!fail) {
+			if (val == search_hi)
+				break;
+			val = val > search_hi / 2 ? search_hi : val * 2;
+			continue;
+		}
+		if (fail - pass <= search_gap(pass))
+			break;
+		val = pass + (fail - pass) / 2;
 	}
 
-	while (size) {
-		ret = read(fd, ptr, size);
-		if (ret < 0)
-			die_errno("Cannot recv from peer");
-		if (ret == 0)
-			die("Peer unexpectedly closed connection\n");
-		size -= ret;
-		ptr += ret;
-	}
+	print_search(steps, nr);
 }
 
-static void encode_options(struct options *dst, const struct options *src)
-{
-	memcpy(dst->version, src->version, VERSION_MAX_LEN);
-	dst->req_depth = htonl(src->req_depth);
-	dst->req_size = htonl(src->req_size);
-	dst->ack_size = htonl(src->ack_size);
-	dst->rdma_size = htonl(src->rdma_size);
-	dst->send_addr = htonl(src->send_addr);		/* host byte order */
-	dst->receive_addr = htonl(src->receive_addr);	/* host byte order */
-	dst->starting_port = htons(src->starting_port);	/* host byte order */
-	dst->nr_tasks = htons(src->nr_tasks);
-	dst->run_time = htonl(src->run_time);
-	dst->summary_only = src->summary_only;		/* byte sized */
-	dst->rtprio = src->rtprio;			/* byte sized */
-	dst->tracing = src->tracing;			/* byte sized */
-	dst->verify = src->verify;			/* byte sized */
-	dst->show_params = src->show_params;		/* byte sized */
-	dst->show_perfdata = src->show_perfdata;	/* byte sized */
-	dst->use_cong_monitor = src->use_cong_monitor;	/* byte sized */
-	dst->rdma_use_once = src->rdma_use_once;	/* byte sized */
-	dst->rdma_use_get_mr = src->rdma_use_get_mr;	/* byte sized */
-	dst->rdma_use_fence = src->rdma_use_fence;	/* byte sized */
-	dst->rdma_cache_mrs = src->rdma_cache_mrs;	/* byte sized */
-	dst->rdma_key_o_meter = src->rdma_key_o_meter;	/* byte sized */
+/*
+ * --curve steps the offered --rate from lo to hi, each step measured
+ * once it is steady, and stops once the children can no longer
+ * send what is offered. The curve is printed as a table and written to
+ * a data file for gnuplot, with a few of the RDS counters as rates.
+ */
+#define MAX_CURVE_STEPS		256
+
+static uint32_t		curve_lo, curve_hi, curve_step;
+static double		curve_factor;
+static char		*curve_data = "rds-stress-curve.dat";
+
+static const char *curve_counters[] = {
+	"recv_delivered",
+	"recv_drop_no_sock",
+	"recv_delayed_retry",
+	"send_queue_full",
+	"send_delayed_retry",
+	"send_lock_contention",
+	"cong_send_blocked",
+	"conn_reset",
+};
+#define NR_CURVE_COUNTERS (sizeof(curve_counters) / sizeof(curve_counters[0]))
 
-	dst->rdma_alignment = htonl(src->rdma_alignment);
-	dst->connect_retries = htonl(src->connect_retries);
+struct curve_step {
+	uint32_t		rate;
+	struct run_result	res;
+};
 
-	dst->suppress_warnings = src->suppress_warnings;/* byte sized */
-        dst->simplex = src->simplex;                    /* byte sized */
-        dst->rw_mode = src->rw_mode;                    /* byte sized */
-        dst->rdma_vector = htonl(src->rdma_vector);
-	dst->tos = src->tos;
-	dst->async = src->async;
+/* lo:hi:step adds step to the rate, lo:hi:xF multiplies it by F */
+static void parse_curve(char *spec)
+{
+	char *hi, *step;
+
+	hi = strchr(spec, ':');
+	step = hi ? strchr(hi + 1, ':') : NULL;
+	if (!step)
+		die("invalid curve '%s', expected lo:hi:step\n", spec);
+	*hi++ = '\0';
+	*step++ = '\0';
+
+	curve_lo = parse_ull(spec, (uint32_t)~0);
+	curve_hi = parse_ull(hi, (uint32_t)~0);
+	if (step[0] == 'x') {
+		curve_factor = strtod(step + 1, &hi);
+		if (*hi || curve_factor <= 1)
+			die("curve factor must be more than 1\n");
+	} else {
+		curve_step = parse_ull(step, (uint32_t)~0);
+		if (curve_step == 0)
+			die("curve step must be at least 1\n");
+	}
+	if (curve_lo == 0 || curve_lo > curve_hi)
+		die("invalid curve range %u:%u\n", curve_lo, curve_hi);
 }
 
-static void decode_options(struct options *dst, const struct options *src)
+static uint64_t curve_next(uint64_t rate)
 {
-	memcpy(dst->version, src->version, VERSION_MAX_LEN);
-	dst->req_depth = ntohl(src->req_depth);
-	dst->req_size = ntohl(src->req_size);
-	dst->ack_size = ntohl(src->ack_size);
-	dst->rdma_size = ntohl(src->rdma_size);
-	dst->send_addr = ntohl(src->send_addr);		/* host byte order */
-	dst->receive_addr = ntohl(src->receive_addr);	/* host byte order */
-	dst->starting_port = ntohs(src->starting_port);	/* host byte order */
-	dst->nr_tasks = ntohs(src->nr_tasks);
-	dst->run_time = ntohl(src->run_time);
-	dst->summary_only = src->summary_only;		/* byte sized */
-	dst->rtprio = src->rtprio;			/* byte sized */
-	dst->tracing = src->tracing;			/* byte sized */
-	dst->verify = src->verify;			/* byte sized */
-	dst->show_params = src->show_params;		/* byte sized */
-	dst->show_perfdata = src->show_perfdata;	/* byte sized */
-	dst->use_cong_monitor = src->use_cong_monitor;	/* byte sized */
-	dst->rdma_use_once = src->rdma_use_once;	/* byte sized */
-	dst->rdma_use_get_mr = src->rdma_use_get_mr;	/* byte sized */
-	dst->rdma_use_fence = src->rdma_use_fence;	/* byte sized */
-	dst->rdma_cache_mrs = src->rdma_cache_mrs;	/* byte sized */
-	dst->rdma_key_o_meter = src->rdma_key_o_meter;	/* byte sized */
+	if (curve_factor)
+		return max((uint64_t) (rate * curve_factor), rate + 1);
+	return rate + curve_step;
+}
 
-	dst->rdma_alignment = ntohl(src->rdma_alignment);
-	dst->connect_retries = ntohl(src->connect_retries);
+static unsigned int curve_steps(void)
+{
+	unsigned int nr = 0;
+	uint64_t rate;
 
-	dst->suppress_warnings = src->suppress_warnings;/* byte sized */
-        dst->simplex = src->simplex;                    /* byte sized */
-        dst->rw_mode = src->rw_mode;                    /* byte sized */
-	dst->rdma_vector = ntohl(src->rdma_vector);
-	dst->tos = src->tos;
-	dst->async = src->async;
+	for (rate = curve_lo; rate <= curve_hi; rate = curve_next(rate)) {
+		if (++nr > MAX_CURVE_STEPS)
+			die("the curve has more than %u steps\n",
+			    MAX_CURVE_STEPS);
+	}
+	return nr;
 }
 
-static void verify_option_encdec(const struct options *opts)
+/* the rate of a counter over a step, or -1 if we couldn't read it */
+static double curve_counter(const struct run_result *res, const char *name)
 {
-	struct options ebuf, dbuf;
-	unsigned int i;
+	int i;
 
-	memcpy(&dbuf, opts, sizeof(*opts));
-	for (i = 0; i < sizeof(*opts); ++i) {
-		unsigned char *x = &((unsigned char *) &dbuf)[i];
+	for (i = 0; res->rds && i < res->rds_count; i++) {
+		if (!strcmp((char *) res->rds[i].name, name))
+			return 1e6 * res->rds[i].value / res->usecs;
+	}
+	return -1;
+}
 
-		*x = ~*x;
+static void print_curve(const struct curve_step *steps, unsigned int nr)
+{
+	const struct curve_step *st;
+	unsigned int k;
+	double val;
+
+	printf("\nThroughput/latency curve\n");
+	printf("%10s %10s %9s %9s %9s %6s %8s", "rate", "tx/s", "p50 us",
+	       "p99 us", "p99.9 us", "cpu %", "warmup s");
+	for (k = 0; k < NR_CURVE_COUNTERS; k++)
+		printf(" %*s", (int) max(strlen(curve_counters[k]), 10),
+		       curve_counters[k]);
+	printf("\n");
+
+	for (st = steps; st < steps + nr; st++) {
+		printf("%10u %10.0f %9.2f %9.2f %9.2f", st->rate,
+		       st->res.tx_per_sec, st->res.p50_usecs,
+		       st->res.p99_usecs, st->res.p999_usecs);
+		if (st->res.cpu < 0)
+			printf(" %6s", "-");
+		else
+			printf(" %6.2f", st->res.cpu);
+		if (st->res.warmup_secs < 0)
+			printf(" %8s", "-");
+		else
+			printf(" %8.2f", st->res.warmup_secs);
+		for (k = 0; k < NR_CURVE_COUNTERS; k++) {
+			val = curve_counter(&st->res, curve_counters[k]);
+			if (val < 0)
+				printf(" %*s", (int) max(strlen(curve_counters[k]), 10), "-");
+			else
+				printf(" %*.0f", (int) max(strlen(curve_counters[k]), 10), val);
+		}
+		printf("\n");
 	}
+}
 
-	encode_options(&ebuf, opts);
-	decode_options(&dbuf, &ebuf);
+/* one line per step, what is missing as NaN so gnuplot skips it */
+static void write_curve(const struct curve_step *steps, unsigned int nr)
+{
+	const struct curve_step *st;
+	unsigned int k;
+	double val;
+	FILE *f;
+
+	f = fopen(curve_data, "w");
+	if (!f)
+		die_errno("cannot create curve data file '%s'", curve_data);
+
+	fprintf(f, "# rate tx_per_sec p50_usecs p99_usecs p999_usecs cpu warmup_secs");
+	for (k = 0; k < NR_CURVE_COUNTERS; k++)
+		fprintf(f, " %s_per_sec", curve_counters[k]);
+	fprintf(f, "\n");
+
+	for (st = steps; st < steps + nr; st++) {
+		fprintf(f, "%u %.2f %.2f %.2f %.2f", st->rate,
+			st->res.tx_per_sec, st->res.p50_usecs,
+			st->res.p99_usecs, st->res.p999_usecs);
+		if (st->res.cpu < 0)
+			fprintf(f, " NaN");
+		else
+			fprintf(f, " %.2f", st->res.cpu);
+		if (st->res.warmup_secs < 0)
+			fprintf(f, " NaN");
+		else
+			fprintf(f, " %.2f", st->res.warmup_secs);
+		for (k = 0; k < NR_CURVE_COUNTERS; k++) {
+			val = curve_counter(&st->res, curve_counters[k]);
+			if (val < 0)
+				fprintf(f, " NaN");
+			else
+				fprintf(f, " %.2f", val);
+		}
+		fprintf(f, "\n");
+	}
 
-	if (memcmp(&dbuf, opts, sizeof(*opts)))
-		die("encode/decode check of options struct failed");
+	if (fclose(f))
+		die_errno("cannot write curve data file '%s'", curve_data);
+	printf("curve data written to %s\n", curve_data);
 }
 
-static void reset_conn(struct options *opts)
+static void run_curve(struct options *opts, struct soak_control *soak_arr)
 {
-	struct rds_reset val;
-	int fd;
-	struct sockaddr_in sin;
+	struct curve_step *steps, *st;
+	struct options base = *opts;
+	unsigned int k, nr = 0;
+	uint64_t rate;
+
+	steps = calloc(curve_steps(), sizeof(*steps));
+	if (!steps)
+		die("ERROR: failed to alloc memory\n");
+
+	curve_rds = 1;
+	for (rate = curve_lo; rate <= curve_hi; rate = curve_next(rate)) {
+		st = &steps[nr++];
+		st->rate = rate;
+
+		*opts = base;
+		opts->rate = rate;
+		printf("\ncurve step %u: rate=%u\n", nr, st->rate);
+		start_point(opts);
+		run_point(opts, soak_arr, &st->res);
+
+		if (interrupted)
+			break;
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opts->starting_port);
-	sin.sin_addr.s_addr = htonl(opts->receive_addr);
+		/* past this, more offered load only grows the backlog */
+		if (st->res.tx_per_sec < 0.95 * offered_rate(rate)) {
+			printf("saturated at rate=%u, tx/s %.0f\n",
+			       st->rate, st->res.tx_per_sec);
+			break;
+		}
+	}
+	curve_rds = 0;
 
-	fd = bound_socket(pf, SOCK_SEQPACKET, 0, &sin);
+	print_curve(steps, nr);
+	write_curve(steps, nr);
 
-	val.tos = opts->tos;
-	val.src.s_addr = htonl(opts->receive_addr);
-	val.dst.s_addr = htonl(opts->send_addr);
-	if (setsockopt(fd, sol, SO_RDS_TRANSPORT, &val, sizeof(val)))
-		die_errno("setsockopt RDS_CONN_RESET failed");
+	for (k = 0; k < nr; k++)
+		free(steps[k].res.rds);
+	free(steps);
 }
 
 static int active_parent(struct options *opts, struct soak_control *soak_arr)
 {
-	struct options enc_options;
-	struct child_control *ctl;
 	struct sockaddr_in sin;
-	int fd;
-	uint8_t ok;
+	struct peer *pr;
+	unsigned int p;
 
 	if (reset_connection) {
 		reset_conn(opts);
@@ -2741,6 +7451,10 @@ static int active_parent(struct options *opts, struct soak_control *soak_arr)
 		       "Req size", opts->req_size,
 		       "ACK size", opts->ack_size,
 		       "RDMA size", opts->rdma_size);
+		if (opts->req_dist[0])
+			printf("  %-10s %s\n", "Req sizes", opts->req_dist);
+		if (opts->ack_dist[0])
+			printf("  %-10s %s\n", "ACK sizes", opts->ack_dist);
 
 		k = 0;
 		printf("  %-10s", "RDMA opts");
@@ -2769,111 +7483,228 @@ static int active_parent(struct options *opts, struct soak_control *soak_arr)
 	 * to add them to the encode/decode routines. */
 	verify_option_encdec(opts);
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(0);
-	sin.sin_addr.s_addr = htonl(opts->receive_addr);
+	/* -s is a mesh of one */
+	if (!nr_peers)
+		add_peer(opts->send_addr);
 
-	fd = bound_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sin);
-	control_fd = fd;
+	for (p = 0, pr = peers; p < nr_peers; p++, pr++) {
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(0);
+		sin.sin_addr.s_addr = htonl(opts->receive_addr);
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opts->starting_port);
-	sin.sin_addr.s_addr = htonl(opts->send_addr);
+		pr->fd = bound_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sin);
+
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(opts->starting_port);
+		sin.sin_addr.s_addr = htonl(pr->addr);
 
-	peer_connect(fd, &sin);
+		peer_connect(pr->fd, &sin);
 
-	if (opts->receive_addr == 0) {
-		opts->receive_addr = get_local_address(fd, &sin);
-		if (opts->rdma_size && !check_rdma_support(opts))
-			die("RDMA not supported by this kernel\n");
+		if (opts->receive_addr == 0) {
+			opts->receive_addr = get_local_address(pr->fd, &sin);
+			if (opts->rdma_size && !check_rdma_support(opts))
+				die("RDMA not supported by this kernel\n");
+		}
 	}
 
-	/* "negotiation" is overstating things a bit :-)
-	 * We just tell the peer what options to use.
-	 */
-	encode_options(&enc_options, opts);
-	if (opts->tos || opts->async)
-		peer_send(fd, &enc_options, sizeof(struct options));
+	if (!nr_axes && search_what < 0 && !curve_hi) {
+		run_point(opts, soak_arr, NULL);
+		return interrupted ? 128 + SIGINT : 0;
+	}
+
+	/* Several points run over the same connections and, where
+	 * they can, the same children */
+	reuse_children = 1;
+	keep_control = 1;
+	if (nr_axes)
+		run_matrix(opts, soak_arr);
+	else if (search_what >= 0)
+		run_search(opts, soak_arr);
 	else
-		peer_send(fd, &enc_options.req_depth,
-				sizeof(struct options_2_0_6));
+		run_curve(opts, soak_arr);
+	keep_control = 0;
+	close_control();
+	retire_children(point_ctl, point_tasks);
+	stop_soakers(soak_arr);
 
-	printf("negotiated options, tasks will start in 2 seconds\n");
-	ctl = start_children(opts, 1);
+	return interrupted ? 128 + SIGINT : 0;
+}
 
-	/* Tell the peer to start up. This is necessary when testing
-	 * with a large number of tasks, because otherwise the peer
-	 * may start sending before we have all our tasks running.
-	 */
-	peer_send(fd, &ok, sizeof(ok));
-	peer_recv(fd, &ok, sizeof(ok));
+/* read the options of the c-th client, whose tasks start at first_task */
+static void client_options(struct peer *pr, unsigned int c, uint32_t addr,
+			   uint16_t first_task)
+{
+	struct options remote;
 
-	release_children_and_wait(opts, ctl, soak_arr, 1);
+	peer_recv(pr->fd, &remote, sizeof(struct options));
+	decode_options(&remote, &remote);
 
-	return 0;
+	/*
+	 * The sender gave us their send and receive addresses, we need
+	 * to swap them.
+	 */
+	remote.send_addr = remote.receive_addr;
+	remote.receive_addr = addr;
+
+	/* Every client gets the next run of our ports */
+	if (remote.starting_port + first_task + remote.nr_tasks > (uint16_t)~0)
+		die("the tasks of %u clients don't fit in the port range\n",
+		    c + 1);
+	if (c && (strcmp(remote.req_dist, peers[0].opts->req_dist) ||
+		  strcmp(remote.ack_dist, peers[0].opts->ack_dist)))
+		die("clients need the same request and ack size distributions\n");
+	if (remote.matrix && nr_clients > 1)
+		die("a client with --matrix needs the passive side to itself\n");
+
+	pr->addr = remote.send_addr;
+	pr->first_task = first_task;
+	pr->nr_tasks = remote.nr_tasks;
+	if (!pr->opts) {
+		pr->opts = malloc(sizeof(remote));
+		if (!pr->opts)
+			die("ERROR: failed to alloc memory\n");
+	}
+	*pr->opts = remote;
 }
 
 static int passive_parent(uint32_t addr, uint16_t port,
 			  struct soak_control *soak_arr)
 {
-	struct options remote, *opts;
-	struct child_control *ctl;
-	struct sockaddr_in sin;
+	struct options combined, *opts = &combined;
+	struct child_control *ctl = NULL;
+	struct sockaddr_in sin, lsin;
 	socklen_t socklen;
-	int lfd, fd;
-	uint8_t ok;
-
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = htonl(addr);
+	struct peer *pr;
+	uint16_t nr_tasks, nr_pool = 0;
+	unsigned int c;
+	int lfd, fd, warm;
+	uint8_t ok[3];
 
-	lfd = bound_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sin);
+	lsin.sin_family = AF_INET;
+	lsin.sin_port = htons(port);
+	lsin.sin_addr.s_addr = htonl(addr);
 
-	printf("waiting for incoming connection on %s:%d\n", inet_ntoa(sin.sin_addr), port);
+	lfd = bound_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, &lsin);
 
 	if (listen(lfd, 255))
 		die_errno("listen() failed");
 
-	socklen = sizeof(sin);
+next_run:
+	printf("waiting for incoming connection on %s:%d\n", inet_ntoa(lsin.sin_addr), port);
+	fflush(stdout);
 
-	fd = accept(lfd, (struct sockaddr *)&sin, &socklen);
-	if (fd < 0)
-		die_errno("accept() failed");
-	control_fd = fd;
+	for (c = 0, nr_tasks = 0; c < nr_clients; c++) {
+		socklen = sizeof(sin);
 
-	/* Do not accept any further connections - we don't handle them
-	 * anyway. */
-	close(lfd);
+		fd = accept(lfd, (struct sockaddr *)&sin, &socklen);
+		if (fd < 0)
+			die_errno("accept() failed");
+
+		printf("accepted connection from %s:%u", inet_ntoa(sin.sin_addr),
+			ntohs(sin.sin_port));
+		if (addr == 0) {
+			/* Get our receive address - i.e. the address the peer connected to. */
+			addr = get_local_address(fd, &sin);
+			printf(" on %s:%u", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+		}
+		printf("\n");
 
-	printf("accepted connection from %s:%u", inet_ntoa(sin.sin_addr),
-		ntohs(sin.sin_port));
-	if (addr == 0) {
-		/* Get our receive address - i.e. the address the peer connected to. */
-		addr = get_local_address(control_fd, &sin);
-		printf(" on %s:%u", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+		add_peer(0);
+		pr = &peers[c];
+		pr->fd = fd;
+		client_options(pr, c, addr, nr_tasks);
+		nr_tasks += pr->nr_tasks;
 	}
-	printf("\n");
 
-	peer_recv(fd, &remote, sizeof(struct options));
-	decode_options(&remote, &remote);
-	opts = &remote;
+	/* Do not accept any further connections - we don't handle them
+	 * anyway. A daemon takes the next run once this one is done. */
+	if (!daemon_mode)
+		close(lfd);
 
+next_point:
 	/*
-	 * The sender gave us their send and receive addresses, we need
-	 * to swap them.
+	 * The parent runs with the first client's options, for all the
+	 * children, with room for everybody's messages.
 	 */
-	opts->send_addr = opts->receive_addr;
-	opts->receive_addr = addr;
+	*opts = *peers[0].opts;
+	opts->nr_tasks = nr_tasks;
+	for (c = 1; c < nr_clients; c++) {
+		opts->req_size = max(opts->req_size, peers[c].opts->req_size);
+		opts->ack_size = max(opts->ack_size, peers[c].opts->ack_size);
+	}
 	opt = *opts;
 
-	ctl = start_children(opts, 0);
+	/* With --matrix the client sends the options of its next point
+	 * once this one is done, for the same children if they fit */
+	keep_control = opts->matrix;
+	if (keep_control)
+		reuse_children = 1;
+
+	/* A daemon starts new children only if the last ones don't fit */
+	warm = ctl && pool_fits(ctl, nr_pool, opts);
+	if (warm) {
+		unpark_children(ctl, opts);
+	} else {
+		if (ctl)
+			retire_children(ctl, nr_pool);
+		ctl = start_children(opts, 0);
+		nr_pool = opts->nr_tasks;
+	}
+
+	/* Wait for "GO" from the initiating peers, and tell them where
+	 * their tasks are */
+	for (c = 0, pr = peers; c < nr_clients; c++, pr++) {
+		peer_recv(pr->fd, ok, 1);
+		ok[0] = 1;
+		ok[1] = (opts->starting_port + pr->first_task) >> 8;
+		ok[2] = opts->starting_port + pr->first_task;
+		peer_send(pr->fd, ok, sizeof(ok));
+	}
+	peer_hist_alloc();
+
+	printf("%u tasks ready in %.2f ms (%s)\n", opts->nr_tasks,
+	       startup_ns / 1e6, warm ? "reused" : "started");
+	printf("negotiated options\n");
+	release_children_and_wait(opts, ctl, soak_arr, 0, NULL);
+
+	/* a ctl-c ends a --daemon or a --matrix session too */
+	if (interrupted) {
+		close_control();
+		if (reuse_children) {
+			retire_children(ctl, nr_pool);
+			stop_soakers(soak_arr);
+		}
+		return 128 + SIGINT;
+	}
+
+	if (keep_control) {
+		if (matrix_next(peers[0].fd)) {
+			client_options(&peers[0], 0, addr, 0);
+			nr_tasks = peers[0].nr_tasks;
+			printf("\n");
+			goto next_point;
+		}
+		close_control();
+	}
 
-	/* Wait for "GO" from the initiating peer */
-	peer_recv(fd, &ok, sizeof(ok));
-	peer_send(fd, &ok, sizeof(ok));
+	if (daemon_mode) {
+		for (c = 0, pr = peers; c < nr_peers; c++, pr++) {
+			free(pr->opts);
+			free(pr->hist_first);
+			free(pr->hist_last);
+		}
+		free(peers);
+		peers = NULL;
+		nr_peers = 0;
+		printf("\n");
+		goto next_run;
+	}
 
-	printf("negotiated options, tasks will start in 2 seconds\n");
-	release_children_and_wait(opts, ctl, soak_arr, 0);
+	/* the children of the last point are parked */
+	if (reuse_children) {
+		retire_children(ctl, nr_pool);
+		stop_soakers(soak_arr);
+	}
 
 	return 0;
 }
@@ -2939,6 +7770,7 @@ struct soak_control *start_soakers(void)
 		if (pid == -1)
 			die_errno("forking soaker nr %lu failed", i);
 		if (pid == 0) {
+			signal(SIGINT, SIG_IGN);
 			run_soaker(parent, soak_arr + i);
 			exit(0);
 		}
@@ -2969,6 +7801,99 @@ void check_size(uint32_t size, uint32_t unspec, uint32_t max, char *desc,
 		die("%s must be at least %u bytes\n", desc, max);
 }
 
+/* every point of a matrix must make sense on its own */
+static void check_matrix(struct options *opts)
+{
+	struct axis *ax;
+	unsigned int k;
+
+	if (req_sizes.type == DIST_SWEEP)
+		die("option --matrix conflicts with --size-sweep\n");
+
+	for (ax = axes; ax < axes + nr_axes; ax++) {
+		if ((ax->what == AXIS_REQ_SIZE && opts->req_dist[0]) ||
+		    (ax->what == AXIS_ACK_SIZE && opts->ack_dist[0]))
+			die("matrix axis '%s' conflicts with its size distribution\n",
+			    axis_names[ax->what]);
+		for (k = 0; k < ax->nr; k++) {
+			switch (ax->what) {
+			case AXIS_REQ_SIZE:
+				check_size(ax->val[k], ~0, MIN_MSG_BYTES, "req size", "-q");
+				break;
+			case AXIS_ACK_SIZE:
+				check_size(ax->val[k], ~0, MIN_MSG_BYTES, "ack size", "-a");
+				break;
+			case AXIS_DEPTH:
+				if (ax->val[k] == 0)
+					die("matrix depths must be at least 1\n");
+				break;
+			case AXIS_TASKS:
+				if (ax->val[k] == 0 ||
+				    opts->starting_port + ax->val[k] * max(nr_peers, 1) > (uint16_t)~0)
+					die("%u tasks don't fit in the port range\n",
+					    ax->val[k]);
+				break;
+			}
+		}
+	}
+
+	matrix_points();
+	if (!opts->run_time)
+		opts->run_time = 5;
+}
+
+/* --search needs an SLO and a range that makes sense */
+static void check_search(struct options *opts)
+{
+	uint32_t max_tasks = ((uint16_t)~0 - opts->starting_port) /
+			     (nr_peers ? nr_peers : 1);
+
+	if (nr_axes)
+		die("option --search conflicts with --matrix\n");
+	if (req_sizes.type == DIST_SWEEP)
+		die("option --search conflicts with --size-sweep\n");
+	if (!slo_usecs)
+		die("option --search needs an --slo\n");
+
+	if (!search_hi) {
+		switch (search_what) {
+		case AXIS_RATE:
+			search_lo = 1000;
+			search_hi = 100000000;
+			break;
+		case AXIS_DEPTH:
+			search_lo = 1;
+			search_hi = 1024;
+			break;
+		case AXIS_TASKS:
+			search_lo = 1;
+			search_hi = min(max_tasks, 256);
+			break;
+		}
+	}
+	if (search_lo == 0 || search_lo > search_hi)
+		die("invalid search range %u:%u\n", search_lo, search_hi);
+	if (search_what == AXIS_TASKS && search_hi > max_tasks)
+		die("%u tasks don't fit in the port range\n", search_hi);
+
+	if (!opts->run_time)
+		opts->run_time = 5;
+}
+
+static void check_curve(struct options *opts)
+{
+	if (nr_axes || search_what >= 0)
+		die("option --curve conflicts with --matrix and --search\n");
+	if (req_sizes.type == DIST_SWEEP)
+		die("option --curve conflicts with --size-sweep\n");
+	if (opts->rate)
+		die("option --curve sets the --rate of each step\n");
+
+	curve_steps();
+	if (!opts->run_time)
+		opts->run_time = 5;
+}
+
 enum {
 	OPT_RDMA_USE_ONCE = 0x100,
 	OPT_RDMA_USE_GET_MR,
@@ -2985,6 +7910,39 @@ enum {
         OPT_SHOW_HISTOGRAM,
 	OPT_RESET,
 	OPT_ASYNC,
+	OPT_THREADS,
+	OPT_CPU_LIST,
+	OPT_PLACEMENT,
+	OPT_NUMA_NODE,
+	OPT_BATCH,
+	OPT_IO_URING,
+	OPT_POLL_MODE,
+	OPT_SPIN_BUDGET,
+	OPT_CLOCK,
+	OPT_HIST_DIGITS,
+	OPT_RATE,
+	OPT_ARRIVAL,
+	OPT_BACKLOG,
+	OPT_REQ_SIZES,
+	OPT_ACK_SIZES,
+	OPT_SIZE_SEED,
+	OPT_VERIFY_MODE,
+	OPT_VERIFY_SAMPLE,
+	OPT_SIZE_SWEEP,
+	OPT_SEND_IOV,
+	OPT_RECV_IOV,
+	OPT_PEERS,
+	OPT_CLIENTS,
+	OPT_DAEMON,
+	OPT_MATRIX,
+	OPT_MATRIX_FORMAT,
+	OPT_SEARCH,
+	OPT_SLO,
+	OPT_CURVE,
+	OPT_CURVE_DATA,
+	OPT_STEADY_CV,
+	OPT_WARMUP_MAX,
+	OPT_TASK_STATS,
 };
 
 static struct option long_options[] = {
@@ -3019,6 +7977,39 @@ static struct option long_options[] = {
 { "show-histogram",     no_argument,            NULL,   OPT_SHOW_HISTOGRAM   },
 { "reset",              no_argument,            NULL,   OPT_RESET },
 { "async",              no_argument,            NULL,   OPT_ASYNC },
+{ "threads",		no_argument,		NULL,	OPT_THREADS },
+{ "cpu-list",		required_argument,	NULL,	OPT_CPU_LIST },
+{ "placement",		required_argument,	NULL,	OPT_PLACEMENT },
+{ "numa-node",		required_argument,	NULL,	OPT_NUMA_NODE },
+{ "batch",		required_argument,	NULL,	OPT_BATCH },
+{ "io-uring",		required_argument,	NULL,	OPT_IO_URING },
+{ "poll-mode",		required_argument,	NULL,	OPT_POLL_MODE },
+{ "spin-budget",	required_argument,	NULL,	OPT_SPIN_BUDGET },
+{ "clock",		required_argument,	NULL,	OPT_CLOCK },
+{ "hist-digits",	required_argument,	NULL,	OPT_HIST_DIGITS },
+{ "rate",		required_argument,	NULL,	OPT_RATE },
+{ "arrival",		required_argument,	NULL,	OPT_ARRIVAL },
+{ "backlog",		required_argument,	NULL,	OPT_BACKLOG },
+{ "req-sizes",		required_argument,	NULL,	OPT_REQ_SIZES },
+{ "ack-sizes",		required_argument,	NULL,	OPT_ACK_SIZES },
+{ "size-seed",		required_argument,	NULL,	OPT_SIZE_SEED },
+{ "verify-mode",	required_argument,	NULL,	OPT_VERIFY_MODE },
+{ "verify-sample",	required_argument,	NULL,	OPT_VERIFY_SAMPLE },
+{ "size-sweep",		required_argument,	NULL,	OPT_SIZE_SWEEP },
+{ "send-iov",		required_argument,	NULL,	OPT_SEND_IOV },
+{ "recv-iov",		required_argument,	NULL,	OPT_RECV_IOV },
+{ "peers",		required_argument,	NULL,	OPT_PEERS },
+{ "clients",		required_argument,	NULL,	OPT_CLIENTS },
+{ "daemon",		no_argument,		NULL,	OPT_DAEMON },
+{ "matrix",		required_argument,	NULL,	OPT_MATRIX },
+{ "matrix-format",	required_argument,	NULL,	OPT_MATRIX_FORMAT },
+{ "search",		required_argument,	NULL,	OPT_SEARCH },
+{ "slo",		required_argument,	NULL,	OPT_SLO },
+{ "curve",		required_argument,	NULL,	OPT_CURVE },
+{ "curve-data",		required_argument,	NULL,	OPT_CURVE_DATA },
+{ "steady-cv",		required_argument,	NULL,	OPT_STEADY_CV },
+{ "warmup-max",		required_argument,	NULL,	OPT_WARMUP_MAX },
+{ "task-stats",		required_argument,	NULL,	OPT_TASK_STATS },
 { NULL }
 };
 
@@ -3071,7 +8062,26 @@ int main(int argc, char **argv)
         show_histogram = 0;
 	opts.tos = 0;
 	reset_connection = 0;
+	use_threads = 0;
+	batch_size = 0;
+	uring_depth = 0;
+	send_iov_nr = 1;
+	recv_iov_nr = 1;
+	nr_clients = 1;
+	poll_mode = POLL_BLOCK;
+	spin_budget = 50;
+	clock_source = CLOCK_SRC_MONOTONIC;
+	hist_digits = 2;
 	opts.async = 0;
+	opts.rate = 0;
+	opts.arrival = ARRIVAL_CONST;
+	opts.backlog = 1024;
+	memset(opts.req_dist, 0, DIST_SPEC_LEN);
+	memset(opts.ack_dist, 0, DIST_SPEC_LEN);
+	opts.verify_mode = VERIFY_PATTERN;
+	opts.verify_sample = 1;
+	opts.peer_port = 0;
+	opts.matrix = 0;
 	strcpy(opts.version, RDS_VERSION);
 
 	while(1) {
@@ -3154,6 +8164,158 @@ int main(int argc, char **argv)
 			case OPT_ASYNC:
 				opts.async = 1;
 				break;
+			case OPT_THREADS:
+				use_threads = 1;
+				break;
+			case OPT_CPU_LIST:
+				placement_cpus = optarg;
+				break;
+			case OPT_PLACEMENT:
+				for (placement = PLACE_HCA; placement > PLACE_NONE; placement--) {
+					if (!strcmp(optarg, placement_names[placement]))
+						break;
+				}
+				if (placement == PLACE_NONE)
+					die("invalid placement '%s'\n", optarg);
+				break;
+			case OPT_NUMA_NODE:
+				placement_node = parse_ull(optarg, MAX_NUMA_NODES - 1);
+				break;
+			case OPT_BATCH:
+				batch_size = parse_ull(optarg, MAX_BATCH);
+				break;
+			case OPT_IO_URING:
+				uring_depth = parse_ull(optarg, MAX_BATCH);
+				break;
+			case OPT_SEND_IOV:
+				send_iov_nr = parse_ull(optarg, MSG_MAXIOVLEN);
+				if (send_iov_nr == 0)
+					die("--send-iov must be at least 1\n");
+				break;
+			case OPT_RECV_IOV:
+				recv_iov_nr = parse_ull(optarg, MSG_MAXIOVLEN);
+				if (recv_iov_nr == 0)
+					die("--recv-iov must be at least 1\n");
+				break;
+			case OPT_PEERS:
+				parse_peers(optarg);
+				break;
+			case OPT_CLIENTS:
+				nr_clients = parse_ull(optarg, MAX_PEERS);
+				if (nr_clients == 0)
+					die("--clients must be at least 1\n");
+				break;
+			case OPT_DAEMON:
+				daemon_mode = 1;
+				reuse_children = 1;
+				break;
+			case OPT_MATRIX:
+				parse_matrix(optarg);
+				break;
+			case OPT_MATRIX_FORMAT:
+				if (!strcmp(optarg, "json"))
+					matrix_json = 1;
+				else if (strcmp(optarg, "csv"))
+					die("invalid matrix format '%s'\n", optarg);
+				break;
+			case OPT_SEARCH:
+				parse_search(optarg);
+				break;
+			case OPT_SLO:
+				parse_slo(optarg);
+				break;
+			case OPT_CURVE:
+				parse_curve(optarg);
+				break;
+			case OPT_CURVE_DATA:
+				curve_data = optarg;
+				break;
+			case OPT_STEADY_CV:
+				steady_cv = parse_ull(optarg, 100);
+				break;
+			case OPT_WARMUP_MAX:
+				warmup_max = parse_ull(optarg, 3600);
+				if (warmup_max == 0)
+					die("--warmup-max must be at least 1\n");
+				break;
+			case OPT_TASK_STATS:
+				task_stats = parse_ull(optarg, 65535);
+				if (task_stats == 0)
+					die("--task-stats must be at least 1\n");
+				break;
+			case OPT_POLL_MODE:
+				for (poll_mode = POLL_HYBRID; poll_mode > POLL_BLOCK; poll_mode--) {
+					if (!strcmp(optarg, poll_mode_names[poll_mode]))
+						break;
+				}
+				if (poll_mode == POLL_BLOCK && strcmp(optarg, poll_mode_names[POLL_BLOCK]))
+					die("invalid poll mode '%s'\n", optarg);
+				break;
+			case OPT_SPIN_BUDGET:
+				spin_budget = parse_ull(optarg, 10000000);
+				break;
+			case OPT_RATE:
+				opts.rate = parse_ull(optarg, (uint32_t)~0);
+				break;
+			case OPT_ARRIVAL:
+				for (opts.arrival = ARRIVAL_POISSON; opts.arrival > ARRIVAL_CONST; opts.arrival--) {
+					if (!strcmp(optarg, arrival_names[opts.arrival]))
+						break;
+				}
+				if (opts.arrival == ARRIVAL_CONST &&
+				    strcmp(optarg, arrival_names[ARRIVAL_CONST]))
+					die("invalid arrival process '%s'\n", optarg);
+				break;
+			case OPT_BACKLOG:
+				opts.backlog = parse_ull(optarg, (uint16_t)~0);
+				if (opts.backlog == 0)
+					die("the backlog needs room for at least one message\n");
+				break;
+			case OPT_REQ_SIZES:
+			case OPT_ACK_SIZES:
+				if (strlen(optarg) >= DIST_SPEC_LEN)
+					die("size spec '%s' is too long\n", optarg);
+				strcpy(c == OPT_REQ_SIZES ? opts.req_dist :
+				       opts.ack_dist, optarg);
+				break;
+			case OPT_SIZE_SWEEP:
+				if (strlen(optarg) + 6 >= DIST_SPEC_LEN)
+					die("size sweep '%s' is too long\n", optarg);
+				sprintf(opts.req_dist, "sweep:%s", optarg);
+				break;
+			case OPT_SIZE_SEED:
+				opts.size_seed = parse_ull(optarg, (uint32_t)~0 - 1);
+				break;
+			case OPT_VERIFY_MODE:
+				for (opts.verify_mode = VERIFY_UNIQUE; opts.verify_mode > VERIFY_PATTERN; opts.verify_mode--) {
+					if (!strcmp(optarg, verify_mode_names[opts.verify_mode]))
+						break;
+				}
+				if (opts.verify_mode == VERIFY_PATTERN &&
+				    strcmp(optarg, verify_mode_names[VERIFY_PATTERN]))
+					die("invalid verify mode '%s'\n", optarg);
+				opts.verify = 1;
+				break;
+			case OPT_VERIFY_SAMPLE:
+				opts.verify_sample = parse_ull(optarg, (uint32_t)~0);
+				if (opts.verify_sample == 0)
+					die("--verify-sample must be at least 1\n");
+				opts.verify = 1;
+				break;
+			case OPT_HIST_DIGITS:
+				hist_digits = parse_ull(optarg, 5);
+				if (hist_digits == 0)
+					die("--hist-digits must be between 1 and 5\n");
+				break;
+			case OPT_CLOCK:
+				for (clock_source = CLOCK_SRC_TSC; clock_source > CLOCK_SRC_MONOTONIC; clock_source--) {
+					if (!strcmp(optarg, clock_names[clock_source]))
+						break;
+				}
+				if (clock_source == CLOCK_SRC_MONOTONIC &&
+				    strcmp(optarg, clock_names[CLOCK_SRC_MONOTONIC]))
+					die("invalid clock '%s'\n", optarg);
+				break;
 			case OPT_RDMA_USE_ONCE:
 				opts.rdma_use_once = parse_ull(optarg, 1);
 				break;
@@ -3201,24 +8363,77 @@ int main(int argc, char **argv)
 	else if (opts.rdma_cache_mrs && !opts.rdma_use_get_mr)
 		die("option --rdma-cache-mrs conflicts with --rdma-use-get-mr=0\n");
 
+	if (clock_source == CLOCK_SRC_TSC)
+		calibrate_tsc();
+
+	if (nr_peers) {
+		if (opts.send_addr != ~0)
+			die("option -s conflicts with --peers\n");
+		opts.send_addr = peers[0].addr;
+	}
+
+	/* rr spreads the children over every node */
+	if (placement == PLACE_RR && placement_node >= 0)
+		die("option --placement rr conflicts with --numa-node\n");
+
+	if (nr_clients > 1 && use_threads)
+		die("option --clients conflicts with --threads\n");
+	if (nr_clients > 1 && opts.send_addr != ~0)
+		die("option --clients is only for the passive side\n");
+	if (daemon_mode && opts.send_addr != ~0)
+		die("option --daemon is only for the passive side\n");
+	if (nr_axes && opts.send_addr == ~0)
+		die("option --matrix is only for the active side\n");
+	if (search_what >= 0 && opts.send_addr == ~0)
+		die("option --search is only for the active side\n");
+	if (curve_hi && opts.send_addr == ~0)
+		die("option --curve is only for the active side\n");
+	if (slo_usecs && search_what < 0)
+		die("option --slo is only used by --search\n");
+
 	/* the passive parent will read options off the wire */
 	if (opts.send_addr == ~0)
 		return passive_parent(opts.receive_addr, opts.starting_port,
 				      soak_arr);
 
 	/* the active parent verifies and sends its options */
+	if (opts.req_dist[0]) {
+		parse_size_dist(&req_sizes, opts.req_dist, 0, "--req-sizes");
+		opts.req_size = req_sizes.max;
+		if (req_sizes.type == DIST_SWEEP && !opts.run_time)
+			opts.run_time = 5;
+	}
+	if (opts.ack_dist[0]) {
+		parse_size_dist(&ack_sizes, opts.ack_dist, 0, "--ack-sizes");
+		opts.ack_size = ack_sizes.max;
+	}
+	if (opts.size_seed == ~0)
+		opts.size_seed = getpid() ^ time(NULL);
 	check_size(opts.ack_size, ~0, MIN_MSG_BYTES, "ack size", "-a");
 	check_size(opts.req_size, ~0, MIN_MSG_BYTES, "req size", "-q");
 
 	/* defaults */
+	if (opts.rate && opts.req_depth != ~0)
+		die("-d doesn't apply to --rate, see --backlog\n");
 	if (opts.req_depth == ~0)
 		opts.req_depth = 1;
 	if (opts.nr_tasks == (uint16_t)~0)
 		opts.nr_tasks = 1;
+	if (nr_peers && (opts.nr_tasks * nr_peers > (uint16_t)~0 ||
+			 opts.starting_port + opts.nr_tasks * nr_peers > (uint16_t)~0))
+		die("%u tasks for each of %u peers don't fit in the port range\n",
+		    opts.nr_tasks, nr_peers);
 
 	if (opts.rdma_size && !check_rdma_support(&opts))
 		die("RDMA not supported by this kernel\n");
 
+	if (nr_axes)
+		check_matrix(&opts);
+	if (search_what >= 0)
+		check_search(&opts);
+	if (curve_hi)
+		check_curve(&opts);
+
 	/* We require RDMA to be multiples of the page size for now.
 	 * this is just to simplify debugging, but eventually we
 	 * need to support rdma sizes from 1 to 1meg byte
@@ -3226,6 +8441,7 @@ int main(int argc, char **argv)
 	if (opts.rdma_size && 0)
 		opts.rdma_size = (opts.rdma_size + 4095) & ~4095;
 
+	open_loop_depth(&opts);
 	opt = opts;
 	return active_parent(&opts, soak_arr);
 }